@@ -27,7 +27,6 @@
 #include <pcl/filters/extract_indices.h>
 
 #include <pcl/features/normal_3d.h>
-#include <pcl/features/normal_3d_omp.h>
 #include <pcl/features/integral_image_normal.h>
 
 #include <pcl/sample_consensus/method_types.h>
@@ -45,584 +44,8417 @@
 
 #include <pcl/common/transforms.h>
 
-#define FPS_CALC_BEGIN                          \
-    static double duration = 0;                 \
-    double start_time = pcl::getTime ();        \
-
-#define FPS_CALC_END(_WHAT_)                    \
-  {                                             \
-    double end_time = pcl::getTime ();          \
-    static unsigned count = 0;                  \
-    if (++count == 10)                          \
-    {                                           \
-      std::cout << "Average framerate("<< _WHAT_ << "): " << double(count)/double(duration) << " Hz" <<  std::endl; \
-      count = 0;                                                        \
-      duration = 0.0;                                                   \
-    }                                           \
-    else                                        \
-    {                                           \
-      duration += end_time - start_time;        \
-    }                                           \
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <boost/atomic.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Per-stage latency instrumentation.
+//
+// STAGE_TIMER ("name") measures the enclosing scope and STAGE_RECORD ("name",
+// value) records any other non-negative sample. Every thread records into its
+// own log-linear histograms without taking a lock; StageRegistry merges them
+// for the p50/p95/p99/max summary and the CSV/JSON export. Building with
+// SEGMENT_TRACKING_DISABLE_INSTRUMENTATION removes all recording.
+#define STAGE_CONCAT_IMPL(a, b) a##b
+#define STAGE_CONCAT(a, b) STAGE_CONCAT_IMPL(a, b)
+
+#ifndef SEGMENT_TRACKING_DISABLE_INSTRUMENTATION
+#define STAGE_TIMER(_NAME_)                                             \
+  static const int STAGE_CONCAT(stage_id_, __LINE__) = StageRegistry::instance ().getStageId (_NAME_); \
+  ScopedStageTimer STAGE_CONCAT(stage_timer_, __LINE__) (STAGE_CONCAT(stage_id_, __LINE__))
+#define STAGE_RECORD(_NAME_, _VALUE_) STAGE_RECORD_UNIT(_NAME_, "us", _VALUE_)
+#define STAGE_RECORD_UNIT(_NAME_, _UNIT_, _VALUE_)                      \
+  do                                                                    \
+  {                                                                     \
+    static const int stage_id = StageRegistry::instance ().getStageId (_NAME_, _UNIT_); \
+    StageRegistry::instance ().record (stage_id, _VALUE_);              \
+  } while (0)
+#else
+#define STAGE_TIMER(_NAME_)
+#define STAGE_RECORD(_NAME_, _VALUE_) do {} while (0)
+#define STAGE_RECORD_UNIT(_NAME_, _UNIT_, _VALUE_) do {} while (0)
+#endif
+
+inline uint64_t
+monotonicMicroseconds ()
+{
+  timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t> (ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Histogram with exact buckets below 64 and 32 sub-buckets per power of two
+// above, i.e. a relative error of about 3%. Only its owner thread writes to
+// it, so relaxed loads and stores are enough; readers may see a sample late
+// but never a torn value.
+class StageHistogram
+{
+public:
+  enum
+  {
+    LINEAR_BUCKETS = 64,
+    SUB_BUCKET_BITS = 5,
+    SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+    MIN_EXPONENT = 6,
+    MAX_EXPONENT = 40,
+    BUCKETS = LINEAR_BUCKETS + (MAX_EXPONENT - MIN_EXPONENT) * SUB_BUCKETS
+  };
+
+  StageHistogram ()
+  {
+    reset ();
+  }
+
+  void
+  record (uint64_t value)
+  {
+    const int bucket = bucketIndex (value);
+    buckets_[bucket].store (buckets_[bucket].load (boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+    count_.store (count_.load (boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+    sum_.store (sum_.load (boost::memory_order_relaxed) + value, boost::memory_order_relaxed);
+    if (value > max_.load (boost::memory_order_relaxed))
+      max_.store (value, boost::memory_order_relaxed);
+  }
+
+  void
+  reset ()
+  {
+    for (int i = 0; i < BUCKETS; i++)
+      buckets_[i].store (0, boost::memory_order_relaxed);
+    count_.store (0, boost::memory_order_relaxed);
+    sum_.store (0, boost::memory_order_relaxed);
+    max_.store (0, boost::memory_order_relaxed);
+  }
+
+  // adds this histogram to plain counters owned by the reader
+  void
+  accumulate (std::vector<uint64_t>& buckets, uint64_t& count, uint64_t& sum, uint64_t& max) const
+  {
+    for (int i = 0; i < BUCKETS; i++)
+      buckets[i] += buckets_[i].load (boost::memory_order_relaxed);
+    count += count_.load (boost::memory_order_relaxed);
+    sum += sum_.load (boost::memory_order_relaxed);
+    max = std::max (max, max_.load (boost::memory_order_relaxed));
+  }
+
+  static int
+  bucketIndex (uint64_t value)
+  {
+    if (value < LINEAR_BUCKETS)
+      return static_cast<int> (value);
+    int exponent = 63 - __builtin_clzll (value);
+    if (exponent >= MAX_EXPONENT)
+      return BUCKETS - 1;
+    const int sub_bucket = static_cast<int> (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return LINEAR_BUCKETS + (exponent - MIN_EXPONENT) * SUB_BUCKETS + sub_bucket;
+  }
+
+  // midpoint of the values that fall into the bucket
+  static uint64_t
+  bucketValue (int bucket)
+  {
+    if (bucket < LINEAR_BUCKETS)
+      return bucket;
+    const int exponent = MIN_EXPONENT + (bucket - LINEAR_BUCKETS) / SUB_BUCKETS;
+    const uint64_t sub_bucket = (bucket - LINEAR_BUCKETS) % SUB_BUCKETS;
+    const uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return ((SUB_BUCKETS + sub_bucket) << (exponent - SUB_BUCKET_BITS)) + width / 2;
+  }
+
+private:
+  boost::atomic<uint32_t> buckets_[BUCKETS];
+  boost::atomic<uint64_t> count_;
+  boost::atomic<uint64_t> sum_;
+  boost::atomic<uint64_t> max_;
+};
+
+// Process-wide table of named stages and of the histograms of every thread
+// that recorded into them. Stage ids are handed out once per call site, the
+// recording path itself never locks.
+class StageRegistry
+{
+public:
+  enum { MAX_STAGES = 64 };
+
+  struct Summary
+  {
+    std::string name;
+    std::string unit;
+    uint64_t count;
+    double mean;
+    uint64_t p50, p95, p99, max;
+  };
+
+  static StageRegistry&
+  instance ()
+  {
+    static StageRegistry registry;
+    return registry;
+  }
+
+  // unit only labels the export, timers always record microseconds
+  int
+  getStageId (const std::string& name, const std::string& unit = "us")
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    for (size_t i = 0; i < names_.size (); i++)
+      if (names_[i] == name)
+        return static_cast<int> (i);
+    if (names_.size () == MAX_STAGES)
+    {
+      PCL_WARN ("too many instrumented stages, %s shares the last one\n", name.c_str ());
+      return MAX_STAGES - 1;
+    }
+    names_.push_back (name);
+    units_.push_back (unit);
+    return static_cast<int> (names_.size () - 1);
+  }
+
+  void
+  record (int stage, uint64_t value)
+  {
+    ThreadRecorder* recorder = local_.get ();
+    if (!recorder)
+      recorder = registerThread ();
+    recorder->stages[stage].record (value);
+  }
+
+  // only exact while no stage is recording
+  void
+  reset ()
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    for (size_t i = 0; i < recorders_.size (); i++)
+      for (int j = 0; j < MAX_STAGES; j++)
+        recorders_[i]->stages[j].reset ();
+  }
+
+  std::vector<Summary>
+  summarize ()
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    std::vector<Summary> summaries;
+    std::vector<uint64_t> buckets (StageHistogram::BUCKETS);
+    for (size_t i = 0; i < names_.size (); i++)
+    {
+      Summary summary;
+      summary.name = names_[i];
+      summary.unit = units_[i];
+      std::fill (buckets.begin (), buckets.end (), 0);
+      uint64_t sum = 0;
+      summary.count = summary.max = 0;
+      for (size_t j = 0; j < recorders_.size (); j++)
+        recorders_[j]->stages[i].accumulate (buckets, summary.count, sum, summary.max);
+      if (summary.count == 0)
+        continue;
+      summary.mean = static_cast<double> (sum) / static_cast<double> (summary.count);
+      summary.p50 = percentile (buckets, summary.count, 0.50);
+      summary.p95 = percentile (buckets, summary.count, 0.95);
+      summary.p99 = percentile (buckets, summary.count, 0.99);
+      summaries.push_back (summary);
+    }
+    return summaries;
+  }
+
+  void
+  print (std::ostream& os)
+  {
+    std::vector<Summary> summaries = summarize ();
+    os << "stage                        unit     count         mean          p50          p95          p99          max" << std::endl;
+    for (size_t i = 0; i < summaries.size (); i++)
+    {
+      const Summary& s = summaries[i];
+      char line[256];
+      snprintf (line, sizeof (line), "%-28s %-5s %8llu %12.1f %12llu %12llu %12llu %12llu",
+                s.name.c_str (), s.unit.c_str (), static_cast<unsigned long long> (s.count), s.mean,
+                static_cast<unsigned long long> (s.p50), static_cast<unsigned long long> (s.p95),
+                static_cast<unsigned long long> (s.p99), static_cast<unsigned long long> (s.max));
+      os << line << std::endl;
+    }
+  }
+
+  // writes JSON if path ends with .json, CSV otherwise
+  bool
+  exportFile (const std::string& path)
+  {
+    std::vector<Summary> summaries = summarize ();
+    std::ofstream ofs (path.c_str ());
+    if (!ofs)
+    {
+      PCL_ERROR ("failed to open %s\n", path.c_str ());
+      return false;
+    }
+    const bool json = path.size () >= 5 && path.compare (path.size () - 5, 5, ".json") == 0;
+    if (json)
+      ofs << "{\n  \"stages\": [\n";
+    else
+      ofs << "stage,unit,count,mean,p50,p95,p99,max\n";
+    for (size_t i = 0; i < summaries.size (); i++)
+    {
+      const Summary& s = summaries[i];
+      if (json)
+        ofs << "    {\"stage\": \"" << s.name << "\", \"unit\": \"" << s.unit << "\", \"count\": " << s.count
+            << ", \"mean\": " << s.mean << ", \"p50\": " << s.p50 << ", \"p95\": " << s.p95
+            << ", \"p99\": " << s.p99 << ", \"max\": " << s.max << "}"
+            << (i + 1 < summaries.size () ? ",\n" : "\n");
+      else
+        ofs << s.name << "," << s.unit << "," << s.count << "," << s.mean << "," << s.p50 << ","
+            << s.p95 << "," << s.p99 << "," << s.max << "\n";
+    }
+    if (json)
+      ofs << "  ]\n}\n";
+    return true;
+  }
+
+private:
+  struct ThreadRecorder
+  {
+    StageHistogram stages[MAX_STAGES];
+  };
+
+  // recorders outlive their threads so that their samples stay in the summary
+  static void
+  keepRecorder (ThreadRecorder*)
+  {
+  }
+
+  StageRegistry () : local_ (&StageRegistry::keepRecorder) {}
+
+  ThreadRecorder*
+  registerThread ()
+  {
+    boost::shared_ptr<ThreadRecorder> recorder (new ThreadRecorder);
+    {
+      boost::mutex::scoped_lock lock (mtx_);
+      recorders_.push_back (recorder);
+    }
+    local_.reset (recorder.get ());
+    return recorder.get ();
+  }
+
+  static uint64_t
+  percentile (const std::vector<uint64_t>& buckets, uint64_t count, double q)
+  {
+    const uint64_t rank = static_cast<uint64_t> (std::ceil (q * static_cast<double> (count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size (); i++)
+    {
+      seen += buckets[i];
+      if (seen >= rank && buckets[i] > 0)
+        return StageHistogram::bucketValue (static_cast<int> (i));
+    }
+    return 0;
+  }
+
+  boost::mutex mtx_;
+  std::vector<std::string> names_;
+  std::vector<std::string> units_;
+  std::vector<boost::shared_ptr<ThreadRecorder> > recorders_;
+  boost::thread_specific_ptr<ThreadRecorder> local_;
+};
+
+class ScopedStageTimer
+{
+public:
+  explicit ScopedStageTimer (int stage)
+  : stage_ (stage)
+  , start_ (monotonicMicroseconds ())
+  {
+  }
+
+  ~ScopedStageTimer ()
+  {
+    StageRegistry::instance ().record (stage_, monotonicMicroseconds () - start_);
+  }
+
+private:
+  int stage_;
+  uint64_t start_;
+};
+
+// set from the SIGUSR1 handler, polled by run ()
+static volatile sig_atomic_t statistics_dump_requested = 0;
+
+void
+requestStatisticsDump (int)
+{
+  statistics_dump_requested = 1;
+}
+
+// set from the SIGINT and SIGTERM handler of a headless run (), polled by it
+static volatile sig_atomic_t stop_requested = 0;
+
+void
+requestStop (int)
+{
+  stop_requested = 1;
+}
+
+// Plays a sequence of frames through the same signal as pcl::OpenNIGrabber,
+// so that the tracking pipeline can run without a device. With
+// frames_per_second <= 0 the frames are emitted back to back, each one as
+// soon as the callbacks of the previous one have returned. Subclasses
+// provide the frames and number them by their index in the sequence.
+class ReplayGrabber : public pcl::Grabber
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+  typedef void (sig_cb_replay_point_cloud_rgb) (const Cloud::ConstPtr&);
+  // fires when the replay ends or is stopped
+  typedef void (sig_cb_replay_finished) ();
+
+  ReplayGrabber (float frames_per_second, bool repeat)
+  : frames_per_second_ (frames_per_second)
+  , repeat_ (repeat)
+  , running_ (false)
+  , frame_count_ (0)
+  {
+    cloud_signal_ = createSignal<sig_cb_replay_point_cloud_rgb> ();
+    finished_signal_ = createSignal<sig_cb_replay_finished> ();
+  }
+
+  // subclasses stop the replay in their destructor, before their frames go
+  virtual
+  ~ReplayGrabber ()
+  {
+    stop ();
+  }
+
+  virtual void
+  start ()
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    if (running_)
+      return;
+    running_ = true;
+    frame_count_ = 0;
+    thread_ = boost::thread (&ReplayGrabber::publishLoop, this);
+  }
+
+  virtual void
+  stop ()
+  {
+    {
+      boost::mutex::scoped_lock lock (mtx_);
+      running_ = false;
+    }
+    if (thread_.joinable ())
+      thread_.join ();
+  }
+
+  virtual bool
+  isRunning () const
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    return running_;
+  }
+
+  virtual float
+  getFramesPerSecond () const
+  {
+    return frames_per_second_;
+  }
+
+  // blocks until the last frame has been published (never returns for a
+  // repeating replay with frames unless stop () is called from another
+  // thread)
+  void
+  waitUntilFinished ()
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    while (running_)
+      finished_cond_.wait (lock);
+  }
+
+  size_t
+  getFrameCount () const
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    return frame_count_;
+  }
+
+protected:
+  virtual size_t
+  getFrameNum () const = 0;
+
+  // frame i, or none to skip it; called on the replay thread only
+  virtual Cloud::ConstPtr
+  getFrame (size_t i) = 0;
+
+  void
+  publishLoop ()
+  {
+    const double period = frames_per_second_ > 0.0f ? 1.0 / frames_per_second_ : 0.0;
+    double next_time = pcl::getTime ();
+    // a pass without a single frame ends a repeating replay instead of
+    // starting the next pass right away
+    bool published = false;
+    do
+    {
+      published = false;
+      for (size_t i = 0; i < getFrameNum () && isRunning (); i++)
+      {
+        Cloud::ConstPtr cloud = getFrame (i);
+        if (!cloud)
+          continue;
+        if (period > 0.0)
+        {
+          next_time += period;
+          const double wait = next_time - pcl::getTime ();
+          if (wait > 0.0)
+            boost::this_thread::sleep (boost::posix_time::microseconds (static_cast<int64_t> (wait * 1e6)));
+        }
+        (*cloud_signal_) (cloud);
+        published = true;
+        boost::mutex::scoped_lock lock (mtx_);
+        ++frame_count_;
+      }
+    } while (repeat_ && published && isRunning ());
+    {
+      boost::mutex::scoped_lock lock (mtx_);
+      running_ = false;
+      finished_cond_.notify_all ();
+    }
+    (*finished_signal_) ();
+  }
+
+  float frames_per_second_;
+  bool repeat_;
+  boost::signals2::signal<sig_cb_replay_point_cloud_rgb>* cloud_signal_;
+  boost::signals2::signal<sig_cb_replay_finished>* finished_signal_;
+  boost::thread thread_;
+  mutable boost::mutex mtx_;
+  boost::condition_variable finished_cond_;
+  bool running_;
+  size_t frame_count_;
+};
+
+// Replays a sequence of PCD files.
+class PCDReplayGrabber : public ReplayGrabber
+{
+public:
+  PCDReplayGrabber (const std::vector<std::string>& pcd_files, float frames_per_second, bool repeat)
+  : ReplayGrabber (frames_per_second, repeat)
+  , pcd_files_ (pcd_files)
+  {
+  }
+
+  virtual
+  ~PCDReplayGrabber ()
+  {
+    stop ();
+  }
+
+  // reads every frame into memory up front, so that a benchmark does not
+  // measure the disk
+  bool
+  preload ()
+  {
+    frames_.resize (pcd_files_.size ());
+    for (size_t i = 0; i < pcd_files_.size (); i++)
+    {
+      frames_[i] = loadFrame (i);
+      if (!frames_[i])
+        return false;
+    }
+    return true;
+  }
+
+  virtual std::string
+  getName () const
+  {
+    return std::string ("PCDReplayGrabber");
+  }
+
+  static std::vector<std::string>
+  listPCDFiles (const std::string& directory)
+  {
+    std::vector<std::string> files;
+    boost::filesystem::path dir (directory);
+    if (!boost::filesystem::is_directory (dir))
+    {
+      PCL_ERROR ("%s is not a directory\n", directory.c_str ());
+      return files;
+    }
+    for (boost::filesystem::directory_iterator it (dir); it != boost::filesystem::directory_iterator (); ++it)
+    {
+      if (boost::filesystem::is_regular_file (it->status ()) && it->path ().extension () == ".pcd")
+        files.push_back (it->path ().string ());
+    }
+    std::sort (files.begin (), files.end ());
+    return files;
+  }
+
+protected:
+  virtual size_t
+  getFrameNum () const
+  {
+    return pcd_files_.size ();
+  }
+
+  virtual Cloud::ConstPtr
+  getFrame (size_t i)
+  {
+    return frames_.empty () ? loadFrame (i) : frames_[i];
+  }
+
+  Cloud::ConstPtr
+  loadFrame (size_t i)
+  {
+    Cloud::Ptr cloud (new Cloud);
+    if (pcl::io::loadPCDFile (pcd_files_[i], *cloud) < 0)
+    {
+      PCL_ERROR ("failed to read %s\n", pcd_files_[i].c_str ());
+      return Cloud::ConstPtr ();
+    }
+    cloud->header.seq = static_cast<uint32_t> (i);
+    return cloud;
+  }
+
+  std::vector<std::string> pcd_files_;
+  std::vector<Cloud::ConstPtr> frames_;
+};
+
+// Pinhole model of the sensor behind an organized cloud. The defaults are the
+// Kinect VGA values, scaled for the other OpenNI resolutions; fit () measures
+// the actual ones of a cloud.
+struct CameraIntrinsics
+{
+  CameraIntrinsics ()
+  : focal_length (525.0f)
+  , center_x (319.5f)
+  , center_y (239.5f)
+  {
+  }
+
+  static CameraIntrinsics
+  forResolution (unsigned width, unsigned height)
+  {
+    CameraIntrinsics intrinsics;
+    const float scale = static_cast<float> (width) / 640.0f;
+    intrinsics.focal_length *= scale;
+    intrinsics.center_x = (static_cast<float> (width) - 1.0f) / 2.0f;
+    intrinsics.center_y = (static_cast<float> (height) - 1.0f) / 2.0f;
+    return intrinsics;
+  }
+
+  // least squares fit of u = f x / z + c_x and v = f y / z + c_y over every
+  // step-th pixel of an organized cloud in both directions; false if there
+  // are too few valid pixels or they do not follow a pinhole model to within
+  // a pixel
+  template <typename PointT> static bool
+  fit (const pcl::PointCloud<PointT> &cloud, CameraIntrinsics &intrinsics, unsigned step = 4)
+  {
+    if (!cloud.isOrganized ())
+      return (false);
+    // sums of a = x / z, b = y / z, u, v and their products
+    double n = 0.0, sa = 0.0, sb = 0.0, su = 0.0, sv = 0.0, saa_bb = 0.0, sau_bv = 0.0;
+    for (unsigned v = 0; v < cloud.height; v += step)
+      for (unsigned u = 0; u < cloud.width; u += step)
+      {
+        const PointT& p = cloud.points[v * cloud.width + u];
+        if (!pcl_isfinite (p.z) || !(p.z > 0.0f) || !pcl_isfinite (p.x) || !pcl_isfinite (p.y))
+          continue;
+        const double a = p.x / p.z, b = p.y / p.z;
+        n += 1.0;
+        sa += a;
+        sb += b;
+        su += u;
+        sv += v;
+        saa_bb += a * a + b * b;
+        sau_bv += a * u + b * v;
+      }
+    if (n < 100.0)
+      return (false);
+    // the normal equations in (f, c_x, c_y), with c_x and c_y eliminated
+    const double spread = saa_bb - (sa * sa + sb * sb) / n;
+    if (!(spread > 1e-6 * n))
+      return (false);
+    const double f = (sau_bv - (sa * su + sb * sv) / n) / spread;
+    const double cx = (su - f * sa) / n, cy = (sv - f * sb) / n;
+    if (!(f > 0.0))
+      return (false);
+    double squared_error = 0.0;
+    for (unsigned v = 0; v < cloud.height; v += step)
+      for (unsigned u = 0; u < cloud.width; u += step)
+      {
+        const PointT& p = cloud.points[v * cloud.width + u];
+        if (!pcl_isfinite (p.z) || !(p.z > 0.0f) || !pcl_isfinite (p.x) || !pcl_isfinite (p.y))
+          continue;
+        const double du = f * p.x / p.z + cx - u, dv = f * p.y / p.z + cy - v;
+        squared_error += du * du + dv * dv;
+      }
+    if (squared_error > n)
+      return (false);
+    intrinsics.focal_length = static_cast<float> (f);
+    intrinsics.center_x = static_cast<float> (cx);
+    intrinsics.center_y = static_cast<float> (cy);
+    return (true);
+  }
+
+  float focal_length;
+  float center_x;
+  float center_y;
+};
+
+// Open addressing table from integer voxel coordinates to dense slot
+// numbers 0, 1, 2, ... in insertion order. The table is sized once and
+// cleared in O(1) by advancing an epoch, so it never allocates per frame.
+class VoxelHashTable
+{
+public:
+  VoxelHashTable ()
+  : mask_ (0)
+  , epoch_ (0)
+  , size_ (0)
+  , max_size_ (0)
+  {
+  }
+
+  // reserves room for max_voxels entries at a load factor of at most 1/2
+  void
+  reserve (size_t max_voxels)
+  {
+    if (max_voxels <= max_size_)
+      return;
+    size_t capacity = 1;
+    while (capacity < 2 * max_voxels)
+      capacity <<= 1;
+    slots_.assign (capacity, Slot ());
+    mask_ = capacity - 1;
+    max_size_ = max_voxels;
+    epoch_ = 1;
+    size_ = 0;
+  }
+
+  void
+  clear ()
+  {
+    size_ = 0;
+    if (++epoch_ == 0)
+    {
+      std::fill (slots_.begin (), slots_.end (), Slot ());
+      epoch_ = 1;
+    }
+  }
+
+  // returns the slot of voxel (i, j, k), or -1 when max_voxels are in use
+  int
+  findOrInsert (int i, int j, int k)
+  {
+    const uint64_t key = packKey (i, j, k);
+    size_t bucket = static_cast<size_t> (hash (key)) & mask_;
+    while (true)
+    {
+      Slot& slot = slots_[bucket];
+      if (slot.epoch != epoch_)
+      {
+        if (size_ == max_size_)
+          return -1;
+        slot.key = key;
+        slot.epoch = epoch_;
+        slot.index = static_cast<int> (size_++);
+        return slot.index;
+      }
+      if (slot.key == key)
+        return slot.index;
+      bucket = (bucket + 1) & mask_;
+    }
+  }
+
+  // returns the slot of voxel (i, j, k), or -1 when it was not inserted
+  int
+  find (int i, int j, int k) const
+  {
+    const uint64_t key = packKey (i, j, k);
+    size_t bucket = static_cast<size_t> (hash (key)) & mask_;
+    while (true)
+    {
+      const Slot& slot = slots_[bucket];
+      if (slot.epoch != epoch_)
+        return -1;
+      if (slot.key == key)
+        return slot.index;
+      bucket = (bucket + 1) & mask_;
+    }
+  }
+
+  size_t
+  size () const
+  {
+    return size_;
+  }
+
+  static uint64_t
+  packKey (int i, int j, int k)
+  {
+    const uint64_t bias = 1 << 20;
+    return ((static_cast<uint64_t> (i + bias) & 0x1fffff) |
+            ((static_cast<uint64_t> (j + bias) & 0x1fffff) << 21) |
+            ((static_cast<uint64_t> (k + bias) & 0x1fffff) << 42));
+  }
+
+  // 64 bit finalizer of MurmurHash3
+  static uint64_t
+  hash (uint64_t key)
+  {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+private:
+  struct Slot
+  {
+    Slot () : key (0), epoch (0), index (-1) {}
+    uint64_t key;
+    uint32_t epoch;
+    int32_t index;
+  };
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  uint32_t epoch_;
+  size_t size_;
+  size_t max_size_;
+};
+
+// pcl::search::Search over a VoxelHashTable of cubic cells as wide as the
+// search radius. Building it is one hashing pass and a counting sort of the
+// cloud instead of a tree, and a nearest query probes the cell of the query
+// point and those of its 26 neighbors that are closer than the nearest point
+// found so far. Only points within the radius are found: nearestKSearch
+// reports the missing neighbors as index -1 at the largest float distance,
+// which a NearestPairPointCloudCoherence with the radius as maximum distance
+// skips.
+template <typename PointT>
+class VoxelHashSearch : public pcl::search::Search<PointT>
+{
+public:
+  typedef boost::shared_ptr<VoxelHashSearch<PointT> > Ptr;
+  typedef typename pcl::search::Search<PointT>::PointCloudConstPtr PointCloudConstPtr;
+  typedef typename pcl::search::Search<PointT>::IndicesConstPtr IndicesConstPtr;
+
+  VoxelHashSearch (float radius)
+  : pcl::search::Search<PointT> ("VoxelHashSearch", true)
+  , radius_ (radius)
+  , inverse_cell_size_ (1.0f / radius)
+  {
+  }
+
+  float
+  getRadius () const
+  {
+    return (radius_);
+  }
+
+  virtual void
+  setInputCloud (const PointCloudConstPtr &cloud, const IndicesConstPtr &indices = IndicesConstPtr ())
+  {
+    this->input_ = cloud;
+    this->indices_ = indices;
+    const size_t size = indices ? indices->size () : cloud->points.size ();
+    cells_.reserve (size);
+    cells_.clear ();
+    cell_of_.resize (size);
+    cell_start_.clear ();
+    for (size_t i = 0; i < size; i++)
+    {
+      const PointT& p = cloud->points[indices ? (*indices)[i] : i];
+      int slot = -1;
+      if (pcl_isfinite (p.x) && pcl_isfinite (p.y) && pcl_isfinite (p.z))
+        slot = cells_.findOrInsert (cell (p.x), cell (p.y), cell (p.z));
+      cell_of_[i] = slot;
+      if (slot < 0)
+        continue;
+      if (static_cast<size_t> (slot) == cell_start_.size ())
+        cell_start_.push_back (0);
+      ++cell_start_[slot];
+    }
+    // counts to the start of every cell in points_
+    size_t start = 0;
+    for (size_t c = 0; c < cell_start_.size (); c++)
+    {
+      const size_t count = cell_start_[c];
+      cell_start_[c] = static_cast<int> (start);
+      start += count;
+    }
+    cell_start_.push_back (static_cast<int> (start));
+    points_.resize (start);
+    std::vector<int> fill (cell_start_.begin (), cell_start_.end () - 1);
+    for (size_t i = 0; i < size; i++)
+    {
+      if (cell_of_[i] < 0)
+        continue;
+      const int index = indices ? (*indices)[i] : static_cast<int> (i);
+      const PointT& p = cloud->points[index];
+      CellPoint& entry = points_[fill[cell_of_[i]]++];
+      entry.x = p.x;
+      entry.y = p.y;
+      entry.z = p.z;
+      entry.index = index;
+    }
+  }
+
+  virtual int
+  nearestKSearch (const PointT &point, int k, std::vector<int> &k_indices, std::vector<float> &k_sqr_distances) const
+  {
+    std::vector<std::pair<float, int> > candidates;
+    collect (point.x, point.y, point.z, radius_, candidates);
+    const size_t found = std::min (candidates.size (), static_cast<size_t> (std::max (k, 0)));
+    std::partial_sort (candidates.begin (), candidates.begin () + found, candidates.end ());
+    k_indices.assign (k, -1);
+    k_sqr_distances.assign (k, std::numeric_limits<float>::max ());
+    for (size_t i = 0; i < found; i++)
+    {
+      k_sqr_distances[i] = candidates[i].first;
+      k_indices[i] = candidates[i].second;
+    }
+    return (static_cast<int> (found));
+  }
+
+  virtual int
+  radiusSearch (const PointT &point, double radius, std::vector<int> &k_indices, std::vector<float> &k_sqr_distances,
+                unsigned int max_nn = 0) const
+  {
+    std::vector<std::pair<float, int> > candidates;
+    collect (point.x, point.y, point.z, static_cast<float> (radius), candidates);
+    size_t found = candidates.size ();
+    if (max_nn > 0 && found > max_nn)
+    {
+      found = max_nn;
+      std::partial_sort (candidates.begin (), candidates.begin () + found, candidates.end ());
+    }
+    else if (this->sorted_results_)
+      std::sort (candidates.begin (), candidates.end ());
+    k_indices.resize (found);
+    k_sqr_distances.resize (found);
+    for (size_t i = 0; i < found; i++)
+    {
+      k_sqr_distances[i] = candidates[i].first;
+      k_indices[i] = candidates[i].second;
+    }
+    return (static_cast<int> (found));
+  }
+
+  // index of the nearest point within the radius of each of count query
+  // points, or -1, without the per query vectors of the Search interface
+  void
+  findNearest (const float* x, const float* y, const float* z, size_t count, int* nearest) const
+  {
+    for (size_t i = 0; i < count; i++)
+      nearest[i] = findNearest (x[i], y[i], z[i]);
+  }
+
+  int
+  findNearest (float x, float y, float z) const
+  {
+    if (points_.empty ())
+      return (-1);
+    const float fx = x * inverse_cell_size_, fy = y * inverse_cell_size_, fz = z * inverse_cell_size_;
+    const int i = static_cast<int> (floorf (fx)), j = static_cast<int> (floorf (fy)), k = static_cast<int> (floorf (fz));
+    // the cell of the query first, then the neighbors closer than the
+    // nearest point found there, from the squared distances to the lower
+    // and upper neighbor cells along each axis
+    const float cell_size2 = radius_ * radius_;
+    float best = cell_size2;
+    int nearest = -1;
+    scanCell (i, j, k, x, y, z, best, nearest);
+    const float lower[3] = { fx - i, fy - j, fz - k };
+    float reach[3][3];
+    int low[3], high[3];
+    for (int a = 0; a < 3; a++)
+    {
+      reach[a][0] = lower[a] * lower[a] * cell_size2;
+      reach[a][1] = 0.0f;
+      reach[a][2] = (1.0f - lower[a]) * (1.0f - lower[a]) * cell_size2;
+      low[a] = reach[a][0] <= best ? -1 : 0;
+      high[a] = reach[a][2] <= best ? 1 : 0;
+    }
+    for (int dk = low[2]; dk <= high[2]; dk++)
+      for (int dj = low[1]; dj <= high[1]; dj++)
+        for (int di = low[0]; di <= high[0]; di++)
+          if ((di != 0 || dj != 0 || dk != 0) && reach[0][di + 1] + reach[1][dj + 1] + reach[2][dk + 1] <= best)
+            scanCell (i + di, j + dj, k + dk, x, y, z, best, nearest);
+    return (nearest);
+  }
+
+protected:
+  struct CellPoint
+  {
+    float x, y, z;
+    int index;
+  };
+
+  int
+  cell (float v) const
+  {
+    return (static_cast<int> (floorf (v * inverse_cell_size_)));
+  }
+
+  // moves nearest to a point of cell (i, j, k) closer than best
+  void
+  scanCell (int i, int j, int k, float x, float y, float z, float &best, int &nearest) const
+  {
+    const int slot = cells_.find (i, j, k);
+    if (slot < 0)
+      return;
+    for (int p = cell_start_[slot]; p < cell_start_[slot + 1]; p++)
+    {
+      const CellPoint& c = points_[p];
+      const float d2 = (c.x - x) * (c.x - x) + (c.y - y) * (c.y - y) + (c.z - z) * (c.z - z);
+      if (d2 <= best)
+      {
+        best = d2;
+        nearest = c.index;
+      }
+    }
+  }
+
+  // (squared distance, index) of every point within radius
+  void
+  collect (float x, float y, float z, float radius, std::vector<std::pair<float, int> > &candidates) const
+  {
+    candidates.clear ();
+    if (points_.empty ())
+      return;
+    const int reach = static_cast<int> (ceilf (radius * inverse_cell_size_));
+    const int i = cell (x), j = cell (y), k = cell (z);
+    const float radius2 = radius * radius;
+    for (int dk = -reach; dk <= reach; dk++)
+      for (int dj = -reach; dj <= reach; dj++)
+        for (int di = -reach; di <= reach; di++)
+        {
+          const int slot = cells_.find (i + di, j + dj, k + dk);
+          if (slot < 0)
+            continue;
+          for (int p = cell_start_[slot]; p < cell_start_[slot + 1]; p++)
+          {
+            const CellPoint& c = points_[p];
+            const float d2 = (c.x - x) * (c.x - x) + (c.y - y) * (c.y - y) + (c.z - z) * (c.z - z);
+            if (d2 <= radius2)
+              candidates.push_back (std::make_pair (d2, c.index));
+          }
+        }
+  }
+
+  float radius_;
+  float inverse_cell_size_;
+  VoxelHashTable cells_;
+  // cell of every input point, and the points sorted by cell
+  std::vector<int> cell_of_;
+  std::vector<int> cell_start_;
+  std::vector<CellPoint> points_;
+};
+
+// Small set of clouds that are recycled frame after frame. acquire () hands
+// out a cloud that nobody else references anymore, so the points keep the
+// capacity of their high-water mark and a steady stream of frames does not
+// allocate. Two slots double-buffer a sequential pipeline (one cloud held by
+// the consumer, one being written); more slots cover frames in flight between
+// pipeline stages. When every slot is still held a fresh cloud is returned and
+// counted as an overflow.
+template <typename PointT>
+class FrameStore
+{
+public:
+  typedef pcl::PointCloud<PointT> CloudT;
+  typedef typename CloudT::Ptr CloudPtr;
+
+  explicit FrameStore (size_t slots = 2)
+  : next_ (0)
+  , overflows_ (0)
+  {
+    setSlotNum (slots);
+  }
+
+  void
+  setSlotNum (size_t slots)
+  {
+    slots_.resize (std::max<size_t> (slots, 1));
+    for (size_t i = 0; i < slots_.size (); i++)
+      if (!slots_[i])
+        slots_[i].reset (new CloudT);
+  }
+
+  // returns an unorganized cloud of exactly size points, their contents are
+  // left over from an earlier frame
+  CloudPtr
+  acquire (size_t size)
+  {
+    CloudPtr cloud;
+    for (size_t i = 0; i < slots_.size () && !cloud; i++)
+    {
+      const size_t slot = (next_ + i) % slots_.size ();
+      if (slots_[slot].unique ())
+      {
+        cloud = slots_[slot];
+        next_ = slot + 1;
+      }
+    }
+    if (!cloud)
+    {
+      cloud.reset (new CloudT);
+      ++overflows_;
+    }
+    cloud->points.resize (size);
+    cloud->width = static_cast<uint32_t> (size);
+    cloud->height = 1;
+    cloud->is_dense = true;
+    return cloud;
+  }
+
+  size_t
+  getOverflowCount () const
+  {
+    return overflows_;
+  }
+
+private:
+  std::vector<CloudPtr> slots_;
+  size_t next_;
+  size_t overflows_;
+};
+
+// Sensor recording: the organized frames of a stream as millimetre depth and
+// RGB, with their acquisition times. The file is a 64 byte header, the
+// frames, each a 24 byte frame header and its 8 byte aligned depth and
+// color sections, and an index of the frame offsets that close () appends
+// and links from the header. The depth of a compressed frame is the zigzag
+// varint of the difference to the pixel on its left, about a byte per pixel
+// on the smooth Kinect depth; color is always raw. x and y are not stored
+// but rebuilt from the depth with the CameraIntrinsics of the resolution.
+struct RecordingFormat
+{
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    float focal_length;
+    float center_x;
+    float center_y;
+    uint64_t frame_num;
+    uint64_t index_offset;
+    uint8_t reserved[16];
+  };
+
+  struct FrameHeader
+  {
+    uint64_t timestamp_us;
+    uint32_t depth_size;
+    uint32_t color_size;
+    uint32_t flags;
+    uint32_t reserved;
+  };
+
+  enum { COMPRESSED_DEPTH = 1 };
+
+  static const uint32_t VERSION = 1;
+  static const char MAGIC[8];
+
+  static uint64_t
+  align (uint64_t offset)
+  {
+    return ((offset + 7) & ~static_cast<uint64_t> (7));
+  }
+};
+
+const char RecordingFormat::MAGIC[8] = { 'O', 'S', 'T', 'R', 'E', 'C', 'R', 'D' };
+
+// Writes a recording from the grabber callback without dropping frames.
+// write () only converts the cloud into a raw frame buffer in one pass and
+// queues it; a writer thread compresses the queued frames and appends them
+// to the file. The raw buffers are recycled, and when the disk falls behind
+// so far that all of them are queued, another one is allocated and counted
+// instead of dropping the frame.
+class RecordingWriter
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+
+  RecordingWriter ()
+  : fd_ (-1)
+  , compress_ (true)
+  , closed_ (true)
+  , width_ (0)
+  , height_ (0)
+  , offset_ (0)
+  , buffer_num_ (0)
+  , skipped_ (0)
+  , intrinsics_fitted_ (false)
+  , failed_ (false)
+  {
+  }
+
+  ~RecordingWriter ()
+  {
+    close ();
+  }
+
+  bool
+  open (const std::string &path, bool compress)
+  {
+    close ();
+    fd_ = ::open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+    {
+      PCL_ERROR ("failed to create the recording %s: %s\n", path.c_str (), std::strerror (errno));
+      return (false);
+    }
+    path_ = path;
+    compress_ = compress;
+    width_ = height_ = 0;
+    offset_ = sizeof (RecordingFormat::Header);
+    index_.clear ();
+    skipped_ = 0;
+    intrinsics_fitted_ = false;
+    failed_ = false;
+    // the first frame adds the resolution to the header, close () the index
+    if (!writeHeader (0, 0) || ::lseek (fd_, offset_, SEEK_SET) < 0)
+    {
+      ::close (fd_);
+      fd_ = -1;
+      return (false);
+    }
+    closed_ = false;
+    thread_ = boost::thread (&RecordingWriter::writeLoop, this);
+    return (true);
+  }
+
+  // queues an organized cloud; the first one fixes the resolution and
+  // unorganized clouds and those of another resolution are skipped. the
+  // intrinsics in the header are fitted to the points of the first frame
+  // that allows it, so that a replay rebuilds the recorded geometry.
+  void
+  write (const Cloud &cloud, uint64_t timestamp_us)
+  {
+    if (fd_ < 0)
+      return;
+    if (!cloud.isOrganized ())
+    {
+      ++skipped_;
+      return;
+    }
+    if (width_ == 0)
+    {
+      width_ = cloud.width;
+      height_ = cloud.height;
+      intrinsics_ = CameraIntrinsics::forResolution (width_, height_);
+      intrinsics_fitted_ = CameraIntrinsics::fit (cloud, intrinsics_);
+      writeHeader (0, 0);
+    }
+    if (cloud.width != width_ || cloud.height != height_)
+    {
+      ++skipped_;
+      return;
+    }
+    if (!intrinsics_fitted_ && CameraIntrinsics::fit (cloud, intrinsics_))
+    {
+      intrinsics_fitted_ = true;
+      writeHeader (0, 0);
+    }
+    RawFramePtr frame;
+    {
+      boost::mutex::scoped_lock lock (mtx_);
+      if (free_.empty ())
+      {
+        free_.push_back (RawFramePtr (new RawFrame));
+        ++buffer_num_;
+      }
+      frame = free_.back ();
+      free_.pop_back ();
+    }
+    const size_t size = cloud.points.size ();
+    frame->timestamp_us = timestamp_us;
+    frame->depth.resize (size);
+    frame->color.resize (3 * size);
+    for (size_t i = 0; i < size; i++)
+    {
+      const pcl::PointXYZRGB& p = cloud.points[i];
+      const float z = p.z * 1000.0f + 0.5f;
+      frame->depth[i] = pcl_isfinite (z) && z >= 1.0f && z < 65535.0f ? static_cast<uint16_t> (z) : 0;
+      frame->color[3 * i] = p.r;
+      frame->color[3 * i + 1] = p.g;
+      frame->color[3 * i + 2] = p.b;
+    }
+    boost::mutex::scoped_lock lock (mtx_);
+    queue_.push_back (frame);
+    queued_.notify_one ();
+  }
+
+  // writes the queued frames, the index and the final header
+  void
+  close ()
+  {
+    if (fd_ < 0)
+      return;
+    {
+      boost::mutex::scoped_lock lock (mtx_);
+      closed_ = true;
+      queued_.notify_one ();
+    }
+    thread_.join ();
+    if (index_.empty () || writeAll (&index_[0], index_.size () * sizeof (uint64_t)))
+      writeHeader (index_.size (), offset_);
+    ::close (fd_);
+    fd_ = -1;
+    // two buffers alternate while the disk keeps up
+    std::cout << "recorded " << index_.size () << " frames to " << path_ << " with " << buffer_num_
+              << " frame buffers";
+    if (skipped_ > 0)
+      std::cout << ", skipped " << skipped_ << " unorganized frames or frames of another resolution";
+    std::cout << std::endl;
+    if (failed_)
+      PCL_ERROR ("writing the recording %s failed\n", path_.c_str ());
+  }
+
+  bool
+  isOpen () const
+  {
+    return (fd_ >= 0);
+  }
+
+protected:
+  struct RawFrame
+  {
+    uint64_t timestamp_us;
+    std::vector<uint16_t> depth;
+    std::vector<uint8_t> color;
+  };
+  typedef boost::shared_ptr<RawFrame> RawFramePtr;
+
+  void
+  writeLoop ()
+  {
+    while (true)
+    {
+      RawFramePtr frame;
+      {
+        boost::mutex::scoped_lock lock (mtx_);
+        while (queue_.empty () && !closed_)
+          queued_.wait (lock);
+        if (queue_.empty ())
+          return;
+        frame = queue_.front ();
+        queue_.pop_front ();
+      }
+      {
+        STAGE_TIMER ("record.write");
+        writeFrame (*frame);
+      }
+      boost::mutex::scoped_lock lock (mtx_);
+      free_.push_back (frame);
+    }
+  }
+
+  void
+  writeFrame (const RawFrame &frame)
+  {
+    RecordingFormat::FrameHeader header = RecordingFormat::FrameHeader ();
+    header.timestamp_us = frame.timestamp_us;
+    header.color_size = static_cast<uint32_t> (frame.color.size ());
+    const char* depth = reinterpret_cast<const char*> (&frame.depth[0]);
+    header.depth_size = static_cast<uint32_t> (frame.depth.size () * sizeof (uint16_t));
+    if (compress_)
+    {
+      encodeDepth (frame.depth, encoded_);
+      depth = &encoded_[0];
+      header.depth_size = static_cast<uint32_t> (encoded_.size ());
+      header.flags = RecordingFormat::COMPRESSED_DEPTH;
+    }
+    static const char zeros[8] = { 0 };
+    const uint64_t depth_end = sizeof (header) + header.depth_size;
+    const uint64_t color_end = RecordingFormat::align (depth_end) + header.color_size;
+    const uint64_t frame_end = RecordingFormat::align (color_end);
+    if (!writeAll (&header, sizeof (header)) || !writeAll (depth, header.depth_size) ||
+        !writeAll (zeros, RecordingFormat::align (depth_end) - depth_end) ||
+        !writeAll (&frame.color[0], header.color_size) || !writeAll (zeros, frame_end - color_end))
+      return;
+    index_.push_back (offset_);
+    offset_ += frame_end;
+  }
+
+  // row by row, so that a row starts from depth 0
+  void
+  encodeDepth (const std::vector<uint16_t> &depth, std::vector<char> &encoded) const
+  {
+    encoded.resize (3 * depth.size ());
+    size_t size = 0;
+    for (uint32_t v = 0; v < height_; v++)
+    {
+      int previous = 0;
+      for (uint32_t u = 0; u < width_; u++)
+      {
+        const int value = depth[v * width_ + u];
+        const int delta = value - previous;
+        uint32_t zigzag = (static_cast<uint32_t> (delta) << 1) ^ static_cast<uint32_t> (delta >> 31);
+        while (zigzag >= 0x80)
+        {
+          encoded[size++] = static_cast<char> (zigzag | 0x80);
+          zigzag >>= 7;
+        }
+        encoded[size++] = static_cast<char> (zigzag);
+        previous = value;
+      }
+    }
+    encoded.resize (size);
+  }
+
+  // a recording without an index is read by walking its frames
+  bool
+  writeHeader (uint64_t frame_num, uint64_t index_offset)
+  {
+    RecordingFormat::Header header = RecordingFormat::Header ();
+    std::memcpy (header.magic, RecordingFormat::MAGIC, sizeof (header.magic));
+    header.version = RecordingFormat::VERSION;
+    header.width = width_;
+    header.height = height_;
+    header.focal_length = intrinsics_.focal_length;
+    header.center_x = intrinsics_.center_x;
+    header.center_y = intrinsics_.center_y;
+    header.frame_num = frame_num;
+    header.index_offset = index_offset;
+    if (::pwrite (fd_, &header, sizeof (header), 0) != static_cast<ssize_t> (sizeof (header)))
+    {
+      PCL_ERROR ("failed to write the header of %s\n", path_.c_str ());
+      failed_ = true;
+      return (false);
+    }
+    return (true);
+  }
+
+  bool
+  writeAll (const void* data, size_t size)
+  {
+    const char* bytes = static_cast<const char*> (data);
+    while (size > 0)
+    {
+      const ssize_t written = ::write (fd_, bytes, size);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+      {
+        if (!failed_.exchange (true))
+          PCL_ERROR ("failed to write the recording: %s\n", std::strerror (errno));
+        return (false);
+      }
+      bytes += written;
+      size -= written;
+    }
+    return (true);
+  }
+
+  int fd_;
+  std::string path_;
+  bool compress_;
+  bool closed_;
+  uint32_t width_, height_;
+  CameraIntrinsics intrinsics_;
+  // written by the writer thread only
+  uint64_t offset_;
+  std::vector<uint64_t> index_;
+  std::vector<char> encoded_;
+  std::deque<RawFramePtr> queue_;
+  std::vector<RawFramePtr> free_;
+  boost::mutex mtx_;
+  boost::condition_variable queued_;
+  boost::thread thread_;
+  size_t buffer_num_;
+  size_t skipped_;
+  bool intrinsics_fitted_;
+  // set by the grabber thread through writeHeader () and by the writer thread
+  boost::atomic<bool> failed_;
+};
+
+// Reads a recording through a memory mapping. open () checks the header and
+// the bounds of every frame, from the index or, for a recording that was
+// not closed, by walking the frames; unpack () then rebuilds a frame in a
+// single pass over its sections.
+class RecordingReader
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+
+  bool
+  open (const std::string &path)
+  {
+    namespace bip = boost::interprocess;
+    frames_.clear ();
+    try
+    {
+      bip::file_mapping mapping (path.c_str (), bip::read_only);
+      bip::mapped_region (mapping, bip::read_only).swap (region_);
+    }
+    catch (const bip::interprocess_exception &e)
+    {
+      PCL_ERROR ("could not map the recording %s: %s\n", path.c_str (), e.what ());
+      return (false);
+    }
+    data_ = static_cast<const char*> (region_.get_address ());
+    const uint64_t size = region_.get_size ();
+    if (size < sizeof (RecordingFormat::Header))
+      return (invalid (path, "truncated header"));
+    std::memcpy (&header_, data_, sizeof (header_));
+    if (std::memcmp (header_.magic, RecordingFormat::MAGIC, sizeof (header_.magic)) != 0)
+      return (invalid (path, "not a recording"));
+    if (header_.version != RecordingFormat::VERSION)
+      return (invalid (path, "unsupported version"));
+    if (!(header_.focal_length > 0.0f))
+      return (invalid (path, "no frames"));
+
+    const bool indexed = header_.index_offset != 0 &&
+                         inside (header_.index_offset, header_.frame_num * sizeof (uint64_t), size);
+    uint64_t offset = sizeof (RecordingFormat::Header);
+    const uint64_t end = indexed ? header_.index_offset : size;
+    for (uint64_t i = 0; indexed ? i < header_.frame_num : offset < end; i++)
+    {
+      if (indexed)
+        std::memcpy (&offset, data_ + header_.index_offset + i * sizeof (uint64_t), sizeof (uint64_t));
+      Frame frame;
+      if (!inside (offset, sizeof (RecordingFormat::FrameHeader), end))
+        break;
+      std::memcpy (&frame.header, data_ + offset, sizeof (frame.header));
+      frame.depth_offset = offset + sizeof (RecordingFormat::FrameHeader);
+      frame.color_offset = RecordingFormat::align (frame.depth_offset + frame.header.depth_size);
+      if (!validFrame (frame, end))
+        break;
+      frames_.push_back (frame);
+      offset = RecordingFormat::align (frame.color_offset + frame.header.color_size);
+    }
+    if (indexed && frames_.size () != header_.frame_num)
+      return (invalid (path, "truncated frame"));
+    if (!indexed)
+      PCL_WARN ("the recording %s was not closed, recovered %d frames\n", path.c_str (), static_cast<int> (frames_.size ()));
+    return (!frames_.empty () || invalid (path, "no frames"));
+  }
+
+  size_t
+  getFrameNum () const
+  {
+    return (frames_.size ());
+  }
+
+  uint64_t
+  getTimestamp (size_t i) const
+  {
+    return (frames_[i].header.timestamp_us);
+  }
+
+  // rebuilds frame i into cloud, which keeps its capacity across frames
+  bool
+  unpack (size_t i, Cloud &cloud) const
+  {
+    const Frame& frame = frames_[i];
+    const unsigned width = header_.width, height = header_.height;
+    cloud.points.resize (static_cast<size_t> (width) * height);
+    cloud.width = width;
+    cloud.height = height;
+    cloud.is_dense = false;
+    const float inverse_focal_length = 1.0f / header_.focal_length;
+    const float nan = std::numeric_limits<float>::quiet_NaN ();
+    const uint8_t* color = reinterpret_cast<const uint8_t*> (data_ + frame.color_offset);
+    const uint8_t* depth = reinterpret_cast<const uint8_t*> (data_ + frame.depth_offset);
+    const uint8_t* depth_end = depth + frame.header.depth_size;
+    const bool compressed = (frame.header.flags & RecordingFormat::COMPRESSED_DEPTH) != 0;
+    for (unsigned v = 0; v < height; v++)
+    {
+      int value = 0;
+      for (unsigned u = 0; u < width; u++)
+      {
+        if (compressed)
+        {
+          uint32_t zigzag = 0;
+          for (int shift = 0; ; shift += 7)
+          {
+            if (depth == depth_end || shift > 28)
+              return (false);
+            zigzag |= static_cast<uint32_t> (*depth & 0x7f) << shift;
+            if ((*depth++ & 0x80) == 0)
+              break;
+          }
+          value += static_cast<int> (zigzag >> 1) ^ -static_cast<int> (zigzag & 1);
+        }
+        else
+        {
+          uint16_t raw;
+          std::memcpy (&raw, depth, sizeof (raw));
+          depth += sizeof (raw);
+          value = raw;
+        }
+        pcl::PointXYZRGB& p = cloud.points[v * width + u];
+        if (value > 0)
+        {
+          p.z = static_cast<float> (value) * 0.001f;
+          p.x = (static_cast<float> (u) - header_.center_x) * p.z * inverse_focal_length;
+          p.y = (static_cast<float> (v) - header_.center_y) * p.z * inverse_focal_length;
+        }
+        else
+          p.x = p.y = p.z = nan;
+        p.rgba = 0;
+        p.r = color[0];
+        p.g = color[1];
+        p.b = color[2];
+        color += 3;
+      }
+    }
+    return (true);
+  }
+
+protected:
+  struct Frame
+  {
+    RecordingFormat::FrameHeader header;
+    uint64_t depth_offset;
+    uint64_t color_offset;
+  };
+
+  bool
+  validFrame (const Frame &frame, uint64_t end)
+  {
+    const uint64_t pixels = static_cast<uint64_t> (header_.width) * header_.height;
+    const bool compressed = (frame.header.flags & RecordingFormat::COMPRESSED_DEPTH) != 0;
+    return (pixels > 0 && frame.header.color_size == 3 * pixels &&
+            (compressed ? frame.header.depth_size >= pixels : frame.header.depth_size == 2 * pixels) &&
+            inside (frame.depth_offset, frame.header.depth_size, end) &&
+            inside (frame.color_offset, frame.header.color_size, end));
+  }
+
+  static bool
+  inside (uint64_t offset, uint64_t length, uint64_t size)
+  {
+    return (offset <= size && length <= size - offset);
+  }
+
+  static bool
+  invalid (const std::string &path, const char* reason)
+  {
+    PCL_ERROR ("could not read the recording %s: %s\n", path.c_str (), reason);
+    return (false);
+  }
+
+  boost::interprocess::mapped_region region_;
+  const char* data_;
+  RecordingFormat::Header header_;
+  std::vector<Frame> frames_;
+};
+
+// Replays a recording. Frames are unpacked into recycled clouds on the
+// replay thread; with frames_per_second <= 0 they follow each other as fast
+// as the pipeline takes them.
+class RecordingGrabber : public ReplayGrabber
+{
+public:
+  RecordingGrabber (float frames_per_second, bool repeat)
+  : ReplayGrabber (frames_per_second, repeat)
+  , store_ (4)
+  {
+  }
+
+  virtual
+  ~RecordingGrabber ()
+  {
+    stop ();
+  }
+
+  bool
+  open (const std::string &path)
+  {
+    return (reader_.open (path));
+  }
+
+  virtual std::string
+  getName () const
+  {
+    return std::string ("RecordingGrabber");
+  }
+
+protected:
+  virtual size_t
+  getFrameNum () const
+  {
+    return reader_.getFrameNum ();
+  }
+
+  virtual Cloud::ConstPtr
+  getFrame (size_t i)
+  {
+    Cloud::Ptr cloud = store_.acquire (0);
+    if (!reader_.unpack (i, *cloud))
+    {
+      PCL_ERROR ("frame %d of the recording is corrupt\n", static_cast<int> (i));
+      return Cloud::ConstPtr ();
+    }
+    cloud->header.seq = static_cast<uint32_t> (i);
+    return cloud;
+  }
+
+  RecordingReader reader_;
+  FrameStore<pcl::PointXYZRGB> store_;
+};
+
+// Interleaves a cloud and its normals into PointXYZRGBNormal. All three point
+// types keep their fields in 16 byte lanes (xyz, normal, rgb/curvature), so
+// with SSE every point is three aligned loads and three aligned stores.
+inline void
+interleaveNormals (const pcl::PointXYZRGB* points, const pcl::Normal* normals, size_t size,
+                   pcl::PointXYZRGBNormal* result)
+{
+#ifdef __SSE2__
+  for (size_t i = 0; i < size; i++)
+  {
+    const __m128 xyz = _mm_load_ps (points[i].data);
+    const __m128 normal = _mm_load_ps (normals[i].data_n);
+    const __m128 rgb = _mm_load_ss (&points[i].rgb);
+    const __m128 curvature = _mm_load_ss (&normals[i].curvature);
+    _mm_store_ps (result[i].data, xyz);
+    _mm_store_ps (result[i].data_n, normal);
+    _mm_store_ps (result[i].data_c, _mm_unpacklo_ps (rgb, curvature));
+  }
+#else
+  for (size_t i = 0; i < size; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      result[i].data[j] = points[i].data[j];
+      result[i].data_n[j] = normals[i].data_n[j];
+    }
+    result[i].data_c[0] = points[i].rgb;
+    result[i].data_c[1] = normals[i].curvature;
+    result[i].data_c[2] = result[i].data_c[3] = 0.0f;
+  }
+#endif
+}
+
+// Voxel grid filter over an open addressing table instead of the index sort
+// of pcl::VoxelGrid: one pass accumulates the points of every occupied leaf
+// and a second one writes the centroids, in the order the leaves were first
+// hit. The table and the leaves are sized for max_voxels once and reused
+// frame after frame; points of leaves beyond max_voxels are dropped. With a
+// temporal window of n frames the centroid of a leaf that is occupied in the
+// current frame also averages the points that fell into it during the n - 1
+// frames before, which smooths the depth noise on static surfaces at the
+// cost of some lag on moving ones.
+class HashedVoxelGrid
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+
+  explicit HashedVoxelGrid (double leaf_size, size_t max_voxels = 640 * 480)
+  : inverse_leaf_size_ (static_cast<float> (1.0 / leaf_size))
+  , max_voxels_ (max_voxels)
+  , frame_ (0)
+  , history_num_ (0)
+  {
+    table_.reserve (max_voxels_);
+    merged_.reserve (max_voxels_);
+    setTemporalWindow (1);
+  }
+
+  // averages every leaf over the last frames (1 to MAX_TEMPORAL_WINDOW) in
+  // which it was occupied; allocates the history and drops the frames in it
+  void
+  setTemporalWindow (int frames)
+  {
+    const size_t window = static_cast<size_t> (std::max (1, frames < MAX_TEMPORAL_WINDOW ? frames : MAX_TEMPORAL_WINDOW));
+    history_.resize (window);
+    history_size_.assign (window, 0);
+    for (size_t i = 0; i < window; i++)
+      history_[i].resize (max_voxels_);
+    frame_ = history_num_ = 0;
+  }
+
+  int
+  getTemporalWindow () const
+  {
+    return (static_cast<int> (history_.size ()));
+  }
+
+  void
+  filter (const Cloud &cloud, Cloud &result)
+  {
+    const size_t current = frame_ % history_.size ();
+    std::vector<Leaf>& leaves = history_[current];
+    size_t dropped = 0;
+    table_.clear ();
+    for (size_t p = 0; p < cloud.points.size (); p++)
+    {
+      const pcl::PointXYZRGB& point = cloud.points[p];
+      if (!pcl_isfinite (point.x) || !pcl_isfinite (point.y) || !pcl_isfinite (point.z))
+        continue;
+      const int i = static_cast<int> (floorf (point.x * inverse_leaf_size_));
+      const int j = static_cast<int> (floorf (point.y * inverse_leaf_size_));
+      const int k = static_cast<int> (floorf (point.z * inverse_leaf_size_));
+      const size_t leaf_num = table_.size ();
+      const int slot = table_.findOrInsert (i, j, k);
+      if (slot < 0)
+      {
+        ++dropped;
+        continue;
+      }
+      Leaf& leaf = leaves[slot];
+      if (table_.size () != leaf_num)
+        leaf = Leaf (i, j, k);
+      leaf.add (point);
+    }
+    const size_t leaf_num = table_.size ();
+    history_size_[current] = leaf_num;
+    if (dropped > 0)
+      STAGE_RECORD_UNIT ("gridSample.dropped", "points", dropped);
+
+    // the current leaves stay untouched for the next frames
+    const Leaf* sums = &leaves[0];
+    if (history_num_ > 0 && history_.size () > 1)
+    {
+      merged_.assign (leaves.begin (), leaves.begin () + leaf_num);
+      for (size_t h = 1; h <= history_num_; h++)
+      {
+        const size_t older = (frame_ - h) % history_.size ();
+        for (size_t l = 0; l < history_size_[older]; l++)
+        {
+          const Leaf& leaf = history_[older][l];
+          const int slot = table_.find (leaf.i, leaf.j, leaf.k);
+          if (slot >= 0)
+            merged_[slot].add (leaf);
+        }
+      }
+      sums = &merged_[0];
+    }
+
+    result.points.resize (leaf_num);
+    result.header = cloud.header;
+    result.width = static_cast<uint32_t> (leaf_num);
+    result.height = 1;
+    result.is_dense = true;
+    for (size_t l = 0; l < leaf_num; l++)
+    {
+      const Leaf& leaf = sums[l];
+      const float inverse_count = 1.0f / static_cast<float> (leaf.count);
+      pcl::PointXYZRGB& point = result.points[l];
+      point.x = leaf.x * inverse_count;
+      point.y = leaf.y * inverse_count;
+      point.z = leaf.z * inverse_count;
+      point.rgba = 0;
+      point.r = static_cast<uint8_t> (leaf.r / leaf.count);
+      point.g = static_cast<uint8_t> (leaf.g / leaf.count);
+      point.b = static_cast<uint8_t> (leaf.b / leaf.count);
+    }
+    ++frame_;
+    history_num_ = std::min (history_num_ + 1, history_.size () - 1);
+  }
+
+  static const int MAX_TEMPORAL_WINDOW = 8;
+
+protected:
+  struct Leaf
+  {
+    Leaf () {}
+    Leaf (int i, int j, int k)
+    : x (0.0f), y (0.0f), z (0.0f), r (0), g (0), b (0), count (0), i (i), j (j), k (k)
+    {
+    }
+
+    void
+    add (const pcl::PointXYZRGB &point)
+    {
+      x += point.x;
+      y += point.y;
+      z += point.z;
+      r += point.r;
+      g += point.g;
+      b += point.b;
+      ++count;
+    }
+
+    void
+    add (const Leaf &leaf)
+    {
+      x += leaf.x;
+      y += leaf.y;
+      z += leaf.z;
+      r += leaf.r;
+      g += leaf.g;
+      b += leaf.b;
+      count += leaf.count;
+    }
+
+    float x, y, z;
+    uint32_t r, g, b;
+    uint32_t count;
+    int i, j, k;
+  };
+
+  float inverse_leaf_size_;
+  size_t max_voxels_;
+  VoxelHashTable table_;
+  // leaves of the last frames, a ring indexed by the frame number
+  std::vector<std::vector<Leaf> > history_;
+  std::vector<size_t> history_size_;
+  std::vector<Leaf> merged_;
+  size_t frame_;
+  size_t history_num_;
+};
+
+// Fused replacement of pass-through, voxel grid and normal estimation for
+// organized clouds. A single row-major sweep over the image applies the z
+// range, accumulates the voxel centroids and builds an integral image of the
+// point moments; the normal of every voxel is then the smallest eigenvector
+// of the covariance of the pixels around its mean pixel, over a window that
+// covers normal_radius at the voxel depth. The output clouds come from
+// FrameStores, one slot per frame that can be in flight downstream.
+class OrganizedPreprocessor
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+  typedef pcl::PointCloud<pcl::PointXYZRGBNormal> RefCloud;
+
+  OrganizedPreprocessor (double min_z, double max_z, double leaf_size, double normal_radius)
+  : min_z_ (static_cast<float> (min_z))
+  , max_z_ (static_cast<float> (max_z))
+  , inverse_leaf_size_ (static_cast<float> (1.0 / leaf_size))
+  , normal_radius_ (static_cast<float> (normal_radius))
+  , use_roi_ (false)
+  , intrinsics_fitted_ (false)
+  , intrinsics_width_ (0)
+  , intrinsics_height_ (0)
+  , downsampled_store_ (4)
+  , tracking_store_ (4)
+  {
+  }
+
+  // restricts the output to the axis aligned box [min, max] in sensor
+  // coordinates; only the pixels the box projects to are swept
+  void
+  setRegionOfInterest (const Eigen::Vector3f &min, const Eigen::Vector3f &max)
+  {
+    roi_min_ = min;
+    roi_max_ = max;
+    use_roi_ = true;
+  }
+
+  void
+  clearRegionOfInterest ()
+  {
+    use_roi_ = false;
+  }
+
+  // intrinsics of the organized cloud, fitted once per resolution; the
+  // nominal ones of the resolution until a frame has enough valid pixels
+  // for the fit
+  const CameraIntrinsics&
+  updateIntrinsics (const Cloud &cloud)
+  {
+    if (cloud.width != intrinsics_width_ || cloud.height != intrinsics_height_)
+    {
+      intrinsics_ = CameraIntrinsics::forResolution (cloud.width, cloud.height);
+      intrinsics_fitted_ = false;
+      intrinsics_width_ = cloud.width;
+      intrinsics_height_ = cloud.height;
+    }
+    if (!intrinsics_fitted_)
+      intrinsics_fitted_ = CameraIntrinsics::fit (cloud, intrinsics_);
+    return (intrinsics_);
+  }
+
+  // fills downsampled and, with with_normals, tracking with the voxel
+  // centroids of cloud; tracking is reset otherwise
+  void
+  compute (const Cloud &cloud, bool with_normals, Cloud::Ptr &downsampled, RefCloud::Ptr &tracking)
+  {
+    updateIntrinsics (cloud);
+    if (voxels_.size () < cloud.points.size ())
+    {
+      voxels_.resize (cloud.points.size ());
+      table_.reserve (cloud.points.size ());
+    }
+    computeSweepRectangle (cloud.width, cloud.height);
+    if (with_normals)
+      integral_.resize ((cloud.width + 1) * (cloud.height + 1));
+    sweep (cloud, with_normals);
+
+    const size_t voxel_num = table_.size ();
+    downsampled = downsampled_store_.acquire (voxel_num);
+    downsampled->header = cloud.header;
+    if (with_normals)
+    {
+      tracking = tracking_store_.acquire (voxel_num);
+      tracking->is_dense = false;
+      tracking->header = cloud.header;
+    }
+    else
+      tracking.reset ();
+
+    for (size_t i = 0; i < voxel_num; i++)
+    {
+      const VoxelAccumulator& voxel = voxels_[i];
+      const float inverse_count = 1.0f / static_cast<float> (voxel.count);
+      pcl::PointXYZRGB& point = downsampled->points[i];
+      point.x = voxel.x * inverse_count;
+      point.y = voxel.y * inverse_count;
+      point.z = voxel.z * inverse_count;
+      point.rgba = 0;
+      point.r = static_cast<uint8_t> (voxel.r / voxel.count);
+      point.g = static_cast<uint8_t> (voxel.g / voxel.count);
+      point.b = static_cast<uint8_t> (voxel.b / voxel.count);
+      if (with_normals)
+      {
+        pcl::PointXYZRGBNormal& tracking_point = tracking->points[i];
+        tracking_point.x = point.x;
+        tracking_point.y = point.y;
+        tracking_point.z = point.z;
+        tracking_point.rgb = point.rgb;
+        computeNormal (voxel, point, tracking_point);
+      }
+    }
+  }
+
+protected:
+  struct VoxelAccumulator
+  {
+    float x, y, z;
+    uint32_t r, g, b;
+    uint32_t count;
+    uint32_t u, v;
+  };
+
+  // n, x, y, z, xx, xy, xz, yy, yz, zz summed over the valid pixels
+  struct Moments
+  {
+    double m[10];
+  };
+
+  // image rectangle [u0_, u1_) x [v0_, v1_) covered by the region of interest,
+  // padded by the largest normal window so that normals match the full sweep
+  void
+  computeSweepRectangle (unsigned width, unsigned height)
+  {
+    u0_ = v0_ = 0;
+    u1_ = static_cast<int> (width);
+    v1_ = static_cast<int> (height);
+    if (!use_roi_)
+      return;
+    const float near_z = std::max (std::max (roi_min_[2], min_z_), 0.05f);
+    const float far_z = std::min (roi_max_[2], max_z_);
+    if (far_z < near_z)
+    {
+      u1_ = u0_;
+      v1_ = v0_;
+      return;
+    }
+    // the extremes of x / z and y / z are at the box corners
+    float u_min = std::numeric_limits<float>::max (), u_max = -u_min;
+    float v_min = u_min, v_max = -u_min;
+    const float zs[2] = { near_z, far_z };
+    for (int i = 0; i < 2; i++)
+    {
+      const float scale = intrinsics_.focal_length / zs[i];
+      u_min = std::min (u_min, roi_min_[0] * scale);
+      u_max = std::max (u_max, roi_max_[0] * scale);
+      v_min = std::min (v_min, roi_min_[1] * scale);
+      v_max = std::max (v_max, roi_max_[1] * scale);
+    }
+    const int pad = std::max (1, std::min (32, static_cast<int> (normal_radius_ * intrinsics_.focal_length / near_z + 0.5f)));
+    u0_ = std::max (0, static_cast<int> (floorf (u_min + intrinsics_.center_x)) - pad);
+    u1_ = std::min (static_cast<int> (width), static_cast<int> (ceilf (u_max + intrinsics_.center_x)) + 1 + pad);
+    v0_ = std::max (0, static_cast<int> (floorf (v_min + intrinsics_.center_y)) - pad);
+    v1_ = std::min (static_cast<int> (height), static_cast<int> (ceilf (v_max + intrinsics_.center_y)) + 1 + pad);
+    u1_ = std::max (u0_, u1_);
+    v1_ = std::max (v0_, v1_);
+  }
+
+  bool
+  inRegionOfInterest (const pcl::PointXYZRGB &p) const
+  {
+    return (!use_roi_ ||
+            (p.x >= roi_min_[0] && p.x <= roi_max_[0] &&
+             p.y >= roi_min_[1] && p.y <= roi_max_[1] &&
+             p.z >= roi_min_[2] && p.z <= roi_max_[2]));
+  }
+
+  void
+  sweep (const Cloud &cloud, bool with_normals)
+  {
+    const int width = static_cast<int> (cloud.width);
+    const size_t stride = u1_ - u0_ + 1;
+    table_.clear ();
+    if (with_normals)
+      std::fill (integral_.begin (), integral_.begin () + stride, Moments ());
+    for (int v = v0_; v < v1_; v++)
+    {
+      Moments row_sum = Moments ();
+      const Moments* above = with_normals ? &integral_[(v - v0_) * stride] : 0;
+      Moments* current = with_normals ? &integral_[(v - v0_ + 1) * stride] : 0;
+      if (with_normals)
+        current[0] = Moments ();
+      for (int u = u0_; u < u1_; u++)
+      {
+        const pcl::PointXYZRGB& p = cloud.points[v * width + u];
+        if (pcl_isfinite (p.z) && p.z >= min_z_ && p.z <= max_z_)
+        {
+          if (inRegionOfInterest (p))
+          {
+            // the table holds as many voxels as there are pixels, so it is never full
+            const size_t voxel_num = table_.size ();
+            const int slot = table_.findOrInsert (static_cast<int> (floorf (p.x * inverse_leaf_size_)),
+                                                  static_cast<int> (floorf (p.y * inverse_leaf_size_)),
+                                                  static_cast<int> (floorf (p.z * inverse_leaf_size_)));
+            VoxelAccumulator& voxel = voxels_[slot];
+            if (table_.size () != voxel_num)
+            {
+              voxel.x = voxel.y = voxel.z = 0.0f;
+              voxel.r = voxel.g = voxel.b = voxel.count = voxel.u = voxel.v = 0;
+            }
+            voxel.x += p.x;
+            voxel.y += p.y;
+            voxel.z += p.z;
+            voxel.r += p.r;
+            voxel.g += p.g;
+            voxel.b += p.b;
+            voxel.u += u;
+            voxel.v += v;
+            ++voxel.count;
+          }
+          // neighbors outside the box still contribute to the normals
+          if (with_normals)
+          {
+            const double x = p.x, y = p.y, z = p.z;
+            double* m = row_sum.m;
+            m[0] += 1.0;
+            m[1] += x; m[2] += y; m[3] += z;
+            m[4] += x * x; m[5] += x * y; m[6] += x * z;
+            m[7] += y * y; m[8] += y * z; m[9] += z * z;
+          }
+        }
+        if (with_normals)
+        {
+          const int i = u - u0_ + 1;
+          for (int c = 0; c < 10; c++)
+            current[i].m[c] = above[i].m[c] + row_sum.m[c];
+        }
+      }
+    }
+  }
+
+  void
+  computeNormal (const VoxelAccumulator &voxel, const pcl::PointXYZRGB &point, pcl::PointXYZRGBNormal &result)
+  {
+    // window in coordinates of the swept rectangle
+    const int u = static_cast<int> (voxel.u / voxel.count) - u0_;
+    const int v = static_cast<int> (voxel.v / voxel.count) - v0_;
+    const int half = std::max (1, std::min (32, static_cast<int> (normal_radius_ * intrinsics_.focal_length / point.z + 0.5f)));
+    const int wu0 = std::max (0, u - half), wu1 = std::min (u1_ - u0_ - 1, u + half);
+    const int wv0 = std::max (0, v - half), wv1 = std::min (v1_ - v0_ - 1, v + half);
+    const size_t stride = u1_ - u0_ + 1;
+    const Moments& a = integral_[wv0 * stride + wu0];
+    const Moments& b = integral_[wv0 * stride + wu1 + 1];
+    const Moments& c = integral_[(wv1 + 1) * stride + wu0];
+    const Moments& d = integral_[(wv1 + 1) * stride + wu1 + 1];
+    double m[10];
+    for (int i = 0; i < 10; i++)
+      m[i] = d.m[i] - b.m[i] - c.m[i] + a.m[i];
+
+    const float nan = std::numeric_limits<float>::quiet_NaN ();
+    if (m[0] < 3.0)
+    {
+      result.normal[0] = result.normal[1] = result.normal[2] = result.curvature = nan;
+      return;
+    }
+    const double n = m[0];
+    const double mx = m[1] / n, my = m[2] / n, mz = m[3] / n;
+    Eigen::Matrix3f covariance;
+    covariance (0, 0) = static_cast<float> (m[4] / n - mx * mx);
+    covariance (0, 1) = covariance (1, 0) = static_cast<float> (m[5] / n - mx * my);
+    covariance (0, 2) = covariance (2, 0) = static_cast<float> (m[6] / n - mx * mz);
+    covariance (1, 1) = static_cast<float> (m[7] / n - my * my);
+    covariance (1, 2) = covariance (2, 1) = static_cast<float> (m[8] / n - my * mz);
+    covariance (2, 2) = static_cast<float> (m[9] / n - mz * mz);
+    float nx, ny, nz, curvature;
+    pcl::solvePlaneParameters (covariance, nx, ny, nz, curvature);
+    pcl::flipNormalTowardsViewpoint (point, 0.0f, 0.0f, 0.0f, nx, ny, nz);
+    result.normal[0] = nx;
+    result.normal[1] = ny;
+    result.normal[2] = nz;
+    result.curvature = curvature;
+  }
+
+  float min_z_, max_z_;
+  float inverse_leaf_size_;
+  float normal_radius_;
+  bool use_roi_;
+  Eigen::Vector3f roi_min_, roi_max_;
+  int u0_, u1_, v0_, v1_;
+  CameraIntrinsics intrinsics_;
+  bool intrinsics_fitted_;
+  unsigned intrinsics_width_, intrinsics_height_;
+  VoxelHashTable table_;
+  std::vector<VoxelAccumulator> voxels_;
+  std::vector<Moments> integral_;
+  FrameStore<pcl::PointXYZRGB> downsampled_store_;
+  FrameStore<pcl::PointXYZRGBNormal> tracking_store_;
+};
+
+// Cloud coherence that associates each reference point with the nearest
+// target point among those projecting next to it in the sensor image,
+// instead of querying a search tree. setTargetCloud () counting-sorts the
+// target into square bins of the image about as wide as one leaf of the
+// downsampled target at its farthest depth, and a query scans the bins its
+// own projection can be offset by within the maximum distance at its own
+// depth. Pairs whose points project to either side of the image border are
+// missed.
+template <typename PointInT>
+class ProjectiveCloudCoherence : public pcl::tracking::PointCloudCoherence<PointInT>
+{
+public:
+  typedef boost::shared_ptr<ProjectiveCloudCoherence<PointInT> > Ptr;
+  typedef typename pcl::tracking::PointCloudCoherence<PointInT>::PointCloudInConstPtr PointCloudInConstPtr;
+  typedef typename pcl::tracking::PointCloudCoherence<PointInT>::IndicesConstPtr IndicesConstPtr;
+  typedef typename pcl::tracking::PointCloudCoherence<PointInT>::PointCoherencePtr PointCoherencePtr;
+
+  ProjectiveCloudCoherence ()
+  : maximum_distance_ (0.02f)
+  , leaf_size_ (0.01f)
+  , width_ (640)
+  , height_ (480)
+  , bin_size_ (1)
+  , bin_cols_ (0)
+  , bin_rows_ (0)
+  {
+    this->coherence_name_ = "ProjectiveCloudCoherence";
+  }
+
+  // intrinsics and resolution of the image the target cloud was taken from
+  void
+  setCameraIntrinsics (const CameraIntrinsics &intrinsics, unsigned width, unsigned height)
+  {
+    intrinsics_ = intrinsics;
+    width_ = width;
+    height_ = height;
+  }
+
+  // reference points without a target point this close do not contribute
+  void
+  setMaximumDistance (float maximum_distance)
+  {
+    maximum_distance_ = maximum_distance;
+  }
+
+  // leaf size the target cloud was downsampled with
+  void
+  setLeafSize (float leaf_size)
+  {
+    leaf_size_ = leaf_size;
+  }
+
+  // the particle filter sets the target once per frame before weighting the
+  // particles in parallel, so the bins are built here and only read later
+  virtual void
+  setTargetCloud (const PointCloudInConstPtr &cloud)
+  {
+    this->target_input_ = cloud;
+    STAGE_TIMER ("projectiveIndex");
+    const std::vector<PointInT, Eigen::aligned_allocator<PointInT> >& points = cloud->points;
+    // far points are the densest in the image, about one per leaf footprint
+    float max_z = 0.0f;
+    for (size_t i = 0; i < points.size (); i++)
+      if (points[i].z > max_z)
+        max_z = points[i].z;
+    const float footprint = max_z > 0.0f ? intrinsics_.focal_length * leaf_size_ / max_z : 1.0f;
+    bin_size_ = std::max (1, std::min (static_cast<int> (MAX_BIN_SIZE), static_cast<int> (footprint)));
+    bin_cols_ = (static_cast<int> (width_) + bin_size_ - 1) / bin_size_;
+    bin_rows_ = (static_cast<int> (height_) + bin_size_ - 1) / bin_size_;
+
+    bin_start_.assign (bin_cols_ * bin_rows_ + 1, 0);
+    point_bins_.resize (points.size ());
+    for (size_t i = 0; i < points.size (); i++)
+    {
+      point_bins_[i] = bin (points[i].x, points[i].y, points[i].z);
+      if (point_bins_[i] >= 0)
+        ++bin_start_[point_bins_[i] + 1];
+    }
+    for (size_t b = 1; b < bin_start_.size (); b++)
+      bin_start_[b] += bin_start_[b - 1];
+    const size_t binned_num = bin_start_.back ();
+    binned_x_.resize (binned_num);
+    binned_y_.resize (binned_num);
+    binned_z_.resize (binned_num);
+    binned_index_.resize (binned_num);
+    fill_.assign (bin_start_.begin (), bin_start_.end () - 1);
+    for (size_t i = 0; i < points.size (); i++)
+    {
+      if (point_bins_[i] < 0)
+        continue;
+      const int slot = fill_[point_bins_[i]]++;
+      binned_x_[slot] = points[i].x;
+      binned_y_[slot] = points[i].y;
+      binned_z_[slot] = points[i].z;
+      binned_index_[slot] = static_cast<int> (i);
+    }
+  }
+
+  // index of the nearest target point within the maximum distance of
+  // (x, y, z), or -1
+  int
+  nearest (float x, float y, float z) const
+  {
+    float u, v;
+    if (!project (x, y, z, u, v))
+      return (-1);
+    // a displacement (dx, dz) of length at most d moves the projection by
+    // f (dx - dz x / z) / (z + dz), so by at most d sqrt (f^2 + (u - c_x)^2)
+    // / (z - d) pixels, and likewise along v
+    const float d = maximum_distance_;
+    const float f = intrinsics_.focal_length;
+    float reach_u = static_cast<float> (width_), reach_v = static_cast<float> (height_);
+    if (z > d)
+    {
+      const float inverse_depth = 1.0f / (z - d);
+      const float du = u - 0.5f - intrinsics_.center_x, dv = v - 0.5f - intrinsics_.center_y;
+      reach_u = std::min (reach_u, d * sqrtf (f * f + du * du) * inverse_depth);
+      reach_v = std::min (reach_v, d * sqrtf (f * f + dv * dv) * inverse_depth);
+    }
+    const float inverse_bin_size = 1.0f / static_cast<float> (bin_size_);
+    const int col0 = std::max (0, static_cast<int> (floorf ((u - reach_u) * inverse_bin_size)));
+    const int col1 = std::min (bin_cols_ - 1, static_cast<int> ((u + reach_u) * inverse_bin_size));
+    const int row0 = std::max (0, static_cast<int> (floorf ((v - reach_v) * inverse_bin_size)));
+    const int row1 = std::min (bin_rows_ - 1, static_cast<int> ((v + reach_v) * inverse_bin_size));
+    int nearest = -1;
+    float nearest_squared_distance = d * d;
+    for (int r = row0; r <= row1; r++)
+    {
+      // the bins of a row are contiguous in the sorted arrays
+      const int begin = bin_start_[r * bin_cols_ + col0];
+      const int end = bin_start_[r * bin_cols_ + col1 + 1];
+      for (int j = begin; j < end; j++)
+      {
+        const float dx = binned_x_[j] - x;
+        const float dy = binned_y_[j] - y;
+        const float dz = binned_z_[j] - z;
+        const float squared_distance = dx * dx + dy * dy + dz * dz;
+        if (squared_distance < nearest_squared_distance)
+        {
+          nearest_squared_distance = squared_distance;
+          nearest = j;
+        }
+      }
+    }
+    return (nearest < 0 ? -1 : binned_index_[nearest]);
+  }
+
+protected:
+  // projection of (x, y, z), shifted by half a pixel so that truncating it
+  // gives the pixel; false outside of the image
+  bool
+  project (float x, float y, float z, float &u, float &v) const
+  {
+    if (!(z > 0.0f))
+      return (false);
+    const float inverse_z = 1.0f / z;
+    u = x * intrinsics_.focal_length * inverse_z + intrinsics_.center_x + 0.5f;
+    v = y * intrinsics_.focal_length * inverse_z + intrinsics_.center_y + 0.5f;
+    return (u >= 0.0f && v >= 0.0f && u < static_cast<float> (width_) && v < static_cast<float> (height_));
+  }
+
+  // bin of the projection of (x, y, z), or -1 outside of the image
+  int
+  bin (float x, float y, float z) const
+  {
+    float u, v;
+    if (!project (x, y, z, u, v))
+      return (-1);
+    return ((static_cast<int> (v) / bin_size_) * bin_cols_ + static_cast<int> (u) / bin_size_);
+  }
+
+  // same sum over the matched pairs as NearestPairPointCloudCoherence
+  virtual void
+  computeCoherence (const PointCloudInConstPtr &cloud, const IndicesConstPtr &, float &w)
+  {
+    double val = 0.0;
+    for (size_t i = 0; i < cloud->points.size (); i++)
+    {
+      const int target_index = nearest (cloud->points[i].x, cloud->points[i].y, cloud->points[i].z);
+      if (target_index < 0)
+        continue;
+      PointInT source_point = cloud->points[i];
+      PointInT target_point = this->target_input_->points[target_index];
+      double coherence_val = 1.0;
+      for (size_t k = 0; k < this->point_coherences_.size (); k++)
+        coherence_val *= this->point_coherences_[k]->compute (source_point, target_point);
+      val += coherence_val;
+    }
+    w = - static_cast<float> (val);
+  }
+
+  enum { MAX_BIN_SIZE = 64 };
+
+  float maximum_distance_;
+  float leaf_size_;
+  CameraIntrinsics intrinsics_;
+  unsigned width_, height_;
+  int bin_size_;
+  int bin_cols_, bin_rows_;
+  // target points sorted by bin; bin b holds [bin_start_[b], bin_start_[b + 1])
+  std::vector<int> bin_start_;
+  std::vector<int> point_bins_;
+  std::vector<int> fill_;
+  std::vector<float> binned_x_, binned_y_, binned_z_;
+  std::vector<int> binned_index_;
+};
+
+// Fixed set of worker threads with one task deque each. A worker runs the
+// newest task of its own deque and steals the oldest task of another one
+// when it runs dry, trying the workers of its own NUMA node first; tasks
+// submitted from outside the pool are spread round robin over the deques.
+// Workers are placed on the CPUs node by node and, if asked to, pinned to
+// them (Linux only), so that the OS does not move them between cores. The
+// time tasks wait in a deque and the steals are recorded as pool.queueWait
+// and pool.steals.
+class WorkStealingPool
+{
+public:
+  typedef boost::function<void ()> Task;
+
+  explicit WorkStealingPool (unsigned threads, bool pin = false)
+  : pending_ (0)
+  , stopped_ (false)
+  , next_queue_ (0)
+  , pinned_ (pin)
+  {
+    const std::vector<std::vector<int> > nodes = cpuNodes ();
+    std::vector<int> cpus, cpu_nodes;
+    for (size_t n = 0; n < nodes.size (); n++)
+      for (size_t c = 0; c < nodes[n].size (); c++)
+      {
+        cpus.push_back (nodes[n][c]);
+        cpu_nodes.push_back (static_cast<int> (n));
+      }
+    for (unsigned i = 0; i < std::max (1u, threads); i++)
+    {
+      queues_.push_back (boost::shared_ptr<WorkerQueue> (new WorkerQueue));
+      queues_.back ()->cpu = cpus.empty () ? -1 : cpus[i % cpus.size ()];
+      queues_.back ()->node = cpus.empty () ? 0 : cpu_nodes[i % cpus.size ()];
+    }
+    node_num_ = std::max<size_t> (1, nodes.size ());
+    // the deques to steal from, those of the same node first
+    steal_order_.resize (queues_.size ());
+    for (size_t i = 0; i < queues_.size (); i++)
+    {
+      for (int same = 1; same >= 0; same--)
+        for (size_t k = 0; k < queues_.size (); k++)
+        {
+          const size_t victim = (i + k) % queues_.size ();
+          if ((queues_[victim]->node == queues_[i]->node) == (same == 1))
+            steal_order_[i].push_back (victim);
+        }
+    }
+    for (size_t i = 0; i < queues_.size (); i++)
+      workers_.create_thread (boost::bind (&WorkStealingPool::workerLoop, this, i));
+  }
+
+  ~WorkStealingPool ()
+  {
+    {
+      boost::mutex::scoped_lock lock (wake_mtx_);
+      stopped_ = true;
+    }
+    wake_cond_.notify_all ();
+    workers_.join_all ();
+  }
+
+  size_t
+  getThreadNum () const
+  {
+    return (queues_.size ());
+  }
+
+  size_t
+  getNodeNum () const
+  {
+    return (node_num_);
+  }
+
+  bool
+  isPinned () const
+  {
+    return (pinned_);
+  }
+
+  void
+  submit (const Task &task)
+  {
+    const size_t* self = worker_index_.get ();
+    const size_t queue = self ? *self : next_queue_.fetch_add (1, boost::memory_order_relaxed) % queues_.size ();
+    {
+      boost::mutex::scoped_lock lock (queues_[queue]->mtx);
+      queues_[queue]->tasks.push_back (QueuedTask (task, monotonicMicroseconds ()));
+    }
+    pending_.fetch_add (1);
+    // pairs with the check in workerLoop (), so that the notification cannot
+    // fall between a worker's check and its wait
+    boost::mutex::scoped_lock lock (wake_mtx_);
+    wake_cond_.notify_one ();
+  }
+
+  // runs one queued task on the calling thread; false if there was none
+  bool
+  runPendingTask ()
+  {
+    QueuedTask task;
+    if (!take (task))
+      return (false);
+    STAGE_RECORD ("pool.queueWait", monotonicMicroseconds () - task.submitted_us);
+    task.task ();
+    return (true);
+  }
+
+  // CPUs of every NUMA node from sysfs, or a single node with all CPUs
+  static std::vector<std::vector<int> >
+  cpuNodes ()
+  {
+    std::vector<std::vector<int> > nodes;
+    for (int n = 0; ; n++)
+    {
+      std::ifstream file (("/sys/devices/system/node/node" + boost::lexical_cast<std::string> (n) + "/cpulist").c_str ());
+      if (!file)
+        break;
+      std::vector<int> cpus;
+      std::string range;
+      while (std::getline (file, range, ','))
+      {
+        int first = 0, last = -1;
+        const int fields = sscanf (range.c_str (), "%d-%d", &first, &last);
+        for (int cpu = first; fields > 0 && cpu <= (fields == 2 ? last : first); cpu++)
+          cpus.push_back (cpu);
+      }
+      if (!cpus.empty ())
+        nodes.push_back (cpus);
+    }
+    if (nodes.empty ())
+    {
+      nodes.resize (1);
+      for (unsigned cpu = 0; cpu < boost::thread::hardware_concurrency (); cpu++)
+        nodes[0].push_back (static_cast<int> (cpu));
+    }
+    return (nodes);
+  }
+
+protected:
+  struct QueuedTask
+  {
+    QueuedTask () : submitted_us (0) {}
+    QueuedTask (const Task &task, uint64_t submitted_us) : task (task), submitted_us (submitted_us) {}
+    Task task;
+    uint64_t submitted_us;
+  };
+
+  struct WorkerQueue
+  {
+    boost::mutex mtx;
+    std::deque<QueuedTask> tasks;
+    int cpu;
+    int node;
+  };
+
+  bool
+  take (QueuedTask &task)
+  {
+    const size_t* self = worker_index_.get ();
+    for (size_t k = 0; k < queues_.size (); k++)
+    {
+      WorkerQueue& queue = *queues_[self ? steal_order_[*self][k] : k];
+      boost::mutex::scoped_lock lock (queue.mtx);
+      if (queue.tasks.empty ())
+        continue;
+      if (self && k == 0)
+      {
+        task = queue.tasks.back ();
+        queue.tasks.pop_back ();
+      }
+      else
+      {
+        task = queue.tasks.front ();
+        queue.tasks.pop_front ();
+        if (self)
+          STAGE_RECORD_UNIT ("pool.steals", "tasks", 1);
+      }
+      pending_.fetch_sub (1);
+      return (true);
+    }
+    return (false);
+  }
+
+  void
+  workerLoop (size_t index)
+  {
+    worker_index_.reset (new size_t (index));
+#ifdef __linux__
+    if (pinned_ && queues_[index]->cpu >= 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO (&set);
+      CPU_SET (queues_[index]->cpu, &set);
+      if (pthread_setaffinity_np (pthread_self (), sizeof (set), &set) != 0)
+        PCL_WARN ("could not pin worker %d to CPU %d\n", static_cast<int> (index), queues_[index]->cpu);
+    }
+#endif
+    while (true)
+    {
+      if (runPendingTask ())
+        continue;
+      boost::mutex::scoped_lock lock (wake_mtx_);
+      while (pending_.load () == 0 && !stopped_)
+        wake_cond_.wait (lock);
+      if (stopped_ && pending_.load () == 0)
+        return;
+    }
+  }
+
+  std::vector<boost::shared_ptr<WorkerQueue> > queues_;
+  boost::thread_group workers_;
+  boost::thread_specific_ptr<size_t> worker_index_;
+  boost::atomic<int> pending_;
+  boost::mutex wake_mtx_;
+  boost::condition_variable wake_cond_;
+  bool stopped_;
+  boost::atomic<size_t> next_queue_;
+  bool pinned_;
+  size_t node_num_;
+  std::vector<std::vector<size_t> > steal_order_;
+};
+
+// Tasks on a WorkStealingPool whose completion wait () awaits. The waiting
+// thread runs queued tasks meanwhile, so that a group may be waited on from
+// inside a pool task without blocking its worker. Once there are none, it
+// yields a few times and then sleeps until the last task finishes, waking
+// periodically to help with tasks queued since.
+class TaskGroup
+{
+public:
+  explicit TaskGroup (WorkStealingPool &pool)
+  : pool_ (pool)
+  , remaining_ (0)
+  {
+  }
+
+  ~TaskGroup ()
+  {
+    wait ();
+  }
+
+  void
+  run (const WorkStealingPool::Task &task)
+  {
+    remaining_.fetch_add (1);
+    pool_.submit (boost::bind (&TaskGroup::execute, this, task));
+  }
+
+  void
+  wait ()
+  {
+    int idle = 0;
+    while (remaining_.load () > 0)
+    {
+      if (pool_.runPendingTask ())
+      {
+        idle = 0;
+        continue;
+      }
+      if (++idle <= SPIN_NUM)
+      {
+        boost::this_thread::yield ();
+        continue;
+      }
+      boost::mutex::scoped_lock lock (done_mtx_);
+      if (remaining_.load () > 0)
+        done_cond_.timed_wait (lock, boost::posix_time::microseconds (static_cast<int> (SLEEP_US)));
+    }
+  }
+
+protected:
+  void
+  execute (const WorkStealingPool::Task &task)
+  {
+    task ();
+    // under the lock, so that the notification cannot fall between the
+    // waiter's check and its wait, and the group outlives the notification
+    boost::mutex::scoped_lock lock (done_mtx_);
+    if (remaining_.fetch_sub (1) == 1)
+      done_cond_.notify_all ();
+  }
+
+  // yields before the waiter sleeps, and the longest sleep between looks
+  // at the pool's queues
+  enum { SPIN_NUM = 16, SLEEP_US = 200 };
+
+  WorkStealingPool &pool_;
+  boost::atomic<int> remaining_;
+  boost::mutex done_mtx_;
+  boost::condition_variable done_cond_;
+};
+
+// runs body on about four ranges of [0, size) per worker of pool
+inline void
+parallelFor (WorkStealingPool &pool, int size, const boost::function<void (int, int)> &body)
+{
+  const int chunk = std::max (1, size / static_cast<int> (4 * pool.getThreadNum ()));
+  TaskGroup group (pool);
+  for (int begin = 0; begin < size; begin += chunk)
+    group.run (boost::bind (body, begin, std::min (size, begin + chunk)));
+  group.wait ();
+}
+
+// Connected components of the points closer than the cluster tolerance to
+// each other, the clusters of pcl::EuclideanClusterExtraction without its
+// kd-tree. The points are hashed into voxels as large as the tolerance, so
+// all neighbours of a point lie in its own or the 26 adjacent voxels. Slabs
+// of voxels along x are joined into union-find trees in parallel, each slab
+// touching only its own points, and the voxel pairs across the slab borders
+// are joined afterwards. The clusters come ordered by decreasing size with
+// ascending indices, like those of pcl::EuclideanClusterExtraction.
+class VoxelClusterExtraction
+{
+public:
+  VoxelClusterExtraction ()
+  : tolerance_ (0.05f)
+  , min_cluster_size_ (1)
+  , max_cluster_size_ (std::numeric_limits<int>::max ())
+  , pool_ (0)
+  {
+  }
+
+  void
+  setClusterTolerance (float tolerance)
+  {
+    tolerance_ = tolerance;
+  }
+
+  void
+  setMinClusterSize (int min_cluster_size)
+  {
+    min_cluster_size_ = min_cluster_size;
+  }
+
+  void
+  setMaxClusterSize (int max_cluster_size)
+  {
+    max_cluster_size_ = max_cluster_size;
+  }
+
+  // joins the slabs on pool instead of an OpenMP team
+  void
+  setWorkerPool (WorkStealingPool* pool)
+  {
+    pool_ = pool;
+  }
+
+  template <typename PointT> void
+  extract (const pcl::PointCloud<PointT> &cloud, std::vector<pcl::PointIndices> &clusters)
+  {
+    clusters.clear ();
+    const size_t n = cloud.points.size ();
+    const float inv_tolerance = 1.0f / tolerance_;
+    voxels_.reserve (n);
+    voxels_.clear ();
+    voxel_of_.assign (n, -1);
+    voxel_coordinates_.clear ();
+    int min_x = std::numeric_limits<int>::max (), max_x = std::numeric_limits<int>::min ();
+    size_t valid = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      const PointT& p = cloud.points[i];
+      if (!pcl_isfinite (p.x) || !pcl_isfinite (p.y) || !pcl_isfinite (p.z))
+        continue;
+      const int vx = static_cast<int> (floorf (p.x * inv_tolerance));
+      const int vy = static_cast<int> (floorf (p.y * inv_tolerance));
+      const int vz = static_cast<int> (floorf (p.z * inv_tolerance));
+      const int voxel = voxels_.findOrInsert (vx, vy, vz);
+      if (static_cast<size_t> (voxel) == voxel_coordinates_.size () / 3)
+      {
+        voxel_coordinates_.push_back (vx);
+        voxel_coordinates_.push_back (vy);
+        voxel_coordinates_.push_back (vz);
+      }
+      voxel_of_[i] = voxel;
+      min_x = std::min (min_x, vx);
+      max_x = std::max (max_x, vx);
+      ++valid;
+    }
+    if (valid == 0)
+      return;
+
+    // points sorted by voxel, in ascending index order within each one
+    const size_t voxel_num = voxels_.size ();
+    voxel_start_.assign (voxel_num + 1, 0);
+    for (size_t i = 0; i < n; i++)
+      if (voxel_of_[i] >= 0)
+        ++voxel_start_[voxel_of_[i] + 1];
+    for (size_t v = 0; v < voxel_num; v++)
+      voxel_start_[v + 1] += voxel_start_[v];
+    position_of_.assign (n, -1);
+    x_.resize (valid);
+    y_.resize (valid);
+    z_.resize (valid);
+    fill_.assign (voxel_start_.begin (), voxel_start_.end () - 1);
+    for (size_t i = 0; i < n; i++)
+    {
+      if (voxel_of_[i] < 0)
+        continue;
+      const int position = fill_[voxel_of_[i]]++;
+      position_of_[i] = position;
+      x_[position] = cloud.points[i].x;
+      y_[position] = cloud.points[i].y;
+      z_[position] = cloud.points[i].z;
+    }
+
+    // slabs of whole voxel columns along x
+    const int extent = max_x - min_x + 1;
+    const int slab_num = std::min (extent, MAX_SLAB_NUM);
+    slab_width_ = (extent + slab_num - 1) / slab_num;
+    min_x_ = min_x;
+    slab_start_.assign (slab_num + 1, 0);
+    for (size_t v = 0; v < voxel_num; v++)
+      ++slab_start_[slabOf (static_cast<int> (v)) + 1];
+    for (int s = 0; s < slab_num; s++)
+      slab_start_[s + 1] += slab_start_[s];
+    slab_voxels_.resize (voxel_num);
+    fill_.assign (slab_start_.begin (), slab_start_.end () - 1);
+    for (size_t v = 0; v < voxel_num; v++)
+      slab_voxels_[fill_[slabOf (static_cast<int> (v))]++] = static_cast<int> (v);
+
+    parent_.resize (valid);
+    for (size_t i = 0; i < valid; i++)
+      parent_[i] = static_cast<int> (i);
+    borders_.resize (slab_num);
+    if (pool_)
+      parallelFor (*pool_, slab_num, boost::bind (&VoxelClusterExtraction::joinSlabs, this, _1, _2));
+    else
+    {
+#pragma omp parallel for schedule (dynamic)
+      for (int s = 0; s < slab_num; s++)
+        joinSlabs (s, s + 1);
+    }
+    for (int s = 0; s < slab_num; s++)
+      for (size_t b = 0; b < borders_[s].size (); b++)
+        joinVoxels (borders_[s][b].first, borders_[s][b].second, true);
+
+    // clusters are numbered by their lowest point index
+    label_.assign (valid, -1);
+    std::vector<int> sizes;
+    for (size_t i = 0; i < n; i++)
+    {
+      if (position_of_[i] < 0)
+        continue;
+      const int root = find (position_of_[i]);
+      if (label_[root] < 0)
+      {
+        label_[root] = static_cast<int> (sizes.size ());
+        sizes.push_back (0);
+      }
+      ++sizes[label_[root]];
+    }
+    std::vector<int> cluster_of (sizes.size (), -1);
+    for (size_t c = 0; c < sizes.size (); c++)
+    {
+      if (sizes[c] < min_cluster_size_ || sizes[c] > max_cluster_size_)
+        continue;
+      cluster_of[c] = static_cast<int> (clusters.size ());
+      clusters.push_back (pcl::PointIndices ());
+      clusters.back ().header = cloud.header;
+      clusters.back ().indices.reserve (sizes[c]);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+      if (position_of_[i] < 0)
+        continue;
+      const int cluster = cluster_of[label_[find (position_of_[i])]];
+      if (cluster >= 0)
+        clusters[cluster].indices.push_back (static_cast<int> (i));
+    }
+    std::stable_sort (clusters.begin (), clusters.end (), largerCluster);
+  }
+
+private:
+  static bool
+  largerCluster (const pcl::PointIndices &a, const pcl::PointIndices &b)
+  {
+    return (a.indices.size () > b.indices.size ());
+  }
+
+  int
+  slabOf (int voxel) const
+  {
+    return ((voxel_coordinates_[3 * voxel] - min_x_) / slab_width_);
+  }
+
+  // root of the tree of position, halving the path on the way
+  int
+  find (int position)
+  {
+    while (parent_[position] != position)
+    {
+      parent_[position] = parent_[parent_[position]];
+      position = parent_[position];
+    }
+    return (position);
+  }
+
+  void
+  unite (int a, int b)
+  {
+    a = find (a);
+    b = find (b);
+    if (a < b)
+      parent_[b] = a;
+    else if (b < a)
+      parent_[a] = b;
+  }
+
+  // joins the point pairs within the tolerance between voxel and its
+  // adjacent voxels in the positive half space, so that every pair of
+  // voxels is visited once. pairs with a voxel of another slab are left to
+  // the border pass.
+  void
+  joinSlabs (int begin, int end)
+  {
+    static const int offsets[13][3] = {
+      { 1, -1, -1}, { 1, -1,  0}, { 1, -1,  1}, { 1,  0, -1}, { 1,  0,  0}, { 1,  0,  1},
+      { 1,  1, -1}, { 1,  1,  0}, { 1,  1,  1}, { 0,  1, -1}, { 0,  1,  0}, { 0,  1,  1},
+      { 0,  0,  1}
+    };
+    for (int s = begin; s < end; s++)
+    {
+      std::vector<std::pair<int, int> >& border = borders_[s];
+      border.clear ();
+      for (int k = slab_start_[s]; k < slab_start_[s + 1]; k++)
+      {
+        const int voxel = slab_voxels_[k];
+        const int* c = &voxel_coordinates_[3 * voxel];
+        joinVoxels (voxel, voxel, false);
+        for (int o = 0; o < 13; o++)
+        {
+          const int neighbour = voxels_.find (c[0] + offsets[o][0], c[1] + offsets[o][1], c[2] + offsets[o][2]);
+          if (neighbour < 0)
+            continue;
+          if (slabOf (neighbour) != s)
+            border.push_back (std::make_pair (voxel, neighbour));
+          else
+            joinVoxels (voxel, neighbour, false);
+        }
+      }
+    }
+  }
+
+  // unites the points of voxels a and b closer than the tolerance. skip_joined
+  // tests the roots first, which pays off once most points are connected.
+  void
+  joinVoxels (int a, int b, bool skip_joined)
+  {
+    const float squared_tolerance = tolerance_ * tolerance_;
+    for (int i = voxel_start_[a]; i < voxel_start_[a + 1]; i++)
+    {
+      const int first = a == b ? i + 1 : voxel_start_[b];
+      for (int j = first; j < voxel_start_[b + 1]; j++)
+      {
+        if (skip_joined && find (i) == find (j))
+          continue;
+        const float dx = x_[i] - x_[j], dy = y_[i] - y_[j], dz = z_[i] - z_[j];
+        if (dx * dx + dy * dy + dz * dz <= squared_tolerance)
+          unite (i, j);
+      }
+    }
+  }
+
+  static const int MAX_SLAB_NUM = 64;
+
+  float tolerance_;
+  int min_cluster_size_;
+  int max_cluster_size_;
+  WorkStealingPool* pool_;
+
+  VoxelHashTable voxels_;
+  std::vector<int> voxel_of_;
+  std::vector<int> voxel_coordinates_;
+  std::vector<int> voxel_start_;
+  std::vector<int> fill_;
+  // points sorted by voxel
+  std::vector<int> position_of_;
+  std::vector<float> x_, y_, z_;
+  std::vector<int> parent_;
+  std::vector<int> label_;
+  int min_x_;
+  int slab_width_;
+  std::vector<int> slab_start_;
+  std::vector<int> slab_voxels_;
+  std::vector<std::vector<std::pair<int, int> > > borders_;
+};
+
+// Table plane followed from frame to frame. The convex hull found at the
+// initialization is rasterized into an occupancy mask in the coordinates of
+// the plane (those of estimatePlaneCoordinate), so whether a point lies on
+// the table is one transformation and one lookup. Every frame the plane is
+// refit by least squares to the points the previous plane predicts as its
+// inliers, a few times with the inliers of the refined plane, instead of
+// running RANSAC again.
+class TablePlaneTracker
+{
+public:
+  TablePlaneTracker ()
+  : valid_ (false)
+  , inlier_threshold_ (0.01f)
+  , table_thickness_ (0.01f)
+  , min_inliers_ (50)
+  , cell_size_ (0.01f)
+  , width_ (0)
+  , height_ (0)
+  {
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  // starts from the coordinate frame plane_trans of the plane and its convex
+  // hull
+  template <typename PointT> void
+  setPlane (const Eigen::Matrix4f &plane_trans, const pcl::PointCloud<PointT> &hull)
+  {
+    valid_ = false;
+    if (hull.points.size () < 3)
+      return;
+    frame_ = Eigen::Affine3f (plane_trans);
+    refit_frame_ = frame_;
+
+    std::vector<Eigen::Vector2f> polygon (hull.points.size ());
+    Eigen::Vector2f min = Eigen::Vector2f::Constant (std::numeric_limits<float>::max ());
+    Eigen::Vector2f max = -min;
+    const Eigen::Affine3f to_plane = frame_.inverse ();
+    for (size_t i = 0; i < hull.points.size (); i++)
+    {
+      const Eigen::Vector3f local = to_plane * hull.points[i].getVector3fMap ();
+      polygon[i] = local.head<2> ();
+      min = min.cwiseMin (polygon[i]);
+      max = max.cwiseMax (polygon[i]);
+    }
+    // one cell of margin, dilated below so that the rim of the table counts
+    cell_size_ = std::max (0.01f, (max - min).maxCoeff () / MAX_MASK_SIZE);
+    origin_ = min - Eigen::Vector2f::Constant (cell_size_);
+    width_ = static_cast<int> ((max[0] - min[0]) / cell_size_) + 3;
+    height_ = static_cast<int> ((max[1] - min[1]) / cell_size_) + 3;
+    std::vector<uint8_t> inside (static_cast<size_t> (width_) * height_);
+    for (int v = 0; v < height_; v++)
+      for (int u = 0; u < width_; u++)
+        inside[v * width_ + u] = insidePolygon (polygon, origin_ + cell_size_ * Eigen::Vector2f (u + 0.5f, v + 0.5f));
+    mask_.assign (inside.size (), 0);
+    for (int v = 0; v < height_; v++)
+      for (int u = 0; u < width_; u++)
+        for (int dv = std::max (v - 1, 0); dv <= std::min (v + 1, height_ - 1) && !mask_[v * width_ + u]; dv++)
+          for (int du = std::max (u - 1, 0); du <= std::min (u + 1, width_ - 1); du++)
+            mask_[v * width_ + u] |= inside[dv * width_ + du];
+    valid_ = true;
+  }
+
+  // refits the plane to cloud, false (keeping the previous plane) when too
+  // few points are left near it
+  template <typename PointT> bool
+  update (const pcl::PointCloud<PointT> &cloud)
+  {
+    if (!valid_)
+      return (false);
+    refit_frame_ = frame_;
+    for (int iteration = 0; iteration < REFIT_ITERATIONS; iteration++)
+    {
+      const Eigen::Affine3f to_plane = refit_frame_.inverse ();
+      Eigen::Vector3d sum = Eigen::Vector3d::Zero ();
+      Eigen::Matrix3d products = Eigen::Matrix3d::Zero ();
+      size_t inliers = 0;
+      for (size_t i = 0; i < cloud.points.size (); i++)
+      {
+        const Eigen::Vector3f p = cloud.points[i].getVector3fMap ();
+        const Eigen::Vector3f local = to_plane * p;
+        if (!(fabsf (local[2]) < inlier_threshold_) || !onTable (local))
+          continue;
+        const Eigen::Vector3d q = p.cast<double> ();
+        sum += q;
+        products += q * q.transpose ();
+        ++inliers;
+      }
+      if (iteration == 0)
+        STAGE_RECORD_UNIT ("table.inliers", "points", inliers);
+      if (inliers < min_inliers_)
+        return (false);
+      const Eigen::Vector3d centroid = sum / static_cast<double> (inliers);
+      const Eigen::Matrix3d covariance = products / static_cast<double> (inliers) - centroid * centroid.transpose ();
+      Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver (covariance);
+      Eigen::Vector3f normal = solver.eigenvectors ().col (0).cast<float> ();
+      // keep the axes of the frame, tilted onto the new plane
+      Eigen::Matrix3f rotation = refit_frame_.linear ();
+      if (normal.dot (rotation.col (2)) < 0.0f)
+        normal = -normal;
+      const Eigen::Vector3f x = (rotation.col (0) - rotation.col (0).dot (normal) * normal).normalized ();
+      rotation.col (0) = x;
+      rotation.col (1) = normal.cross (x);
+      rotation.col (2) = normal;
+      const Eigen::Vector3f origin = refit_frame_.translation ();
+      refit_frame_.linear () = rotation;
+      refit_frame_.translation () = origin - normal.dot (origin - centroid.cast<float> ()) * normal;
+    }
+    frame_ = refit_frame_;
+    return (true);
+  }
+
+  // copies the points of cloud that are not on the table to result
+  template <typename PointT> void
+  removeTable (const pcl::PointCloud<PointT> &cloud, pcl::PointCloud<PointT> &result) const
+  {
+    result.points.resize (cloud.points.size ());
+    size_t size = 0;
+    const Eigen::Affine3f to_plane = frame_.inverse ();
+    for (size_t i = 0; i < cloud.points.size (); i++)
+    {
+      const Eigen::Vector3f local = to_plane * cloud.points[i].getVector3fMap ();
+      if (valid_ && fabsf (local[2]) < table_thickness_ && onTable (local))
+        continue;
+      result.points[size++] = cloud.points[i];
+    }
+    result.points.resize (size);
+    result.width = static_cast<uint32_t> (size);
+    result.height = 1;
+    result.is_dense = cloud.is_dense;
+    result.header = cloud.header;
+  }
+
+  // copies the points of cloud above the table, the prism of its hull from
+  // the table thickness on, to result
+  template <typename PointT> void
+  extractAbove (const pcl::PointCloud<PointT> &cloud, pcl::PointCloud<PointT> &result) const
+  {
+    result.points.clear ();
+    const Eigen::Affine3f to_plane = frame_.inverse ();
+    for (size_t i = 0; i < cloud.points.size (); i++)
+    {
+      const Eigen::Vector3f local = to_plane * cloud.points[i].getVector3fMap ();
+      if (local[2] >= table_thickness_ && onTable (local))
+        result.points.push_back (cloud.points[i]);
+    }
+    result.width = static_cast<uint32_t> (result.points.size ());
+    result.height = 1;
+    result.is_dense = cloud.is_dense;
+    result.header = cloud.header;
+  }
+
+  bool
+  isValid () const
+  {
+    return (valid_);
+  }
+
+  // the coordinate frame of the plane, as estimatePlaneCoordinate
+  Eigen::Matrix4f
+  getTransformation () const
+  {
+    return (frame_.matrix ());
+  }
+
+private:
+  bool
+  onTable (const Eigen::Vector3f &local) const
+  {
+    const int u = static_cast<int> (floorf ((local[0] - origin_[0]) / cell_size_));
+    const int v = static_cast<int> (floorf ((local[1] - origin_[1]) / cell_size_));
+    return (u >= 0 && u < width_ && v >= 0 && v < height_ && mask_[v * width_ + u]);
+  }
+
+  // crossing number test
+  static bool
+  insidePolygon (const std::vector<Eigen::Vector2f> &polygon, const Eigen::Vector2f &p)
+  {
+    bool inside = false;
+    for (size_t i = 0, j = polygon.size () - 1; i < polygon.size (); j = i++)
+    {
+      const Eigen::Vector2f& a = polygon[i];
+      const Eigen::Vector2f& b = polygon[j];
+      if ((a[1] > p[1]) != (b[1] > p[1]) &&
+          p[0] < (b[0] - a[0]) * (p[1] - a[1]) / (b[1] - a[1]) + a[0])
+        inside = !inside;
+    }
+    return (inside);
+  }
+
+  static const int REFIT_ITERATIONS = 3;
+  static const int MAX_MASK_SIZE = 512;
+
+  bool valid_;
+  float inlier_threshold_;
+  float table_thickness_;
+  size_t min_inliers_;
+  Eigen::Affine3f frame_;
+  Eigen::Affine3f refit_frame_;
+  // occupancy of the hull in cells of cell_size_ from origin_ on
+  float cell_size_;
+  Eigen::Vector2f origin_;
+  int width_;
+  int height_;
+  std::vector<uint8_t> mask_;
+};
+
+// acos on [-1, 1] from Abramowitz and Stegun 4.4.46, absolute error below
+// 2e-8, so that the scalar and the vector coherences agree
+inline float
+approximateAcos (float x)
+{
+  const float a = fabsf (x);
+  float p = -0.0012624911f;
+  p = p * a + 0.0066700901f;
+  p = p * a - 0.0170881256f;
+  p = p * a + 0.0308918810f;
+  p = p * a - 0.0501743046f;
+  p = p * a + 0.0889789874f;
+  p = p * a - 0.2145988016f;
+  p = p * a + 1.5707963050f;
+  const float r = sqrtf (1.0f - a) * p;
+  return (x < 0.0f ? static_cast<float> (M_PI) - r : r);
+}
+
+#ifdef __AVX2__
+inline __m256
+approximateAcos (__m256 x)
+{
+  const __m256 a = _mm256_andnot_ps (_mm256_set1_ps (-0.0f), x);
+  __m256 p = _mm256_set1_ps (-0.0012624911f);
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (0.0066700901f));
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (-0.0170881256f));
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (0.0308918810f));
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (-0.0501743046f));
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (0.0889789874f));
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (-0.2145988016f));
+  p = _mm256_add_ps (_mm256_mul_ps (p, a), _mm256_set1_ps (1.5707963050f));
+  const __m256 r = _mm256_mul_ps (_mm256_sqrt_ps (_mm256_sub_ps (_mm256_set1_ps (1.0f), a)), p);
+  const __m256 negative = _mm256_cmp_ps (x, _mm256_setzero_ps (), _CMP_LT_OQ);
+  return (_mm256_blendv_ps (r, _mm256_sub_ps (_mm256_set1_ps (static_cast<float> (M_PI)), r), negative));
+}
+#endif
+
+// Distance, HSV color and normal point coherences in structure-of-arrays
+// form, scoring eight pairs of transformed reference and nearest target
+// points at a time. Colors are converted to HSV and normals normalized once
+// per cloud instead of once per pair. The formulas follow DistanceCoherence,
+// HSVColorCoherence and NormalCoherence, in float instead of double. The
+// target, which the pairs gather from at random, is read either from the
+// same arrays as the reference or from CompactPoint records.
+class BatchedCoherence
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBNormal> RefCloud;
+  typedef pcl::tracking::PointCoherence<pcl::PointXYZRGBNormal>::Ptr PointCoherencePtr;
+
+  // per point attributes, padded to a multiple of eight with the last point.
+  // a normal NormalCoherence rejects is stored as NaN.
+  struct Attributes
+  {
+    std::vector<float> x, y, z;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> h, s, v;
+  };
+
+  // the attributes of a point in 16 bytes instead of 36, so that a pair
+  // gathers from one cache line instead of nine arrays: the position in
+  // steps of CompactAttributes::step from its origin, the hue in 16 and
+  // saturation and value in 8 bits, and the normal octahedral encoded,
+  // with nu = INVALID_NORMAL for a rejected one. the fields are grouped by
+  // 32 bit word as the AVX2 path gathers them.
+  struct CompactPoint
+  {
+    int16_t x, y;
+    int16_t z;
+    uint16_t h;
+    int16_t nu, nv;
+    uint8_t s, v;
+    uint16_t reserved;
+  };
+
+  // the origin is the center of the bounding box of the cloud, which is the
+  // region of interest under gating, and the step resolves its larger half
+  // extent in 15 bits, e.g. 0.06 mm for a 4 m box
+  struct CompactAttributes
+  {
+    std::vector<CompactPoint, Eigen::aligned_allocator<CompactPoint> > points;
+    float origin[3];
+    float step;
+  };
+
+  enum { INVALID_NORMAL = -32768 };
+
+  BatchedCoherence ()
+  : use_distance_ (false)
+  , use_color_ (false)
+  , use_normal_ (false)
+  , distance_weight_ (0.0f)
+  , color_weight_ (0.0f)
+  , h_weight_ (0.0f)
+  , s_weight_ (0.0f)
+  , v_weight_ (0.0f)
+  , normal_weight_ (0.0f)
+  {
+  }
+
+  // takes over the weights of coherences; false if one of them is not a
+  // distance, HSV color or normal coherence, or appears twice
+  bool
+  configure (const std::vector<PointCoherencePtr> &coherences)
+  {
+    use_distance_ = use_color_ = use_normal_ = false;
+    for (size_t i = 0; i < coherences.size (); i++)
+    {
+      boost::shared_ptr<pcl::tracking::DistanceCoherence<pcl::PointXYZRGBNormal> > distance
+        = boost::dynamic_pointer_cast<pcl::tracking::DistanceCoherence<pcl::PointXYZRGBNormal> > (coherences[i]);
+      boost::shared_ptr<pcl::tracking::HSVColorCoherence<pcl::PointXYZRGBNormal> > color
+        = boost::dynamic_pointer_cast<pcl::tracking::HSVColorCoherence<pcl::PointXYZRGBNormal> > (coherences[i]);
+      boost::shared_ptr<pcl::tracking::NormalCoherence<pcl::PointXYZRGBNormal> > normal
+        = boost::dynamic_pointer_cast<pcl::tracking::NormalCoherence<pcl::PointXYZRGBNormal> > (coherences[i]);
+      if (distance && !use_distance_)
+      {
+        use_distance_ = true;
+        distance_weight_ = static_cast<float> (distance->getWeight ());
+      }
+      else if (color && !use_color_)
+      {
+        use_color_ = true;
+        color_weight_ = static_cast<float> (color->getWeight ());
+        h_weight_ = static_cast<float> (color->getHWeight ());
+        s_weight_ = static_cast<float> (color->getSWeight ());
+        v_weight_ = static_cast<float> (color->getVWeight ());
+      }
+      else if (normal && !use_normal_)
+      {
+        use_normal_ = true;
+        normal_weight_ = static_cast<float> (normal->getWeight ());
+      }
+      else
+        return (false);
+    }
+    return (true);
+  }
+
+  static void
+  computeAttributes (const RefCloud &cloud, Attributes &attributes)
+  {
+    const size_t size = cloud.points.size ();
+    const size_t padded_size = (size + 7) & ~static_cast<size_t> (7);
+    std::vector<float>* arrays[9] = { &attributes.x, &attributes.y, &attributes.z,
+                                      &attributes.nx, &attributes.ny, &attributes.nz,
+                                      &attributes.h, &attributes.s, &attributes.v };
+    for (int k = 0; k < 9; k++)
+      arrays[k]->resize (padded_size);
+    const float nan = std::numeric_limits<float>::quiet_NaN ();
+    for (size_t i = 0; i < padded_size; i++)
+    {
+      const pcl::PointXYZRGBNormal& p = cloud.points[std::min (i, size - 1)];
+      attributes.x[i] = p.x;
+      attributes.y[i] = p.y;
+      attributes.z[i] = p.z;
+      const float norm = sqrtf (p.normal[0] * p.normal[0] + p.normal[1] * p.normal[1] + p.normal[2] * p.normal[2]);
+      const bool valid = norm > 1e-5f;
+      attributes.nx[i] = valid ? p.normal[0] / norm : nan;
+      attributes.ny[i] = valid ? p.normal[1] / norm : nan;
+      attributes.nz[i] = valid ? p.normal[2] / norm : nan;
+      // HSVColorCoherence passes red, blue, green
+      pcl::tracking::RGB2HSV (p.r, p.b, p.g, attributes.h[i], attributes.s[i], attributes.v[i]);
+    }
+  }
+
+  static void
+  computeAttributes (const RefCloud &cloud, CompactAttributes &attributes)
+  {
+    const size_t size = cloud.points.size ();
+    attributes.points.resize (size);
+    Eigen::Vector3f min = Eigen::Vector3f::Constant (std::numeric_limits<float>::max ());
+    Eigen::Vector3f max = -min;
+    for (size_t i = 0; i < size; i++)
+    {
+      min = min.cwiseMin (cloud.points[i].getVector3fMap ());
+      max = max.cwiseMax (cloud.points[i].getVector3fMap ());
+    }
+    const Eigen::Vector3f origin = size > 0 ? Eigen::Vector3f (0.5f * (min + max)) : Eigen::Vector3f::Zero ();
+    const float half_extent = size > 0 ? 0.5f * (max - min).maxCoeff () : 0.0f;
+    attributes.step = std::max (half_extent / 32767.0f, 1e-9f);
+    for (int k = 0; k < 3; k++)
+      attributes.origin[k] = origin[k];
+    const float inverse_step = 1.0f / attributes.step;
+    for (size_t i = 0; i < size; i++)
+    {
+      const pcl::PointXYZRGBNormal& p = cloud.points[i];
+      CompactPoint& c = attributes.points[i];
+      c.x = static_cast<int16_t> (lrintf ((p.x - origin[0]) * inverse_step));
+      c.y = static_cast<int16_t> (lrintf ((p.y - origin[1]) * inverse_step));
+      c.z = static_cast<int16_t> (lrintf ((p.z - origin[2]) * inverse_step));
+      float h, s, v;
+      pcl::tracking::RGB2HSV (p.r, p.b, p.g, h, s, v);
+      c.h = static_cast<uint16_t> (lrintf (std::min (std::max (h, 0.0f), 1.0f) * 65535.0f));
+      c.s = static_cast<uint8_t> (lrintf (std::min (std::max (s, 0.0f), 1.0f) * 255.0f));
+      c.v = static_cast<uint8_t> (lrintf (std::min (std::max (v, 0.0f), 1.0f) * 255.0f));
+      c.reserved = 0;
+      // projected onto the octahedron, the lower half folded over the upper
+      const float l1 = fabsf (p.normal[0]) + fabsf (p.normal[1]) + fabsf (p.normal[2]);
+      if (!(l1 > 1e-5f))
+      {
+        c.nu = INVALID_NORMAL;
+        c.nv = 0;
+        continue;
+      }
+      float u = p.normal[0] / l1, w = p.normal[1] / l1;
+      if (p.normal[2] < 0.0f)
+      {
+        const float folded_u = (1.0f - fabsf (w)) * (u >= 0.0f ? 1.0f : -1.0f);
+        w = (1.0f - fabsf (u)) * (w >= 0.0f ? 1.0f : -1.0f);
+        u = folded_u;
+      }
+      c.nu = static_cast<int16_t> (lrintf (u * 32767.0f));
+      c.nv = static_cast<int16_t> (lrintf (w * 32767.0f));
+    }
+  }
+
+  // sum of the coherence products of the count pairs (x[i], y[i], z[i]) and
+  // target point nearest[i], where reference point offset + i supplies color
+  // and normal. pairs with nearest[i] < 0 do not contribute. TargetT is
+  // Attributes or CompactAttributes.
+  template <typename TargetT> double
+  score (const Attributes &reference, const TargetT &target, size_t offset,
+         const float* x, const float* y, const float* z, const int* nearest, size_t count) const
+  {
+    if (size (target) == 0)
+      return (0.0);
+    size_t i = 0;
+    double val = 0.0;
+#ifdef __AVX2__
+    const __m256 one = _mm256_set1_ps (1.0f);
+    __m256 sum = _mm256_setzero_ps ();
+    for (; i + 8 <= count; i += 8)
+    {
+      const __m256i index = _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (nearest + i));
+      const __m256 matched = _mm256_castsi256_ps (_mm256_cmpgt_epi32 (index, _mm256_set1_epi32 (-1)));
+      const __m256i target_index = _mm256_max_epi32 (index, _mm256_setzero_si256 ());
+      __m256 val8 = one;
+      if (use_distance_)
+      {
+        __m256 tx, ty, tz;
+        gatherPosition (target, target_index, tx, ty, tz);
+        const __m256 dx = _mm256_sub_ps (_mm256_loadu_ps (x + i), tx);
+        const __m256 dy = _mm256_sub_ps (_mm256_loadu_ps (y + i), ty);
+        const __m256 dz = _mm256_sub_ps (_mm256_loadu_ps (z + i), tz);
+        const __m256 d2 = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (dx, dx), _mm256_mul_ps (dy, dy)), _mm256_mul_ps (dz, dz));
+        const __m256 term = _mm256_div_ps (one, _mm256_add_ps (one, _mm256_mul_ps (_mm256_set1_ps (distance_weight_), d2)));
+        val8 = _mm256_mul_ps (val8, term);
+      }
+      if (use_color_)
+      {
+        const __m256 half = _mm256_set1_ps (0.5f);
+        __m256 th, ts, tv;
+        gatherColor (target, target_index, th, ts, tv);
+        __m256 dh = _mm256_sub_ps (_mm256_loadu_ps (&reference.h[offset + i]), th);
+        dh = _mm256_andnot_ps (_mm256_set1_ps (-0.0f), dh);
+        dh = _mm256_blendv_ps (dh, _mm256_sub_ps (dh, half), _mm256_cmp_ps (dh, half, _CMP_GT_OQ));
+        const __m256 ds = _mm256_sub_ps (_mm256_loadu_ps (&reference.s[offset + i]), ts);
+        const __m256 dv = _mm256_sub_ps (_mm256_loadu_ps (&reference.v[offset + i]), tv);
+        const __m256 diff2 = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (_mm256_set1_ps (h_weight_), _mm256_mul_ps (dh, dh)),
+                                                           _mm256_mul_ps (_mm256_set1_ps (s_weight_), _mm256_mul_ps (ds, ds))),
+                                            _mm256_mul_ps (_mm256_set1_ps (v_weight_), _mm256_mul_ps (dv, dv)));
+        val8 = _mm256_mul_ps (val8, _mm256_div_ps (one, _mm256_add_ps (one, _mm256_mul_ps (_mm256_set1_ps (color_weight_), diff2))));
+      }
+      if (use_normal_)
+      {
+        __m256 tnx, tny, tnz;
+        gatherNormal (target, target_index, tnx, tny, tnz);
+        const __m256 dot = _mm256_add_ps (_mm256_add_ps (
+          _mm256_mul_ps (_mm256_loadu_ps (&reference.nx[offset + i]), tnx),
+          _mm256_mul_ps (_mm256_loadu_ps (&reference.ny[offset + i]), tny)),
+          _mm256_mul_ps (_mm256_loadu_ps (&reference.nz[offset + i]), tnz));
+        // a rejected normal gives NaN, which scores 0
+        const __m256 valid = _mm256_cmp_ps (dot, dot, _CMP_ORD_Q);
+        const __m256 theta = approximateAcos (_mm256_min_ps (_mm256_max_ps (dot, _mm256_set1_ps (-1.0f)), one));
+        const __m256 term = _mm256_div_ps (one, _mm256_add_ps (one, _mm256_mul_ps (_mm256_set1_ps (normal_weight_),
+                                                                                   _mm256_mul_ps (theta, theta))));
+        val8 = _mm256_mul_ps (val8, _mm256_and_ps (term, valid));
+      }
+      sum = _mm256_add_ps (sum, _mm256_and_ps (val8, matched));
+    }
+    EIGEN_ALIGN16 float lanes[8];
+    _mm256_storeu_ps (lanes, sum);
+    for (int k = 0; k < 8; k++)
+      val += lanes[k];
+#endif
+    for (; i < count; i++)
+      if (nearest[i] >= 0)
+        val += scorePair (reference, target, offset + i, x[i], y[i], z[i], nearest[i]);
+    return (val);
+  }
+
+protected:
+  static size_t
+  size (const Attributes &attributes)
+  {
+    return (attributes.x.size ());
+  }
+
+  static size_t
+  size (const CompactAttributes &attributes)
+  {
+    return (attributes.points.size ());
+  }
+
+  // attributes of target point t; a rejected normal is NaN
+  static void
+  position (const Attributes &attributes, int t, float &x, float &y, float &z)
+  {
+    x = attributes.x[t];
+    y = attributes.y[t];
+    z = attributes.z[t];
+  }
+
+  static void
+  position (const CompactAttributes &attributes, int t, float &x, float &y, float &z)
+  {
+    const CompactPoint& c = attributes.points[t];
+    x = attributes.origin[0] + attributes.step * c.x;
+    y = attributes.origin[1] + attributes.step * c.y;
+    z = attributes.origin[2] + attributes.step * c.z;
+  }
+
+  static void
+  color (const Attributes &attributes, int t, float &h, float &s, float &v)
+  {
+    h = attributes.h[t];
+    s = attributes.s[t];
+    v = attributes.v[t];
+  }
+
+  static void
+  color (const CompactAttributes &attributes, int t, float &h, float &s, float &v)
+  {
+    const CompactPoint& c = attributes.points[t];
+    h = c.h * (1.0f / 65535.0f);
+    s = c.s * (1.0f / 255.0f);
+    v = c.v * (1.0f / 255.0f);
+  }
+
+  static void
+  normal (const Attributes &attributes, int t, float &nx, float &ny, float &nz)
+  {
+    nx = attributes.nx[t];
+    ny = attributes.ny[t];
+    nz = attributes.nz[t];
+  }
+
+  static void
+  normal (const CompactAttributes &attributes, int t, float &nx, float &ny, float &nz)
+  {
+    const CompactPoint& c = attributes.points[t];
+    if (c.nu == INVALID_NORMAL)
+    {
+      nx = ny = nz = std::numeric_limits<float>::quiet_NaN ();
+      return;
+    }
+    // unfolds the lower half of the octahedron
+    float u = c.nu * (1.0f / 32767.0f), w = c.nv * (1.0f / 32767.0f);
+    nz = 1.0f - fabsf (u) - fabsf (w);
+    const float fold = std::max (-nz, 0.0f);
+    u += u >= 0.0f ? -fold : fold;
+    w += w >= 0.0f ? -fold : fold;
+    const float inverse_norm = 1.0f / sqrtf (u * u + w * w + nz * nz);
+    nx = u * inverse_norm;
+    ny = w * inverse_norm;
+    nz *= inverse_norm;
+  }
+
+#ifdef __AVX2__
+  static void
+  gatherPosition (const Attributes &attributes, __m256i index, __m256 &x, __m256 &y, __m256 &z)
+  {
+    x = _mm256_i32gather_ps (&attributes.x[0], index, 4);
+    y = _mm256_i32gather_ps (&attributes.y[0], index, 4);
+    z = _mm256_i32gather_ps (&attributes.z[0], index, 4);
+  }
+
+  static void
+  gatherColor (const Attributes &attributes, __m256i index, __m256 &h, __m256 &s, __m256 &v)
+  {
+    h = _mm256_i32gather_ps (&attributes.h[0], index, 4);
+    s = _mm256_i32gather_ps (&attributes.s[0], index, 4);
+    v = _mm256_i32gather_ps (&attributes.v[0], index, 4);
+  }
+
+  static void
+  gatherNormal (const Attributes &attributes, __m256i index, __m256 &nx, __m256 &ny, __m256 &nz)
+  {
+    nx = _mm256_i32gather_ps (&attributes.nx[0], index, 4);
+    ny = _mm256_i32gather_ps (&attributes.ny[0], index, 4);
+    nz = _mm256_i32gather_ps (&attributes.nz[0], index, 4);
+  }
+
+  // 32 bit word of the CompactPoint records at index
+  static __m256i
+  gatherWord (const CompactAttributes &attributes, __m256i index, int word)
+  {
+    const int* base = reinterpret_cast<const int*> (&attributes.points[0]) + word;
+    return (_mm256_i32gather_epi32 (base, _mm256_slli_epi32 (index, 2), 4));
+  }
+
+  static __m256
+  lowSigned (__m256i words)
+  {
+    return (_mm256_cvtepi32_ps (_mm256_srai_epi32 (_mm256_slli_epi32 (words, 16), 16)));
+  }
+
+  static __m256
+  highSigned (__m256i words)
+  {
+    return (_mm256_cvtepi32_ps (_mm256_srai_epi32 (words, 16)));
+  }
+
+  static void
+  gatherPosition (const CompactAttributes &attributes, __m256i index, __m256 &x, __m256 &y, __m256 &z)
+  {
+    const __m256i xy = gatherWord (attributes, index, 0);
+    const __m256i zh = gatherWord (attributes, index, 1);
+    const __m256 step = _mm256_set1_ps (attributes.step);
+    x = _mm256_add_ps (_mm256_set1_ps (attributes.origin[0]), _mm256_mul_ps (step, lowSigned (xy)));
+    y = _mm256_add_ps (_mm256_set1_ps (attributes.origin[1]), _mm256_mul_ps (step, highSigned (xy)));
+    z = _mm256_add_ps (_mm256_set1_ps (attributes.origin[2]), _mm256_mul_ps (step, lowSigned (zh)));
+  }
+
+  static void
+  gatherColor (const CompactAttributes &attributes, __m256i index, __m256 &h, __m256 &s, __m256 &v)
+  {
+    const __m256i zh = gatherWord (attributes, index, 1);
+    const __m256i sv = gatherWord (attributes, index, 3);
+    const __m256i byte = _mm256_set1_epi32 (0xff);
+    const __m256 byte_scale = _mm256_set1_ps (1.0f / 255.0f);
+    h = _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_srli_epi32 (zh, 16)), _mm256_set1_ps (1.0f / 65535.0f));
+    s = _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_and_si256 (sv, byte)), byte_scale);
+    v = _mm256_mul_ps (_mm256_cvtepi32_ps (_mm256_and_si256 (_mm256_srli_epi32 (sv, 8), byte)), byte_scale);
+  }
+
+  static void
+  gatherNormal (const CompactAttributes &attributes, __m256i index, __m256 &nx, __m256 &ny, __m256 &nz)
+  {
+    const __m256i uv = gatherWord (attributes, index, 2);
+    const __m256 sign = _mm256_set1_ps (-0.0f);
+    const __m256 scale = _mm256_set1_ps (1.0f / 32767.0f);
+    __m256 u = _mm256_mul_ps (lowSigned (uv), scale);
+    __m256 w = _mm256_mul_ps (highSigned (uv), scale);
+    nz = _mm256_sub_ps (_mm256_sub_ps (_mm256_set1_ps (1.0f), _mm256_andnot_ps (sign, u)), _mm256_andnot_ps (sign, w));
+    // moves u and w towards 0 by the fold
+    const __m256 fold = _mm256_max_ps (_mm256_sub_ps (_mm256_setzero_ps (), nz), _mm256_setzero_ps ());
+    u = _mm256_sub_ps (u, _mm256_or_ps (fold, _mm256_and_ps (sign, u)));
+    w = _mm256_sub_ps (w, _mm256_or_ps (fold, _mm256_and_ps (sign, w)));
+    const __m256 inverse_norm = _mm256_div_ps (_mm256_set1_ps (1.0f), _mm256_sqrt_ps (_mm256_add_ps (
+      _mm256_add_ps (_mm256_mul_ps (u, u), _mm256_mul_ps (w, w)), _mm256_mul_ps (nz, nz))));
+    const __m256 invalid = _mm256_castsi256_ps (_mm256_cmpeq_epi32 (_mm256_slli_epi32 (uv, 16),
+                                                                    _mm256_set1_epi32 (INVALID_NORMAL * 65536)));
+    const __m256 nan = _mm256_set1_ps (std::numeric_limits<float>::quiet_NaN ());
+    nx = _mm256_blendv_ps (_mm256_mul_ps (u, inverse_norm), nan, invalid);
+    ny = _mm256_blendv_ps (_mm256_mul_ps (w, inverse_norm), nan, invalid);
+    nz = _mm256_blendv_ps (_mm256_mul_ps (nz, inverse_norm), nan, invalid);
+  }
+#endif
+
+  template <typename TargetT> float
+  scorePair (const Attributes &reference, const TargetT &target, size_t r,
+             float x, float y, float z, int t) const
+  {
+    float val = 1.0f;
+    if (use_distance_)
+    {
+      float tx, ty, tz;
+      position (target, t, tx, ty, tz);
+      const float dx = x - tx, dy = y - ty, dz = z - tz;
+      val *= 1.0f / (1.0f + distance_weight_ * (dx * dx + dy * dy + dz * dz));
+    }
+    if (use_color_)
+    {
+      float th, ts, tv;
+      color (target, t, th, ts, tv);
+      float dh = fabsf (reference.h[r] - th);
+      if (dh > 0.5f)
+        dh -= 0.5f;
+      const float ds = reference.s[r] - ts;
+      const float dv = reference.v[r] - tv;
+      val *= 1.0f / (1.0f + color_weight_ * (h_weight_ * dh * dh + s_weight_ * ds * ds + v_weight_ * dv * dv));
+    }
+    if (use_normal_)
+    {
+      float tnx, tny, tnz;
+      normal (target, t, tnx, tny, tnz);
+      const float dot = reference.nx[r] * tnx + reference.ny[r] * tny + reference.nz[r] * tnz;
+      if (!(dot == dot))
+        return (0.0f);
+      const float theta = approximateAcos (std::min (std::max (dot, -1.0f), 1.0f));
+      val *= 1.0f / (1.0f + normal_weight_ * theta * theta);
+    }
+    return (val);
+  }
+
+  bool use_distance_, use_color_, use_normal_;
+  float distance_weight_;
+  float color_weight_, h_weight_, s_weight_, v_weight_;
+  float normal_weight_;
+};
+
+// Input cloud of a frame prepared for BatchedParticleFilterTracker: the
+// BatchedCoherence attributes and either a kd-tree, a VoxelHashSearch or the
+// index of a ProjectiveCloudCoherence to associate reference points with.
+// The trackers of several objects share one per frame.
+class CorrespondenceTarget
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBNormal> RefCloud;
+  typedef boost::shared_ptr<CorrespondenceTarget> Ptr;
+  typedef boost::shared_ptr<const CorrespondenceTarget> ConstPtr;
+
+  CorrespondenceTarget ()
+  : compact_ (false)
+  , search_radius_ (0.0f)
+  {
+  }
+
+  // with a positive radius, the input is indexed in a VoxelHashSearch and
+  // only pairs within the radius are associated, as the projective index
+  // associates them within its maximum distance
+  void
+  setSearchRadius (float radius)
+  {
+    search_radius_ = radius;
+  }
+
+  // indexes cloud in projective, or in a kd-tree or VoxelHashSearch if
+  // projective is null. with compact, the attributes are quantized into
+  // CompactPoint records.
+  void
+  setInputCloud (const RefCloud::ConstPtr &cloud,
+                 const boost::shared_ptr<ProjectiveCloudCoherence<pcl::PointXYZRGBNormal> > &projective,
+                 bool compact = false)
+  {
+    STAGE_TIMER ("correspondenceTarget");
+    compact_ = compact;
+    if (compact_)
+    {
+      BatchedCoherence::computeAttributes (*cloud, compact_attributes_);
+      attributes_ = BatchedCoherence::Attributes ();
+    }
+    else
+    {
+      BatchedCoherence::computeAttributes (*cloud, attributes_);
+      compact_attributes_.points.clear ();
+    }
+    projective_ = projective;
+    tree_.reset ();
+    voxel_search_.reset ();
+    if (projective_)
+      projective_->setTargetCloud (cloud);
+    else if (search_radius_ > 0.0f)
+    {
+      voxel_search_.reset (new VoxelHashSearch<pcl::PointXYZRGBNormal> (search_radius_));
+      voxel_search_->setInputCloud (cloud);
+    }
+    else if (!cloud->points.empty ())
+    {
+      tree_.reset (new pcl::KdTreeFLANN<pcl::PointXYZRGBNormal> ());
+      tree_->setInputCloud (cloud);
+    }
+  }
+
+  bool
+  isCompact () const
+  {
+    return (compact_);
+  }
+
+  // the attributes of the cloud, in the layout isCompact () selects
+  const BatchedCoherence::Attributes&
+  getAttributes () const
+  {
+    return (attributes_);
+  }
+
+  const BatchedCoherence::CompactAttributes&
+  getCompactAttributes () const
+  {
+    return (compact_attributes_);
+  }
+
+  // index of the target point each query point is paired with, or -1
+  void
+  findNearest (const float* x, const float* y, const float* z, size_t count, int* nearest) const
+  {
+    if (projective_)
+    {
+      for (size_t i = 0; i < count; i++)
+        nearest[i] = projective_->nearest (x[i], y[i], z[i]);
+      return;
+    }
+    if (voxel_search_)
+    {
+      voxel_search_->findNearest (x, y, z, count, nearest);
+      return;
+    }
+    if (!tree_)
+    {
+      std::fill (nearest, nearest + count, -1);
+      return;
+    }
+    std::vector<int> k_indices (1);
+    std::vector<float> k_distances (1);
+    pcl::PointXYZRGBNormal point;
+    for (size_t i = 0; i < count; i++)
+    {
+      point.x = x[i];
+      point.y = y[i];
+      point.z = z[i];
+      nearest[i] = tree_->nearestKSearch (point, 1, k_indices, k_distances) > 0 ? k_indices[0] : -1;
+    }
+  }
+
+protected:
+  bool compact_;
+  BatchedCoherence::Attributes attributes_;
+  BatchedCoherence::CompactAttributes compact_attributes_;
+  float search_radius_;
+  pcl::KdTreeFLANN<pcl::PointXYZRGBNormal>::Ptr tree_;
+  VoxelHashSearch<pcl::PointXYZRGBNormal>::Ptr voxel_search_;
+  boost::shared_ptr<ProjectiveCloudCoherence<pcl::PointXYZRGBNormal> > projective_;
+};
+
+// Compact appearance of an object to find it again after the tracker lost
+// it: the spread along its principal axes, a hue/saturation histogram and a
+// histogram of the angles between its normals and the table normal. Sizes
+// are compared in log scale and histograms by their Bhattacharyya
+// coefficient, so distance () is 0 for identical objects and about 1 for
+// unrelated ones.
+struct ObjectDescriptor
+{
+  static const int HUE_BINS = 8;
+  static const int SATURATION_BINS = 4;
+  static const int NORMAL_BINS = 6;
+
+  void
+  compute (const pcl::PointCloud<pcl::PointXYZRGBNormal> &cloud, const Eigen::Vector3f &up)
+  {
+    std::fill (color, color + HUE_BINS * SATURATION_BINS, 0.0f);
+    std::fill (normal, normal + NORMAL_BINS, 0.0f);
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero ();
+    Eigen::Matrix3d products = Eigen::Matrix3d::Zero ();
+    size_t normal_num = 0;
+    for (size_t i = 0; i < cloud.points.size (); i++)
+    {
+      const pcl::PointXYZRGBNormal& p = cloud.points[i];
+      const Eigen::Vector3d q = p.getVector3fMap ().cast<double> ();
+      sum += q;
+      products += q * q.transpose ();
+
+      const int max = std::max (p.r, std::max (p.g, p.b)), min = std::min (p.r, std::min (p.g, p.b));
+      float hue = 0.0f;
+      if (max > min)
+      {
+        const float range = static_cast<float> (max - min);
+        if (max == p.r)
+          hue = (p.g - p.b) / range;
+        else if (max == p.g)
+          hue = 2.0f + (p.b - p.r) / range;
+        else
+          hue = 4.0f + (p.r - p.g) / range;
+        if (hue < 0.0f)
+          hue += 6.0f;
+      }
+      const float saturation = max > 0 ? static_cast<float> (max - min) / max : 0.0f;
+      const int h = std::min (HUE_BINS - 1, static_cast<int> (hue / 6.0f * HUE_BINS));
+      const int s = std::min (SATURATION_BINS - 1, static_cast<int> (saturation * SATURATION_BINS));
+      color[h * SATURATION_BINS + s] += 1.0f;
+
+      const Eigen::Vector3f n (p.normal_x, p.normal_y, p.normal_z);
+      const float norm = n.norm ();
+      if (pcl_isfinite (norm) && norm > 1e-5f)
+      {
+        const float angle = acosf (std::min (1.0f, fabsf (n.dot (up)) / norm));
+        normal[std::min (NORMAL_BINS - 1, static_cast<int> (angle / static_cast<float> (M_PI / 2) * NORMAL_BINS))] += 1.0f;
+        ++normal_num;
+      }
+    }
+    const size_t size = std::max<size_t> (1, cloud.points.size ());
+    for (int b = 0; b < HUE_BINS * SATURATION_BINS; b++)
+      color[b] /= static_cast<float> (size);
+    for (int b = 0; b < NORMAL_BINS; b++)
+      normal[b] /= static_cast<float> (std::max<size_t> (1, normal_num));
+    centroid = (sum / static_cast<double> (size)).cast<float> ();
+    const Eigen::Matrix3d covariance = products / static_cast<double> (size) - centroid.cast<double> () * centroid.cast<double> ().transpose ();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver (covariance);
+    for (int k = 0; k < 3; k++)
+      spread[k] = sqrtf (static_cast<float> (std::max (0.0, solver.eigenvalues ()[2 - k])));
+  }
+
+  float
+  distance (const ObjectDescriptor &other) const
+  {
+    float size = 0.0f;
+    for (int k = 0; k < 3; k++)
+      size += fabsf (logf ((spread[k] + 0.005f) / (other.spread[k] + 0.005f))) / 3.0f;
+    float color_overlap = 0.0f, normal_overlap = 0.0f;
+    for (int b = 0; b < HUE_BINS * SATURATION_BINS; b++)
+      color_overlap += sqrtf (color[b] * other.color[b]);
+    for (int b = 0; b < NORMAL_BINS; b++)
+      normal_overlap += sqrtf (normal[b] * other.normal[b]);
+    return ((size + (1.0f - color_overlap) + (1.0f - normal_overlap)) / 3.0f);
+  }
+
+  Eigen::Vector3f centroid;
+  // standard deviations along the principal axes, largest first
+  Eigen::Vector3f spread;
+  float color[HUE_BINS * SATURATION_BINS];
+  float normal[NORMAL_BINS];
+};
+
+// Reference models of the tracked objects together with the table plane,
+// saved after an online initialization so that a restart tracks from the
+// first frame instead of segmenting it. The file is a header, one entry per
+// object and 64 byte aligned sections: the table hull (xyz), the reference
+// points in their in-memory layout and their nine BatchedCoherence
+// attribute arrays. Only these per reference attributes are cached; no
+// search index is stored, since the batched weighting searches an index
+// built over the input cloud of each frame. The file is read through a
+// memory mapping; the version, the point size and all section bounds are
+// checked before anything is copied.
+class ReferenceModel
+{
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGBNormal> RefCloud;
+
+  struct Object
+  {
+    RefCloud::Ptr reference;
+    BatchedCoherence::Attributes attributes;
+  };
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  ReferenceModel ()
+  : plane_trans (Eigen::Matrix4f::Identity ())
+  {
+  }
+
+  bool
+  save (const std::string &path) const
+  {
+    Header header;
+    std::memcpy (header.magic, MAGIC, sizeof (header.magic));
+    header.version = VERSION;
+    header.point_size = sizeof (pcl::PointXYZRGBNormal);
+    header.object_num = static_cast<uint32_t> (objects.size ());
+    header.hull_size = static_cast<uint32_t> (hull.points.size ());
+    for (int i = 0; i < 16; i++)
+      header.plane_trans[i] = plane_trans (i % 4, i / 4);
+
+    std::vector<ObjectEntry> entries (objects.size ());
+    uint64_t offset = align (sizeof (Header) + entries.size () * sizeof (ObjectEntry));
+    header.hull_offset = offset;
+    offset = align (offset + 3 * sizeof (float) * hull.points.size ());
+    for (size_t k = 0; k < objects.size (); k++)
+    {
+      entries[k].point_num = static_cast<uint32_t> (objects[k].reference->points.size ());
+      entries[k].padded_num = static_cast<uint32_t> (objects[k].attributes.x.size ());
+      entries[k].points_offset = offset;
+      offset = align (offset + sizeof (pcl::PointXYZRGBNormal) * entries[k].point_num);
+      entries[k].attributes_offset = offset;
+      offset = align (offset + ATTRIBUTE_NUM * sizeof (float) * entries[k].padded_num);
+    }
+
+    std::ofstream file (path.c_str (), std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+      PCL_ERROR ("could not write the model %s\n", path.c_str ());
+      return (false);
+    }
+    write (file, &header, sizeof (header));
+    if (!entries.empty ())
+      write (file, &entries[0], entries.size () * sizeof (ObjectEntry));
+    pad (file, header.hull_offset);
+    for (size_t i = 0; i < hull.points.size (); i++)
+      write (file, &hull.points[i].x, 3 * sizeof (float));
+    for (size_t k = 0; k < objects.size (); k++)
+    {
+      pad (file, entries[k].points_offset);
+      if (entries[k].point_num > 0)
+        write (file, &objects[k].reference->points[0], sizeof (pcl::PointXYZRGBNormal) * entries[k].point_num);
+      pad (file, entries[k].attributes_offset);
+      const std::vector<float>* arrays[ATTRIBUTE_NUM];
+      attributeArrays (objects[k].attributes, arrays);
+      for (int a = 0; a < ATTRIBUTE_NUM; a++)
+        if (entries[k].padded_num > 0)
+          write (file, &(*arrays[a])[0], sizeof (float) * entries[k].padded_num);
+    }
+    return (static_cast<bool> (file));
+  }
+
+  bool
+  load (const std::string &path)
+  {
+    namespace bip = boost::interprocess;
+    objects.clear ();
+    hull.points.clear ();
+    bip::mapped_region region;
+    try
+    {
+      bip::file_mapping mapping (path.c_str (), bip::read_only);
+      bip::mapped_region (mapping, bip::read_only).swap (region);
+    }
+    catch (const bip::interprocess_exception &e)
+    {
+      PCL_ERROR ("could not map the model %s: %s\n", path.c_str (), e.what ());
+      return (false);
+    }
+    const char* data = static_cast<const char*> (region.get_address ());
+    const uint64_t size = region.get_size ();
+
+    Header header;
+    if (size < sizeof (Header))
+      return (invalid (path, "truncated header"));
+    std::memcpy (&header, data, sizeof (Header));
+    if (std::memcmp (header.magic, MAGIC, sizeof (header.magic)) != 0)
+      return (invalid (path, "not a reference model"));
+    if (header.version != VERSION)
+      return (invalid (path, "unsupported version"));
+    if (header.point_size != sizeof (pcl::PointXYZRGBNormal))
+      return (invalid (path, "point layout of another build"));
+    if (sizeof (Header) + static_cast<uint64_t> (header.object_num) * sizeof (ObjectEntry) > size)
+      return (invalid (path, "truncated object table"));
+    if (!inside (header.hull_offset, 3 * sizeof (float) * static_cast<uint64_t> (header.hull_size), size))
+      return (invalid (path, "truncated hull"));
+
+    for (int i = 0; i < 16; i++)
+      plane_trans (i % 4, i / 4) = header.plane_trans[i];
+    hull.points.resize (header.hull_size);
+    for (size_t i = 0; i < hull.points.size (); i++)
+      std::memcpy (&hull.points[i].x, data + header.hull_offset + 3 * sizeof (float) * i, 3 * sizeof (float));
+    hull.width = header.hull_size;
+    hull.height = 1;
+
+    objects.resize (header.object_num);
+    for (size_t k = 0; k < objects.size (); k++)
+    {
+      ObjectEntry entry;
+      std::memcpy (&entry, data + sizeof (Header) + k * sizeof (ObjectEntry), sizeof (ObjectEntry));
+      if (entry.point_num == 0 || entry.padded_num != ((entry.point_num + 7) & ~7u) ||
+          !inside (entry.points_offset, sizeof (pcl::PointXYZRGBNormal) * static_cast<uint64_t> (entry.point_num), size) ||
+          !inside (entry.attributes_offset, ATTRIBUTE_NUM * sizeof (float) * static_cast<uint64_t> (entry.padded_num), size))
+      {
+        objects.clear ();
+        return (invalid (path, "truncated object"));
+      }
+      RefCloud::Ptr reference (new RefCloud);
+      reference->points.resize (entry.point_num);
+      std::memcpy (&reference->points[0], data + entry.points_offset, sizeof (pcl::PointXYZRGBNormal) * entry.point_num);
+      reference->width = entry.point_num;
+      reference->height = 1;
+      reference->is_dense = true;
+      objects[k].reference = reference;
+      std::vector<float>* arrays[ATTRIBUTE_NUM];
+      attributeArrays (objects[k].attributes, arrays);
+      const float* attributes = reinterpret_cast<const float*> (data + entry.attributes_offset);
+      for (int a = 0; a < ATTRIBUTE_NUM; a++)
+        arrays[a]->assign (attributes + a * entry.padded_num, attributes + (a + 1) * entry.padded_num);
+    }
+    return (true);
+  }
+
+  Eigen::Matrix4f plane_trans;
+  pcl::PointCloud<pcl::PointXYZRGB> hull;
+  std::vector<Object> objects;
+
+private:
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t point_size;
+    uint32_t object_num;
+    uint32_t hull_size;
+    uint64_t hull_offset;
+    float plane_trans[16];
+  };
+
+  struct ObjectEntry
+  {
+    uint64_t points_offset;
+    uint64_t attributes_offset;
+    uint32_t point_num;
+    uint32_t padded_num;
+  };
+
+  static const int ATTRIBUTE_NUM = 9;
+  static const uint32_t VERSION = 1;
+  static const char MAGIC[8];
+
+  template <typename AttributesT, typename ArrayT> static void
+  attributeArrays (AttributesT &attributes, ArrayT* (&arrays)[ATTRIBUTE_NUM])
+  {
+    ArrayT* all[ATTRIBUTE_NUM] = { &attributes.x, &attributes.y, &attributes.z,
+                                   &attributes.nx, &attributes.ny, &attributes.nz,
+                                   &attributes.h, &attributes.s, &attributes.v };
+    std::copy (all, all + ATTRIBUTE_NUM, arrays);
+  }
+
+  static uint64_t
+  align (uint64_t offset)
+  {
+    return ((offset + 63) & ~static_cast<uint64_t> (63));
+  }
+
+  static bool
+  inside (uint64_t offset, uint64_t length, uint64_t size)
+  {
+    return (offset <= size && length <= size - offset);
+  }
+
+  static void
+  write (std::ofstream &file, const void* data, size_t size)
+  {
+    file.write (static_cast<const char*> (data), size);
+  }
+
+  static void
+  pad (std::ofstream &file, uint64_t offset)
+  {
+    while (static_cast<uint64_t> (file.tellp ()) < offset)
+      file.put (0);
+  }
+
+  static bool
+  invalid (const std::string &path, const char* reason)
+  {
+    PCL_ERROR ("could not load the model %s: %s\n", path.c_str (), reason);
+    return (false);
+  }
+};
+
+const char ReferenceModel::MAGIC[8] = { 'O', 'S', 'T', 'M', 'O', 'D', 'E', 'L' };
+
+// ParticleFilterOMPTracker whose weight () transforms the reference into all
+// particle poses in structure-of-arrays form and scores the pairs with
+// BatchedCoherence, instead of building a transformed cloud per particle and
+// calling each point coherence once per pair. Input cropping, association
+// (kd-tree, or ProjectiveCloudCoherence) and normalization are the same as
+// in the per-particle path, which is kept for configurations it does not
+// cover.
+class BatchedParticleFilterTracker
+  : public pcl::tracking::ParticleFilterOMPTracker<pcl::PointXYZRGBNormal, pcl::tracking::ParticleXYZRPY>
+{
+public:
+  typedef pcl::tracking::ParticleFilterOMPTracker<pcl::PointXYZRGBNormal, pcl::tracking::ParticleXYZRPY> BaseClass;
+  typedef pcl::PointCloud<pcl::PointXYZRGBNormal> RefCloud;
+
+  BatchedParticleFilterTracker (unsigned int nr_threads = 0)
+  : BaseClass (nr_threads)
+  , batched_ (true)
+  , compact_target_ (false)
+  , adaptive_ (false)
+  , min_particle_num_ (0)
+  , max_particle_num_ (0)
+  , budget_particle_num_ (0)
+  , max_iteration_num_ (1)
+  , time_budget_ (0.0)
+  , cost_per_particle_ (0.0)
+  , weighted_particle_num_ (0)
+  , carry_weights_ (false)
+  , refine_fraction_ (1.0f)
+  , match_score_ (std::numeric_limits<float>::quiet_NaN ())
+  , effective_sample_size_ (0.0)
+  , motion_model_ (MOTION_NONE)
+  , predict_pending_ (false)
+  , prediction_valid_ (false)
+  , pool_ (0)
+  {
+    pcl_motion_ratio_ = motion_ratio_;
+    step_.setZero ();
+  }
+
+  enum MotionModel
+  {
+    MOTION_NONE,
+    CONSTANT_VELOCITY,
+    CONSTANT_ACCELERATION
+  };
+
+  // predicts the pose of each frame from the last results, one step per
+  // frame, and moves all particles by the predicted step before they are
+  // weighted. the step noise then only has to cover the prediction error: it
+  // follows the squared residual of the prediction per state dimension,
+  // between MIN_STEP_NOISE_FRACTION of the configured step noise and the
+  // configured step noise. MOTION_NONE keeps the fixed step noise and the
+  // partial motion of resampleWithReplacement ().
+  void
+  setMotionModel (MotionModel model)
+  {
+    motion_model_ = model;
+    motion_ratio_ = model == MOTION_NONE ? pcl_motion_ratio_ : 0.0;
+    resetMotion ();
+  }
+
+  // translation and rotation the motion model predicted for the last frame
+  const Eigen::Matrix<float, 6, 1>&
+  getPredictedStep () const
+  {
+    return (step_);
+  }
+
+  // runs the batched weighting on the workers of pool instead of OpenMP
+  void
+  setWorkerPool (WorkStealingPool* pool)
+  {
+    pool_ = pool;
+  }
+
+  // input prepared once for all trackers of a frame; the batched weighting
+  // then pairs with the whole frame instead of cropping it per tracker
+  void
+  setSharedTarget (const CorrespondenceTarget::ConstPtr &target)
+  {
+    shared_target_ = target;
+  }
+
+  void
+  setBatchedWeighting (bool batched)
+  {
+    batched_ = batched;
+  }
+
+  // whether the target the tracker crops from its input itself is scored in
+  // the CompactPoint layout; a shared target has its own setting
+  void
+  setCompactTarget (bool compact)
+  {
+    compact_target_ = compact;
+  }
+
+  // radius of the VoxelHashSearch of that target, 0 for a kd-tree
+  void
+  setSearchRadius (float radius)
+  {
+    own_target_.setSearchRadius (radius);
+  }
+
+  // mean point coherence of the best particle of the last weighting, from 0
+  // to 1 for a perfect match; NaN when the per-particle path weighted them
+  float
+  getMatchScore () const
+  {
+    return (match_score_);
+  }
+
+  // effective sample size of the last weights, from 1 when a single particle
+  // carries all weight to the particle count for uniform weights
+  double
+  getEffectiveSampleSize () const
+  {
+    return (effective_sample_size_);
+  }
+
+  // restarts the particles at trans, e.g. after re-acquiring a lost object
+  void
+  reseed (const Eigen::Affine3f &trans)
+  {
+    setTrans (trans);
+    resetTracking ();
+    carry_weights_ = false;
+    prior_weights_.clear ();
+    resetMotion ();
+  }
+
+  // coarse-to-fine batched weighting: every particle is scored on the
+  // reference thinned to one point per voxel of the largest leaf size, and
+  // only the best refine_fraction of them on each finer level and finally on
+  // the full reference. no leaf sizes score every particle in full.
+  void
+  setReferencePyramid (const std::vector<float> &leaf_sizes, float refine_fraction)
+  {
+    leaf_sizes_ = leaf_sizes;
+    refine_fraction_ = std::min (std::max (refine_fraction, 0.0f), 1.0f);
+    pyramid_reference_.reset ();
+    pyramid_.clear ();
+  }
+
+  // attributes of the reference for the batched weighting, computed once per
+  // reference cloud
+  const BatchedCoherence::Attributes&
+  getReferenceAttributes ()
+  {
+    if (ref_ && attributes_reference_ != ref_)
+    {
+      BatchedCoherence::computeAttributes (*ref_, reference_attributes_);
+      attributes_reference_ = ref_;
+    }
+    return (reference_attributes_);
+  }
+
+  // hands in the attributes of the current reference cloud, e.g. from a
+  // ReferenceModel, so they are not computed again
+  void
+  setReferenceAttributes (const BatchedCoherence::Attributes &attributes)
+  {
+    reference_attributes_ = attributes;
+    attributes_reference_ = ref_;
+  }
+
+  // lets resample () choose between min_particles and max_particles per
+  // frame by KLD-sampling. it resamples only while the effective sample
+  // size is below half the particles and otherwise moves the particles
+  // with the step noise, keeping their weights as a prior.
+  void
+  setAdaptiveParticleNum (int min_particles, int max_particles)
+  {
+    adaptive_ = min_particles < max_particles;
+    min_particle_num_ = std::max (1, min_particles);
+    max_particle_num_ = std::max (min_particle_num_, max_particles);
+    budget_particle_num_ = max_particle_num_;
+  }
+
+  // keeps computeTracking () within budget_ms, from a running estimate of
+  // the cost per particle and iteration, by lowering the particle maximum
+  // or by spending what the particles leave over on up to max_iterations
+  // iterations. 0 disables the budget.
+  void
+  setTimeBudget (double budget_ms, int max_iterations)
+  {
+    time_budget_ = budget_ms / 1000.0;
+    max_iteration_num_ = std::max (1, max_iterations);
+  }
+
+  // weights the particles against cloud repetitions times with either path
+  // and reports the time per weighting and the largest weight difference
+  void
+  compareWeighting (const PointCloudInConstPtr &cloud, int repetitions, std::ostream &os)
+  {
+    setInputCloud (cloud);
+    if (!initCompute ())
+      return;
+    const size_t particle_num = particles_->points.size ();
+    std::vector<float> per_particle_weights (particle_num);
+    double start = pcl::getTime ();
+    for (int r = 0; r < repetitions; r++)
+      BaseClass::weight ();
+    const double per_particle_time = (pcl::getTime () - start) / repetitions;
+    for (size_t i = 0; i < particle_num; i++)
+      per_particle_weights[i] = particles_->points[i].weight;
+
+    if (!prepareBatchedWeighting ())
+    {
+      os << "the point coherences have no batched form" << std::endl;
+      return;
+    }
+    start = pcl::getTime ();
+    for (int r = 0; r < repetitions; r++)
+      weightBatched ();
+    const double batched_time = (pcl::getTime () - start) / repetitions;
+    float max_weight = 0.0f, max_difference = 0.0f;
+    size_t per_particle_best = 0, batched_best = 0;
+    for (size_t i = 0; i < particle_num; i++)
+    {
+      max_weight = std::max (max_weight, per_particle_weights[i]);
+      max_difference = std::max (max_difference, fabsf (particles_->points[i].weight - per_particle_weights[i]));
+      if (per_particle_weights[i] > per_particle_weights[per_particle_best])
+        per_particle_best = i;
+      if (particles_->points[i].weight > particles_->points[batched_best].weight)
+        batched_best = i;
+    }
+    os << "particles: " << particle_num << ", reference points: " << ref_->points.size ()
+       << ", input points: " << cloud->points.size () << "\n"
+       << "per-particle: " << per_particle_time * 1000.0 << " ms, batched: " << batched_time * 1000.0
+       << " ms, speedup: " << per_particle_time / batched_time << "\n"
+       << "largest weight difference: " << max_difference << " (largest weight: " << max_weight << ")"
+       << ", best particle " << (per_particle_best == batched_best ? "agrees" : "differs") << std::endl;
+    if (shared_target_)
+      return;
+
+    // the batched path again with the target in the other layout
+    const bool compact = compact_target_;
+    compact_target_ = !compact;
+    start = pcl::getTime ();
+    for (int r = 0; r < repetitions; r++)
+      weightBatched ();
+    const double other_time = (pcl::getTime () - start) / repetitions;
+    compact_target_ = compact;
+    float other_difference = 0.0f;
+    size_t other_best = 0;
+    for (size_t i = 0; i < particle_num; i++)
+    {
+      other_difference = std::max (other_difference, fabsf (particles_->points[i].weight - per_particle_weights[i]));
+      if (particles_->points[i].weight > particles_->points[other_best].weight)
+        other_best = i;
+    }
+    os << (compact ? "float" : "compact") << " target: " << other_time * 1000.0 << " ms, speedup over "
+       << (compact ? "compact" : "float") << ": " << batched_time / other_time << "\n"
+       << "largest weight difference: " << other_difference
+       << ", best particle " << (per_particle_best == other_best ? "agrees" : "differs") << std::endl;
+  }
+
+protected:
+  virtual void
+  weight ()
+  {
+    STAGE_TIMER ("weight");
+    match_score_ = std::numeric_limits<float>::quiet_NaN ();
+    if (batched_ && !use_normal_ && prepareBatchedWeighting ())
+      weightBatched ();
+    else
+      BaseClass::weight ();
+    weighted_particle_num_ += particles_->points.size ();
+    if (carry_weights_)
+    {
+      // sequential importance sampling for a frame that was not resampled
+      double sum = 0.0;
+      for (size_t i = 0; i < particles_->points.size (); i++)
+      {
+        particles_->points[i].weight *= prior_weights_[i];
+        sum += particles_->points[i].weight;
+      }
+      for (size_t i = 0; i < particles_->points.size (); i++)
+        particles_->points[i].weight = sum > 0.0 ? static_cast<float> (particles_->points[i].weight / sum)
+                                                 : 1.0f / static_cast<float> (particles_->points.size ());
+      carry_weights_ = false;
+    }
+    double squared_sum = 0.0;
+    for (size_t i = 0; i < particles_->points.size (); i++)
+      squared_sum += particles_->points[i].weight * particles_->points[i].weight;
+    effective_sample_size_ = squared_sum > 0.0 ? 1.0 / squared_sum : 0.0;
+  }
+
+  virtual void
+  computeTracking ()
+  {
+    const double start = pcl::getTime ();
+    if (time_budget_ > 0.0 && cost_per_particle_ > 0.0)
+    {
+      const int affordable = static_cast<int> (time_budget_ / cost_per_particle_);
+      const int needed = std::max (1, static_cast<int> (particles_->points.size ()));
+      iteration_num_ = std::max (1, std::min (max_iteration_num_, affordable / needed));
+      budget_particle_num_ = std::max (min_particle_num_, std::min (max_particle_num_, affordable / iteration_num_));
+    }
+    weighted_particle_num_ = 0;
+    predict_pending_ = predictStep ();
+    BaseClass::computeTracking ();
+    predict_pending_ = false;
+    if (weighted_particle_num_ > 0)
+    {
+      const double cost = (pcl::getTime () - start) / static_cast<double> (weighted_particle_num_);
+      cost_per_particle_ = cost_per_particle_ > 0.0 ? 0.8 * cost_per_particle_ + 0.2 * cost : cost;
+    }
+    updateMotion ();
+    STAGE_RECORD_UNIT ("particles.iterations", "iterations", iteration_num_);
+  }
+
+  typedef Eigen::Matrix<float, 6, 1> StateVector;
+
+  static StateVector
+  toVector (const pcl::tracking::ParticleXYZRPY &p)
+  {
+    StateVector v;
+    v << p.x, p.y, p.z, p.roll, p.pitch, p.yaw;
+    return (v);
+  }
+
+  // a - b with the angle differences wrapped into [-pi, pi]
+  static StateVector
+  difference (const StateVector &a, const StateVector &b)
+  {
+    StateVector d = a - b;
+    for (int i = 3; i < 6; i++)
+      d[i] = atan2f (sinf (d[i]), cosf (d[i]));
+    return (d);
+  }
+
+  // drops the past results and restores the configured step noise
+  void
+  resetMotion ()
+  {
+    if (!configured_step_noise_.empty ())
+      step_noise_covariance_ = configured_step_noise_;
+    configured_step_noise_.clear ();
+    results_.clear ();
+    step_.setZero ();
+    predict_pending_ = prediction_valid_ = false;
+  }
+
+  // computes step_ and predicted_ from the last results; false without a
+  // motion model or before two results
+  bool
+  predictStep ()
+  {
+    if (motion_model_ == MOTION_NONE || results_.size () < 2)
+    {
+      step_.setZero ();
+      prediction_valid_ = false;
+      return (false);
+    }
+    const size_t n = results_.size ();
+    const StateVector velocity = difference (results_[n - 1], results_[n - 2]);
+    step_ = velocity;
+    if (motion_model_ == CONSTANT_ACCELERATION && n >= 3)
+      step_ += difference (velocity, difference (results_[n - 2], results_[n - 3]));
+    predicted_ = results_[n - 1] + step_;
+    prediction_valid_ = true;
+    return (true);
+  }
+
+  // moves every particle by the predicted step of the frame
+  void
+  applyPrediction ()
+  {
+    for (size_t i = 0; i < particles_->points.size (); i++)
+    {
+      pcl::tracking::ParticleXYZRPY& p = particles_->points[i];
+      p.x += step_[0];
+      p.y += step_[1];
+      p.z += step_[2];
+      p.roll += step_[3];
+      p.pitch += step_[4];
+      p.yaw += step_[5];
+    }
+  }
+
+  // records the result of the frame and fits the step noise to the
+  // residual of its prediction
+  void
+  updateMotion ()
+  {
+    if (motion_model_ == MOTION_NONE)
+      return;
+    if (configured_step_noise_.empty ())
+    {
+      configured_step_noise_ = step_noise_covariance_;
+      residual_variance_ = configured_step_noise_;
+    }
+    const StateVector result = toVector (representative_state_);
+    if (prediction_valid_)
+    {
+      const StateVector residual = difference (result, predicted_);
+      for (int i = 0; i < 6; i++)
+      {
+        residual_variance_[i] = (1.0 - RESIDUAL_GAIN) * residual_variance_[i] + RESIDUAL_GAIN * residual[i] * residual[i];
+        step_noise_covariance_[i] = std::min (configured_step_noise_[i],
+                                              std::max (MIN_STEP_NOISE_FRACTION * configured_step_noise_[i],
+                                                        residual_variance_[i]));
+      }
+      STAGE_RECORD_UNIT ("motion.residual", "um", static_cast<uint64_t> (1e6f * residual.head<3> ().norm ()));
+    }
+    results_.push_back (result);
+    if (results_.size () > 3)
+      results_.erase (results_.begin ());
+  }
+
+  virtual void
+  resample ()
+  {
+    double squared_sum = 0.0;
+    for (size_t i = 0; i < particles_->points.size (); i++)
+      squared_sum += particles_->points[i].weight * particles_->points[i].weight;
+    const double effective_sample_size = squared_sum > 0.0 ? 1.0 / squared_sum : 0.0;
+    STAGE_RECORD_UNIT ("particles.ess", "particles", static_cast<uint64_t> (effective_sample_size + 0.5));
+    if (!adaptive_)
+      BaseClass::resample ();
+    else if (effective_sample_size >= 0.5 * particles_->points.size ()
+             && static_cast<int> (particles_->points.size ()) <= budget_particle_num_)
+      propagate ();
+    else
+      resampleKLD ();
+    // only the first resampling of a frame moves the particles by the prediction
+    if (predict_pending_)
+    {
+      applyPrediction ();
+      predict_pending_ = false;
+    }
+    particle_num_ = static_cast<int> (particles_->points.size ());
+    // the per-particle weighting transforms the reference into one cloud per particle
+    while (transed_reference_vector_.size () < particles_->points.size ())
+      transed_reference_vector_.push_back (PointCloudInPtr (new PointCloudIn));
+    STAGE_RECORD_UNIT ("particles.count", "particles", particle_num_);
+  }
+
+  // moves every particle by the step noise and keeps its weight
+  void
+  propagate ()
+  {
+    const std::vector<double> zero_mean (pcl::tracking::ParticleXYZRPY::stateDimension (), 0.0);
+    prior_weights_.resize (particles_->points.size ());
+    for (size_t i = 0; i < particles_->points.size (); i++)
+    {
+      prior_weights_[i] = particles_->points[i].weight;
+      particles_->points[i].sample (zero_mean, step_noise_covariance_);
+    }
+    carry_weights_ = true;
+  }
+
+  // draws particles until their number reaches the KLD bound for the number
+  // of occupied state bins (Fox, 2003), within the particle range
+  void
+  resampleKLD ()
+  {
+    std::vector<int> a (particles_->points.size ());
+    std::vector<double> q (particles_->points.size ());
+    genAliasTable (a, q, particles_);
+    const std::vector<double> zero_mean (pcl::tracking::ParticleXYZRPY::stateDimension (), 0.0);
+    const int max_particles = std::max (min_particle_num_, budget_particle_num_);
+    PointCloudStatePtr resampled (new PointCloudState);
+    resampled->points.reserve (max_particles);
+    // the first particle is a copy of the last result, as in resampleWithReplacement ()
+    resampled->points.push_back (representative_state_);
+    bins_.reserve (max_particle_num_);
+    bins_.clear ();
+    insertBin (resampled->points.back ());
+    while (static_cast<int> (resampled->points.size ()) < max_particles
+           && (static_cast<int> (resampled->points.size ()) < min_particle_num_
+               || static_cast<double> (resampled->points.size ()) < kldBound (bins_.size ())))
+    {
+      pcl::tracking::ParticleXYZRPY p = particles_->points[sampleWithReplacement (a, q)];
+      p.sample (zero_mean, step_noise_covariance_);
+      resampled->points.push_back (p);
+      insertBin (p);
+    }
+    resampled->width = static_cast<uint32_t> (resampled->points.size ());
+    resampled->height = 1;
+    particles_ = resampled;
+  }
+
+  // KLD-sampling bins are 2 cm and 0.1 rad wide; each rotation angle takes
+  // the six low bits of a translation axis
+  void
+  insertBin (const pcl::tracking::ParticleXYZRPY &p)
+  {
+    const float angles[3] = { p.roll, p.pitch, p.yaw };
+    const float positions[3] = { p.x, p.y, p.z };
+    int key[3];
+    for (int i = 0; i < 3; i++)
+    {
+      const int angle_bin = std::max (0, std::min (63, static_cast<int> (floorf ((angles[i] + static_cast<float> (M_PI)) * 10.0f))));
+      key[i] = static_cast<int> (floorf (positions[i] * 50.0f)) * 64 + angle_bin;
+    }
+    bins_.findOrInsert (key[0], key[1], key[2]);
+  }
+
+  // particles for a KL divergence below 0.05 with probability 0.99
+  static double
+  kldBound (size_t bin_num)
+  {
+    if (bin_num <= 1)
+      return (1.0);
+    const double epsilon = 0.05, z = 2.326;
+    const double a = 2.0 / (9.0 * static_cast<double> (bin_num - 1));
+    const double b = 1.0 - a + sqrt (a) * z;
+    return (static_cast<double> (bin_num - 1) / (2.0 * epsilon) * b * b * b);
+  }
+
+  // takes the weights of the point coherences and the attributes of a new
+  // reference; false if the coherences have no batched form
+  bool
+  prepareBatchedWeighting ()
+  {
+    if (!coherence_ || !ref_ || ref_->points.empty () || !batched_coherence_.configure (coherence_->getPointCoherences ()))
+      return (false);
+    if (!boost::dynamic_pointer_cast<ProjectiveCloudCoherence<pcl::PointXYZRGBNormal> > (coherence_)
+        && !boost::dynamic_pointer_cast<pcl::tracking::NearestPairPointCloudCoherence<pcl::PointXYZRGBNormal> > (coherence_))
+      return (false);
+    getReferenceAttributes ();
+    if (pyramid_reference_ != ref_)
+      buildPyramid ();
+    return (true);
+  }
+
+  void
+  weightBatched ()
+  {
+    const int particle_num = static_cast<int> (particles_->points.size ());
+    // the first level scored is moved by every particle before the scoring
+    // only if the crop of the own target needs its bounds
+    ReferenceLevel* first = pyramid_.empty () ? 0 : &pyramid_[0];
+    if (!shared_target_)
+    {
+      std::vector<Eigen::Vector3f> mins (particle_num), maxs (particle_num);
+      std::vector<float>& transformed = first ? first->transformed : transformed_;
+      transformed.resize (particle_num * 3 * (first ? first->attributes : reference_attributes_).x.size ());
+      forEachParticle (particle_num, boost::bind (&BatchedParticleFilterTracker::transformParticles, this, _1, _2, first,
+                                                  &mins, &maxs));
+      // the input inside the bounding box of all transformed references, as
+      // cropInputPointCloud () selects it. every point of the full reference
+      // shares a voxel with a point of a coarse level, so the box of the
+      // level grows by its leaf size.
+      Eigen::Vector3f min = Eigen::Vector3f::Constant (std::numeric_limits<float>::max ());
+      Eigen::Vector3f max = -min;
+      for (int i = 0; i < particle_num; i++)
+      {
+        min = min.cwiseMin (mins[i]);
+        max = max.cwiseMax (maxs[i]);
+      }
+      if (first)
+      {
+        min.array () -= first->leaf_size;
+        max.array () += first->leaf_size;
+      }
+      RefCloud::Ptr cropped (new RefCloud);
+      for (size_t i = 0; i < input_->points.size (); i++)
+      {
+        const pcl::PointXYZRGBNormal& p = input_->points[i];
+        if (p.x >= min[0] && p.x <= max[0] && p.y >= min[1] && p.y <= max[1] && p.z >= min[2] && p.z <= max[2])
+          cropped->points.push_back (p);
+      }
+      cropped->width = static_cast<uint32_t> (cropped->points.size ());
+      cropped->height = 1;
+      own_target_.setInputCloud (cropped, boost::dynamic_pointer_cast<ProjectiveCloudCoherence<pcl::PointXYZRGBNormal> > (coherence_),
+                                 compact_target_);
+    }
+    const CorrespondenceTarget* target = shared_target_ ? shared_target_.get () : &own_target_;
+    const bool transform_first = static_cast<bool> (shared_target_);
+    if (pyramid_.empty ())
+    {
+      if (transform_first)
+        transformed_.resize (particle_num * 3 * reference_attributes_.x.size ());
+      forEachParticle (particle_num, boost::bind (&BatchedParticleFilterTracker::scoreParticles, this, _1, _2, target,
+                                                  static_cast<ReferenceLevel*> (0), static_cast<const std::vector<int>*> (0),
+                                                  transform_first));
+    }
+    else
+      weightCoarseToFine (particle_num, target, transform_first);
+    // mean point coherence of the best particle, before normalizeWeight ()
+    // rescales the weights relative to each other
+    float best = 0.0f;
+    for (int i = 0; i < particle_num; i++)
+      best = std::min (best, particles_->points[i].weight);
+    match_score_ = - best / static_cast<float> (ref_->points.size ());
+    normalizeWeight ();
+  }
+
+  // coarse levels of the reference, scaled to weigh like the full one
+  struct ReferenceLevel
+  {
+    BatchedCoherence::Attributes attributes;
+    size_t point_num;
+    float leaf_size;
+    float scale;
+    std::vector<float> transformed;
+  };
+
+  // scores all particles on the coarsest level of the pyramid and each finer
+  // level, up to the full reference, only on the best refine_fraction_ of
+  // the particles of the level before. the particles that drop out keep the
+  // weight of their last level, scaled to the full reference. the references
+  // are moved as they are scored, the coarsest level only with
+  // transform_first.
+  void
+  weightCoarseToFine (int particle_num, const CorrespondenceTarget* target, bool transform_first)
+  {
+    std::vector<int> selection (particle_num);
+    for (int i = 0; i < particle_num; i++)
+      selection[i] = i;
+    for (size_t l = 0; l <= pyramid_.size (); l++)
+    {
+      ReferenceLevel* level = l < pyramid_.size () ? &pyramid_[l] : 0;
+      if (l > 0 && !selection.empty ())
+      {
+        const size_t keep = std::max<size_t> (1, static_cast<size_t> (ceilf (refine_fraction_ * selection.size ())));
+        std::nth_element (selection.begin (), selection.begin () + (keep - 1), selection.end (), LowerWeight (*particles_));
+        selection.resize (keep);
+      }
+      std::vector<float>& transformed = level ? level->transformed : transformed_;
+      const size_t stride = (level ? level->attributes : reference_attributes_).x.size ();
+      const bool transform = l > 0 || transform_first;
+      if (transform)
+        transformed.resize (selection.size () * 3 * stride);
+      forEachParticle (static_cast<int> (selection.size ()),
+                       boost::bind (&BatchedParticleFilterTracker::scoreParticles, this, _1, _2, target, level, &selection,
+                                    transform));
+    }
+    STAGE_RECORD_UNIT ("particles.refined", "particles", selection.size ());
+  }
+
+  // orders particle indices best first: the weights are negated sums of
+  // coherences until normalizeWeight ()
+  struct LowerWeight
+  {
+    explicit LowerWeight (const PointCloudState &particles) : particles_ (particles) {}
+    bool operator () (int a, int b) const { return (particles_.points[a].weight < particles_.points[b].weight); }
+    const PointCloudState& particles_;
+  };
+
+  // one point per voxel of each leaf size, coarsest first; levels that do
+  // not thin out the reference are left out
+  void
+  buildPyramid ()
+  {
+    pyramid_.clear ();
+    pyramid_reference_ = ref_;
+    std::vector<float> leaf_sizes = leaf_sizes_;
+    std::sort (leaf_sizes.rbegin (), leaf_sizes.rend ());
+    VoxelHashTable voxels;
+    voxels.reserve (ref_->points.size ());
+    for (size_t l = 0; l < leaf_sizes.size (); l++)
+    {
+      RefCloud level_cloud;
+      voxels.clear ();
+      const float inv_leaf = 1.0f / leaf_sizes[l];
+      for (size_t i = 0; i < ref_->points.size (); i++)
+      {
+        const pcl::PointXYZRGBNormal& p = ref_->points[i];
+        const int voxel = voxels.findOrInsert (static_cast<int> (floorf (p.x * inv_leaf)),
+                                               static_cast<int> (floorf (p.y * inv_leaf)),
+                                               static_cast<int> (floorf (p.z * inv_leaf)));
+        if (static_cast<size_t> (voxel) == level_cloud.points.size ())
+          level_cloud.points.push_back (p);
+      }
+      if (level_cloud.points.size () >= ref_->points.size ())
+        continue;
+      pyramid_.push_back (ReferenceLevel ());
+      ReferenceLevel& level = pyramid_.back ();
+      BatchedCoherence::computeAttributes (level_cloud, level.attributes);
+      level.point_num = level_cloud.points.size ();
+      level.leaf_size = leaf_sizes[l];
+      level.scale = static_cast<float> (ref_->points.size ()) / static_cast<float> (level.point_num);
+    }
+  }
+
+  // runs body on ranges of [0, particle_num), on the pool if there is one
+  void
+  forEachParticle (int particle_num, const boost::function<void (int, int)> &body)
+  {
+    if (pool_)
+    {
+      parallelFor (*pool_, particle_num, body);
+      return;
+    }
+#pragma omp parallel for num_threads (threads_)
+    for (int i = 0; i < particle_num; i++)
+      body (i, i + 1);
+  }
+
+  // moves a level of the pyramid, or the full reference without one, by the
+  // particles [begin, end) and collects the bounds of each
+  void
+  transformParticles (int begin, int end, ReferenceLevel* level, std::vector<Eigen::Vector3f>* mins,
+                      std::vector<Eigen::Vector3f>* maxs)
+  {
+    const BatchedCoherence::Attributes& reference = level ? level->attributes : reference_attributes_;
+    std::vector<float>& transformed = level ? level->transformed : transformed_;
+    const size_t stride = reference.x.size ();
+    for (int i = begin; i < end; i++)
+      transformReference (reference, toEigenMatrix (particles_->points[i]), &transformed[i * 3 * stride], stride,
+                          (*mins)[i], (*maxs)[i]);
+  }
+
+  // scores the particles selection[begin, end), or [begin, end) without a
+  // selection, against a level of the pyramid, or the full reference without
+  // one. with transform, the reference is moved by each particle into its
+  // place in the selection; otherwise transformParticles () moved it already.
+  void
+  scoreParticles (int begin, int end, const CorrespondenceTarget* target, ReferenceLevel* level,
+                  const std::vector<int>* selection, bool transform)
+  {
+    const BatchedCoherence::Attributes& reference = level ? level->attributes : reference_attributes_;
+    const size_t ref_num = level ? level->point_num : ref_->points.size ();
+    const size_t stride = reference.x.size ();
+    const float scale = level ? level->scale : 1.0f;
+    std::vector<float>& transformed = level ? level->transformed : transformed_;
+    int nearest[BLOCK_SIZE];
+    for (int j = begin; j < end; j++)
+    {
+      const int i = selection ? (*selection)[j] : j;
+      float* x = &transformed[j * 3 * stride];
+      if (transform)
+      {
+        Eigen::Vector3f min, max;
+        transformReference (reference, toEigenMatrix (particles_->points[i]), x, stride, min, max);
+      }
+      const float* y = x + stride;
+      const float* z = y + stride;
+      double val = 0.0;
+      for (size_t block = 0; block < ref_num; block += BLOCK_SIZE)
+      {
+        const size_t count = std::min (static_cast<size_t> (BLOCK_SIZE), ref_num - block);
+        target->findNearest (x + block, y + block, z + block, count, nearest);
+        if (target->isCompact ())
+          val += batched_coherence_.score (reference, target->getCompactAttributes (), block,
+                                           x + block, y + block, z + block, nearest, count);
+        else
+          val += batched_coherence_.score (reference, target->getAttributes (), block,
+                                           x + block, y + block, z + block, nearest, count);
+      }
+      particles_->points[i].weight = - scale * static_cast<float> (val);
+    }
+  }
+
+  // writes the x, y and z arrays of the reference moved by trans to out and
+  // their bounds to min and max
+  void
+  transformReference (const BatchedCoherence::Attributes &reference, const Eigen::Affine3f &trans, float* out,
+                      size_t stride, Eigen::Vector3f &min, Eigen::Vector3f &max) const
+  {
+    const Eigen::Matrix4f& m = trans.matrix ();
+    const float* x = &reference.x[0];
+    const float* y = &reference.y[0];
+    const float* z = &reference.z[0];
+    float* out_x = out;
+    float* out_y = out + stride;
+    float* out_z = out + 2 * stride;
+#ifdef __AVX2__
+    __m256 row[3][4];
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 4; c++)
+        row[r][c] = _mm256_set1_ps (m (r, c));
+    __m256 min8[3], max8[3];
+    for (int r = 0; r < 3; r++)
+    {
+      min8[r] = _mm256_set1_ps (std::numeric_limits<float>::max ());
+      max8[r] = _mm256_set1_ps (-std::numeric_limits<float>::max ());
+    }
+    float* outs[3] = { out_x, out_y, out_z };
+    for (size_t i = 0; i < stride; i += 8)
+    {
+      const __m256 px = _mm256_loadu_ps (x + i), py = _mm256_loadu_ps (y + i), pz = _mm256_loadu_ps (z + i);
+      for (int r = 0; r < 3; r++)
+      {
+        const __m256 v = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (row[r][0], px), _mm256_mul_ps (row[r][1], py)),
+                                        _mm256_add_ps (_mm256_mul_ps (row[r][2], pz), row[r][3]));
+        _mm256_storeu_ps (outs[r] + i, v);
+        min8[r] = _mm256_min_ps (min8[r], v);
+        max8[r] = _mm256_max_ps (max8[r], v);
+      }
+    }
+    for (int r = 0; r < 3; r++)
+    {
+      EIGEN_ALIGN16 float lanes_min[8], lanes_max[8];
+      _mm256_storeu_ps (lanes_min, min8[r]);
+      _mm256_storeu_ps (lanes_max, max8[r]);
+      min[r] = *std::min_element (lanes_min, lanes_min + 8);
+      max[r] = *std::max_element (lanes_max, lanes_max + 8);
+    }
+#else
+    min = Eigen::Vector3f::Constant (std::numeric_limits<float>::max ());
+    max = -min;
+    for (size_t i = 0; i < stride; i++)
+    {
+      out_x[i] = m (0, 0) * x[i] + m (0, 1) * y[i] + m (0, 2) * z[i] + m (0, 3);
+      out_y[i] = m (1, 0) * x[i] + m (1, 1) * y[i] + m (1, 2) * z[i] + m (1, 3);
+      out_z[i] = m (2, 0) * x[i] + m (2, 1) * y[i] + m (2, 2) * z[i] + m (2, 3);
+      min = min.cwiseMin (Eigen::Vector3f (out_x[i], out_y[i], out_z[i]));
+      max = max.cwiseMax (Eigen::Vector3f (out_x[i], out_y[i], out_z[i]));
+    }
+#endif
+  }
+
+  // reference points scored per association call
+  enum { BLOCK_SIZE = 256 };
+
+  bool batched_;
+  bool compact_target_;
+  bool adaptive_;
+  int min_particle_num_, max_particle_num_;
+  // particle maximum under the time budget
+  int budget_particle_num_;
+  int max_iteration_num_;
+  double time_budget_;
+  // seconds per weighted particle, averaged over the frames
+  double cost_per_particle_;
+  size_t weighted_particle_num_;
+  bool carry_weights_;
+  std::vector<float> prior_weights_;
+  VoxelHashTable bins_;
+  BatchedCoherence batched_coherence_;
+  PointCloudInConstPtr attributes_reference_;
+  BatchedCoherence::Attributes reference_attributes_;
+  std::vector<float> transformed_;
+  std::vector<float> leaf_sizes_;
+  float refine_fraction_;
+  PointCloudInConstPtr pyramid_reference_;
+  std::vector<ReferenceLevel> pyramid_;
+  float match_score_;
+  double effective_sample_size_;
+  MotionModel motion_model_;
+  double pcl_motion_ratio_;
+  // last results, oldest first, and the prediction of the current frame
+  std::vector<StateVector> results_;
+  StateVector step_;
+  StateVector predicted_;
+  bool predict_pending_;
+  bool prediction_valid_;
+  // step noise set by the user, and the smoothed squared prediction residual
+  std::vector<double> configured_step_noise_;
+  std::vector<double> residual_variance_;
+  static const double RESIDUAL_GAIN;
+  static const double MIN_STEP_NOISE_FRACTION;
+  CorrespondenceTarget own_target_;
+  CorrespondenceTarget::ConstPtr shared_target_;
+  WorkStealingPool* pool_;
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+const double BatchedParticleFilterTracker::RESIDUAL_GAIN = 0.3;
+const double BatchedParticleFilterTracker::MIN_STEP_NOISE_FRACTION = 0.04;
+
+// Bounded FIFO between two pipeline stages. When it is full, push () either
+// drops the oldest entry, so that the consumer always sees the newest frame,
+// or waits for the consumer to make room.
+template <typename T>
+class FrameQueue
+{
+public:
+  FrameQueue (size_t capacity, bool drop_stale)
+  : capacity_ (capacity)
+  , drop_stale_ (drop_stale)
+  , closed_ (false)
+  , dropped_ (0)
+  {
+  }
+
+  void
+  setDropStale (bool drop_stale)
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    drop_stale_ = drop_stale;
+  }
+
+  // returns false once the queue is closed
+  bool
+  push (const T& item)
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    if (drop_stale_)
+    {
+      while (!closed_ && queue_.size () >= capacity_)
+      {
+        queue_.pop_front ();
+        ++dropped_;
+      }
+    }
+    else
+    {
+      while (!closed_ && queue_.size () >= capacity_)
+        not_full_.wait (lock);
+    }
+    if (closed_)
+      return false;
+    queue_.push_back (item);
+    not_empty_.notify_one ();
+    return true;
+  }
+
+  // blocks until an item is available; returns false when the queue is
+  // closed and drained
+  bool
+  pop (T& item)
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    while (queue_.empty () && !closed_)
+      not_empty_.wait (lock);
+    if (queue_.empty ())
+      return false;
+    item = queue_.front ();
+    queue_.pop_front ();
+    not_full_.notify_one ();
+    return true;
+  }
+
+  void
+  close ()
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    closed_ = true;
+    not_empty_.notify_all ();
+    not_full_.notify_all ();
+  }
+
+  size_t
+  getDroppedCount () const
+  {
+    boost::mutex::scoped_lock lock (mtx_);
+    return dropped_;
+  }
+
+private:
+  std::deque<T> queue_;
+  size_t capacity_;
+  bool drop_stale_;
+  bool closed_;
+  size_t dropped_;
+  mutable boost::mutex mtx_;
+  boost::condition_variable not_empty_;
+  boost::condition_variable not_full_;
+};
+
+// Single producer, single consumer exchange of the latest value through
+// three slots. The writer fills its back slot and swaps it with the middle
+// one; the reader swaps the middle slot with its front slot whenever the
+// middle one holds a newer value. Neither side waits for the other, and the
+// slots are reused in place, so values that own buffers keep their capacity.
+// The reader skips the values it was too slow for.
+template <typename T>
+class TripleBuffer
+{
+public:
+  TripleBuffer ()
+  : back_ (0)
+  , middle_ (1)
+  , front_ (2)
+  {
+  }
+
+  // slot of the writer, published by publish ()
+  T&
+  back ()
+  {
+    return (slots_[back_]);
+  }
+
+  void
+  publish ()
+  {
+    back_ = middle_.exchange (back_ | FRESH) & INDEX_MASK;
+  }
+
+  // moves front () to the latest published value; false if there is none
+  // newer than the current front ()
+  bool
+  update ()
+  {
+    if ((middle_.load () & FRESH) == 0)
+      return (false);
+    front_ = middle_.exchange (front_) & INDEX_MASK;
+    return (true);
+  }
+
+  // slot of the reader
+  const T&
+  front () const
+  {
+    return (slots_[front_]);
+  }
+
+protected:
+  enum { INDEX_MASK = 3, FRESH = 4 };
+
+  T slots_[3];
+  unsigned back_;
+  boost::atomic<unsigned> middle_;
+  unsigned front_;
+};
+
+// Append-only binary stream of the tracking results, one record per frame,
+// written to a file or, for a "unix:<path>" target, sent as one datagram per
+// frame to a local socket bound at <path>. A file starts with the 16 byte
+// header "OSTPOSES", version, object record size; the socket carries frame
+// records only. All fields are native endian:
+//   frame record  uint32 size, frame (sensor sequence number); uint64
+//                 acquired_us (monotonic clock);
+//                 uint32 to_tracking_us, tracking_us, end_to_end_us, object_num
+//   object record uint32 id, flags (1: lost); float x, y, z, roll, pitch,
+//                 yaw, match score, particle spread (m)
+// The record is assembled in a buffer sized once for MAX_OBJECTS objects and
+// written with a single write () or a non-blocking send (), so the tracking
+// stage never allocates or waits on a slow reader; unsent frames are counted.
+class PoseSink
+{
+public:
+  enum { FRAME_HEADER_SIZE = 32, OBJECT_SIZE = 40, MAX_OBJECTS = 64 };
+
+  PoseSink ()
+  : fd_ (-1)
+  , socket_ (false)
+  , size_ (0)
+  , object_num_ (0)
+  , frame_ (0)
+  , dropped_ (0)
+  {
+    buffer_.resize (FRAME_HEADER_SIZE + MAX_OBJECTS * OBJECT_SIZE);
+  }
+
+  ~PoseSink ()
+  {
+    close ();
+  }
+
+  bool
+  open (const std::string &target)
+  {
+    close ();
+    socket_ = target.compare (0, 5, "unix:") == 0;
+    if (socket_)
+    {
+      const std::string path = target.substr (5);
+      sockaddr_un address;
+      std::memset (&address, 0, sizeof (address));
+      address.sun_family = AF_UNIX;
+      if (path.empty () || path.size () >= sizeof (address.sun_path))
+      {
+        PCL_ERROR ("invalid socket path %s\n", path.c_str ());
+        return (false);
+      }
+      std::strncpy (address.sun_path, path.c_str (), sizeof (address.sun_path) - 1);
+      fd_ = ::socket (AF_UNIX, SOCK_DGRAM, 0);
+      if (fd_ < 0 || ::connect (fd_, reinterpret_cast<sockaddr*> (&address), sizeof (address)) != 0)
+      {
+        PCL_ERROR ("failed to connect to %s: %s\n", path.c_str (), std::strerror (errno));
+        close ();
+        return (false);
+      }
+      return (true);
+    }
+    fd_ = ::open (target.c_str (), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0)
+    {
+      PCL_ERROR ("failed to open %s: %s\n", target.c_str (), std::strerror (errno));
+      return (false);
+    }
+    // a new file gets the header, an existing one is continued
+    if (::lseek (fd_, 0, SEEK_END) == 0)
+    {
+      char header[16];
+      const uint32_t version = VERSION, object_size = OBJECT_SIZE;
+      std::memcpy (header, MAGIC, 8);
+      std::memcpy (header + 8, &version, 4);
+      std::memcpy (header + 12, &object_size, 4);
+      if (::write (fd_, header, sizeof (header)) != static_cast<ssize_t> (sizeof (header)))
+      {
+        PCL_ERROR ("failed to write %s\n", target.c_str ());
+        close ();
+        return (false);
+      }
+    }
+    return (true);
+  }
+
+  void
+  close ()
+  {
+    if (fd_ >= 0)
+      ::close (fd_);
+    fd_ = -1;
+  }
+
+  bool
+  isOpen () const
+  {
+    return (fd_ >= 0);
+  }
+
+  // frame is the sequence number of the sensor frame
+  void
+  beginFrame (uint32_t frame, uint64_t acquired_us, uint32_t to_tracking_us, uint32_t tracking_us, uint32_t end_to_end_us)
+  {
+    size_ = 8;
+    object_num_ = 0;
+    frame_ = frame;
+    put (acquired_us);
+    put (to_tracking_us);
+    put (tracking_us);
+    put (end_to_end_us);
+    size_ = FRAME_HEADER_SIZE;
+  }
+
+  // objects beyond MAX_OBJECTS are left out
+  void
+  addObject (uint32_t id, const pcl::tracking::ParticleXYZRPY &pose, float match_score, float spread, bool lost)
+  {
+    if (object_num_ == MAX_OBJECTS)
+      return;
+    put (id);
+    put (static_cast<uint32_t> (lost ? 1 : 0));
+    const float values[8] = { pose.x, pose.y, pose.z, pose.roll, pose.pitch, pose.yaw, match_score, spread };
+    for (int i = 0; i < 8; i++)
+      put (values[i]);
+    ++object_num_;
+  }
+
+  void
+  endFrame ()
+  {
+    const uint32_t size = static_cast<uint32_t> (size_);
+    const uint32_t object_num = static_cast<uint32_t> (object_num_);
+    std::memcpy (&buffer_[0], &size, 4);
+    std::memcpy (&buffer_[4], &frame_, 4);
+    std::memcpy (&buffer_[28], &object_num, 4);
+    const ssize_t written = socket_ ? ::send (fd_, &buffer_[0], size_, MSG_DONTWAIT)
+                                    : ::write (fd_, &buffer_[0], size_);
+    if (written != static_cast<ssize_t> (size_))
+    {
+      ++dropped_;
+      STAGE_RECORD_UNIT ("poses.dropped", "frames", 1);
+    }
+  }
+
+  size_t
+  getDroppedFrames () const
+  {
+    return (dropped_);
+  }
+
+  static const uint32_t VERSION = 2;
+  static const char MAGIC[8];
+
+protected:
+  template <typename T> void
+  put (const T &value)
+  {
+    std::memcpy (&buffer_[size_], &value, sizeof (T));
+    size_ += sizeof (T);
+  }
+
+  int fd_;
+  bool socket_;
+  std::vector<char> buffer_;
+  size_t size_;
+  size_t object_num_;
+  uint32_t frame_;
+  size_t dropped_;
+};
+
+const char PoseSink::MAGIC[8] = { 'O', 'S', 'T', 'P', 'O', 'S', 'E', 'S' };
+
+// Knobs of the pipeline that are fixed for a run. The defaults are the values
+// the tracker was tuned with; -params overrides some of them, -sweep runs a
+// grid of them.
+struct TrackingParameters
+{
+  enum { PARAMETER_NUM = 11 };
+
+  TrackingParameters ()
+  : leaf_size (0.01)
+  , min_depth (0.0)
+  , max_depth (2.0)
+  , plane_iterations (1000)
+  , plane_threshold (0.03)
+  , normal_radius (0.03)
+  , particle_num (0)
+  , distance_weight (5.0)
+  , color_weight (0.1)
+  , normal_weight (0.1)
+  , threads (0)
+  {
+  }
+
+  // false for an unknown name
+  bool
+  set (const std::string &name, double value)
+  {
+    if (name == "leaf")
+      leaf_size = value;
+    else if (name == "min_depth")
+      min_depth = value;
+    else if (name == "max_depth")
+      max_depth = value;
+    else if (name == "plane_iterations")
+      plane_iterations = static_cast<int> (value);
+    else if (name == "plane_threshold")
+      plane_threshold = value;
+    else if (name == "normal_radius")
+      normal_radius = value;
+    else if (name == "particles")
+      particle_num = static_cast<int> (value);
+    else if (name == "distance_weight")
+      distance_weight = value;
+    else if (name == "color_weight")
+      color_weight = value;
+    else if (name == "normal_weight")
+      normal_weight = value;
+    else if (name == "threads")
+      threads = static_cast<int> (value);
+    else
+      return (false);
+    return (true);
+  }
+
+  double
+  get (int i) const
+  {
+    const double values[PARAMETER_NUM] = { leaf_size, min_depth, max_depth, static_cast<double> (plane_iterations),
+                                           plane_threshold, normal_radius, static_cast<double> (particle_num),
+                                           distance_weight, color_weight, normal_weight, static_cast<double> (threads) };
+    return (values[i]);
+  }
+
+  bool
+  isValid () const
+  {
+    return (leaf_size > 0.0 && min_depth >= 0.0 && max_depth > min_depth && plane_iterations > 0 &&
+            plane_threshold > 0.0 && normal_radius > 0.0 && particle_num >= 0 && distance_weight >= 0.0 &&
+            color_weight >= 0.0 && normal_weight >= 0.0 && threads >= 0);
+  }
+
+  std::string
+  describe () const
+  {
+    std::ostringstream os;
+    for (int i = 0; i < PARAMETER_NUM; i++)
+      os << (i > 0 ? " " : "") << NAMES[i] << "=" << get (i);
+    return (os.str ());
+  }
+
+  // expands "name=v1,v2,... name=..." into the product of the values, every
+  // other parameter taken from this; false on a malformed spec
+  bool
+  expand (const std::string &spec, std::vector<TrackingParameters> &grid) const
+  {
+    grid.assign (1, *this);
+    std::istringstream tokens (spec);
+    std::string token;
+    while (tokens >> token)
+    {
+      const size_t equals = token.find ('=');
+      if (equals == std::string::npos || equals + 1 == token.size ())
+      {
+        PCL_ERROR ("expected <name>=<value>[,<value>...] instead of %s\n", token.c_str ());
+        return (false);
+      }
+      const std::string name = token.substr (0, equals);
+      std::vector<TrackingParameters> expanded;
+      const char* values = token.c_str () + equals + 1;
+      while (*values)
+      {
+        char* end;
+        const double value = std::strtod (values, &end);
+        if (end == values || (*end != ',' && *end != '\0'))
+        {
+          PCL_ERROR ("invalid value in %s\n", token.c_str ());
+          return (false);
+        }
+        for (size_t i = 0; i < grid.size (); i++)
+        {
+          expanded.push_back (grid[i]);
+          if (!expanded.back ().set (name, value))
+          {
+            PCL_ERROR ("unknown parameter %s\n", name.c_str ());
+            return (false);
+          }
+        }
+        values = *end ? end + 1 : end;
+      }
+      grid.swap (expanded);
+    }
+    for (size_t i = 0; i < grid.size (); i++)
+      if (!grid[i].isValid ())
+      {
+        PCL_ERROR ("invalid parameters %s\n", grid[i].describe ().c_str ());
+        return (false);
+      }
+    return (true);
+  }
+
+  static const char* const NAMES[PARAMETER_NUM];
+
+  double leaf_size;
+  // pass-through range along z
+  double min_depth, max_depth;
+  // RANSAC of the table plane
+  int plane_iterations;
+  double plane_threshold;
+  double normal_radius;
+  // particles per object, 0 for 200 with a motion model and 400 without;
+  // the adaptive count ranges from a quarter to twice it
+  int particle_num;
+  double distance_weight, color_weight, normal_weight;
+  // workers of the pool, 0 for one less than the cores
+  int threads;
+};
+
+const char* const TrackingParameters::NAMES[TrackingParameters::PARAMETER_NUM] =
+{
+  "leaf", "min_depth", "max_depth", "plane_iterations", "plane_threshold", "normal_radius",
+  "particles", "distance_weight", "color_weight", "normal_weight", "threads"
+};
+
+// The frames of a PoseSink file, in the order they were written.
+class PoseTrajectory
+{
+public:
+  struct Object
+  {
+    uint32_t id;
+    bool lost;
+    float x, y, z, roll, pitch, yaw;
+  };
+
+  struct Frame
+  {
+    uint32_t frame;
+    uint64_t acquired_us;
+    std::vector<Object> objects;
+  };
+
+  // deviation of an estimate from this trajectory. object frames count the
+  // objects of every frame here that is not lost, tracked those of them the
+  // estimate has a pose for.
+  struct Error
+  {
+    size_t object_frames;
+    size_t tracked;
+    double rms_translation, max_translation;
+    double mean_rotation;
+  };
+
+  bool
+  load (const std::string &path)
+  {
+    frames_.clear ();
+    std::ifstream ifs (path.c_str (), std::ios::binary);
+    char header[16];
+    uint32_t version, object_size;
+    if (!ifs.read (header, sizeof (header)) || std::memcmp (header, PoseSink::MAGIC, 8) != 0)
+    {
+      PCL_ERROR ("%s is not a pose stream\n", path.c_str ());
+      return (false);
+    }
+    std::memcpy (&version, header + 8, 4);
+    std::memcpy (&object_size, header + 12, 4);
+    if (version > PoseSink::VERSION || object_size < PoseSink::OBJECT_SIZE)
+    {
+      PCL_ERROR ("unsupported pose stream %s\n", path.c_str ());
+      return (false);
+    }
+    std::vector<char> record (PoseSink::FRAME_HEADER_SIZE + PoseSink::MAX_OBJECTS * object_size);
+    while (ifs.read (&record[0], PoseSink::FRAME_HEADER_SIZE))
+    {
+      uint32_t size, object_num;
+      Frame frame;
+      std::memcpy (&size, &record[0], 4);
+      std::memcpy (&frame.frame, &record[4], 4);
+      std::memcpy (&frame.acquired_us, &record[8], 8);
+      std::memcpy (&object_num, &record[28], 4);
+      if (object_num > PoseSink::MAX_OBJECTS || size != PoseSink::FRAME_HEADER_SIZE + object_num * object_size ||
+          !ifs.read (&record[PoseSink::FRAME_HEADER_SIZE], object_num * object_size))
+      {
+        PCL_WARN ("%s is truncated after %d frames\n", path.c_str (), static_cast<int> (frames_.size ()));
+        break;
+      }
+      frame.objects.resize (object_num);
+      for (uint32_t k = 0; k < object_num; k++)
+      {
+        const char* data = &record[PoseSink::FRAME_HEADER_SIZE + k * object_size];
+        Object& object = frame.objects[k];
+        uint32_t lost;
+        std::memcpy (&object.id, data, 4);
+        std::memcpy (&lost, data + 4, 4);
+        std::memcpy (&object.x, data + 8, 6 * sizeof (float));
+        object.lost = lost != 0;
+      }
+      frames_.push_back (frame);
+    }
+    return (true);
+  }
+
+  const std::vector<Frame>&
+  getFrames () const
+  {
+    return (frames_);
+  }
+
+  // frames per second between the first and the last frame
+  double
+  getFrameRate () const
+  {
+    if (frames_.size () < 2 || frames_.back ().acquired_us <= frames_.front ().acquired_us)
+      return (0.0);
+    return (1e6 * static_cast<double> (frames_.size () - 1) /
+            static_cast<double> (frames_.back ().acquired_us - frames_.front ().acquired_us));
+  }
+
+  // matches the frames by number. the objects are associated once, nearest
+  // first on the first frame both contain, since their ids depend on the
+  // order the clustering found them in.
+  Error
+  compare (const PoseTrajectory &estimate) const
+  {
+    Error error = Error ();
+    std::map<uint32_t, const Frame*> estimated;
+    for (size_t i = 0; i < estimate.frames_.size (); i++)
+      estimated[estimate.frames_[i].frame] = &estimate.frames_[i];
+    std::map<uint32_t, uint32_t> association;
+    bool associated = false;
+    double sum_squares = 0.0, sum_angles = 0.0;
+    for (size_t i = 0; i < frames_.size (); i++)
+    {
+      const std::map<uint32_t, const Frame*>::const_iterator match = estimated.find (frames_[i].frame);
+      if (match != estimated.end () && !associated)
+      {
+        associate (frames_[i], *match->second, association);
+        associated = true;
+      }
+      for (size_t k = 0; k < frames_[i].objects.size (); k++)
+      {
+        const Object& reference = frames_[i].objects[k];
+        if (reference.lost)
+          continue;
+        ++error.object_frames;
+        const Object* object = 0;
+        if (match != estimated.end () && association.count (reference.id))
+          object = find (*match->second, association[reference.id]);
+        if (!object || object->lost)
+          continue;
+        ++error.tracked;
+        const double distance = (position (*object) - position (reference)).norm ();
+        sum_squares += distance * distance;
+        error.max_translation = std::max (error.max_translation, distance);
+        sum_angles += Eigen::AngleAxisf (rotation (reference).transpose () * rotation (*object)).angle ();
+      }
+    }
+    if (error.tracked > 0)
+    {
+      error.rms_translation = sqrt (sum_squares / static_cast<double> (error.tracked));
+      error.mean_rotation = sum_angles / static_cast<double> (error.tracked);
+    }
+    return (error);
+  }
+
+protected:
+  static void
+  associate (const Frame &reference, const Frame &estimate, std::map<uint32_t, uint32_t> &association)
+  {
+    std::vector<bool> taken (estimate.objects.size (), false);
+    for (size_t k = 0; k < reference.objects.size (); k++)
+    {
+      int nearest = -1;
+      float nearest_distance = std::numeric_limits<float>::max ();
+      for (size_t j = 0; j < estimate.objects.size (); j++)
+      {
+        const float distance = (position (estimate.objects[j]) - position (reference.objects[k])).squaredNorm ();
+        if (!taken[j] && distance < nearest_distance)
+        {
+          nearest = static_cast<int> (j);
+          nearest_distance = distance;
+        }
+      }
+      if (nearest < 0)
+        break;
+      taken[nearest] = true;
+      association[reference.objects[k].id] = estimate.objects[nearest].id;
+    }
+  }
+
+  static const Object*
+  find (const Frame &frame, uint32_t id)
+  {
+    for (size_t k = 0; k < frame.objects.size (); k++)
+      if (frame.objects[k].id == id)
+        return (&frame.objects[k]);
+    return (0);
+  }
+
+  static Eigen::Vector3f
+  position (const Object &object)
+  {
+    return (Eigen::Vector3f (object.x, object.y, object.z));
+  }
+
+  // same convention as pcl::getTransformation
+  static Eigen::Matrix3f
+  rotation (const Object &object)
+  {
+    return (Eigen::Matrix3f (Eigen::AngleAxisf (object.yaw, Eigen::Vector3f::UnitZ ()) *
+                             Eigen::AngleAxisf (object.pitch, Eigen::Vector3f::UnitY ()) *
+                             Eigen::AngleAxisf (object.roll, Eigen::Vector3f::UnitX ())));
+  }
+
+  std::vector<Frame> frames_;
+};
+
+using namespace pcl::tracking;
+
+template <typename PointType>
+class OpenNISegmentTracking
+{
+public:
+  typedef pcl::PointXYZRGBNormal RefPointType;
+  typedef ParticleXYZRPY ParticleT;
+  
+  typedef pcl::PointCloud<PointType> Cloud;
+  typedef pcl::PointCloud<RefPointType> RefCloud;
+  typedef typename RefCloud::Ptr RefCloudPtr;
+  typedef typename RefCloud::ConstPtr RefCloudConstPtr;
+  typedef typename Cloud::Ptr CloudPtr;
+  typedef typename Cloud::ConstPtr CloudConstPtr;
+  typedef BatchedParticleFilterTracker ParticleFilter;
+  //typedef ParticleFilterOMPTracker<RefPointType, ParticleT> ParticleFilter;
+  //typedef ParticleFilterTracker<RefPointType, ParticleT> ParticleFilter;
+  typedef typename ParticleFilter::CoherencePtr CoherencePtr;
+
+  // grabber frame and the time it was received
+  struct AcquiredFrame
+  {
+    pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr cloud;
+    uint64_t acquired_us;
+  };
+
+  // output of the preprocessing stage, handed to the tracking stage
+  struct PreprocessedFrame
+  {
+    uint32_t seq;
+    uint64_t acquired_us;
+    CloudPtr cloud_pass_downsampled;
+    pcl::PointCloud<pcl::Normal>::Ptr normals;
+    RefCloudPtr tracking_cloud;
+    // resolution of an organized input, 0 otherwise, and its intrinsics
+    unsigned sensor_width, sensor_height;
+    CameraIntrinsics sensor_intrinsics;
+    // frames of the additional sensors that go with this one of the primary
+    // sensor, in its coordinates
+    std::vector<boost::shared_ptr<PreprocessedFrame> > sensor_frames;
+  };
+  typedef boost::shared_ptr<PreprocessedFrame> PreprocessedFramePtr;
+
+  // a sensor besides the primary one, preprocessed on its own thread into
+  // the coordinates of the primary one
+  struct Sensor
+  {
+    Sensor (const std::string &source, const Eigen::Matrix4f &extrinsics, const TrackingParameters &parameters)
+    : source (source)
+    , extrinsics (extrinsics)
+    , preprocessor (parameters.min_depth, parameters.max_depth, parameters.leaf_size, parameters.normal_radius)
+    , input_queue (1, true)
+    , output_queue (1, true)
+    {
+    }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    std::string source;
+    Eigen::Affine3f extrinsics;
+    boost::shared_ptr<pcl::Grabber> grabber;
+    OrganizedPreprocessor preprocessor;
+    FrameQueue<AcquiredFrame> input_queue;
+    FrameQueue<PreprocessedFramePtr> output_queue;
+    boost::thread thread;
+  };
+  typedef boost::shared_ptr<Sensor> SensorPtr;
+
+  // what the viewer draws of one frame. the tracking stage fills the back
+  // slot of snapshots_ in place, so its clouds keep their capacity.
+  struct VizSnapshot
+  {
+    VizSnapshot ()
+    : cloud (new Cloud)
+    , particles (new pcl::PointCloud<pcl::PointXYZ>)
+    {
+    }
+
+    CloudPtr cloud;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr particles;
+    // reference and result of every tracked object; no reference for a lost one
+    std::vector<RefCloudConstPtr> references;
+    std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > results;
+  };
+
+  // one cluster on the table, its tracker and the region of interest around
+  // its last result
+  struct TrackedObject
+  {
+    boost::shared_ptr<ParticleFilter> tracker;
+    boost::shared_ptr<ProjectiveCloudCoherence<RefPointType> > projective_coherence;
+    // centroid, bounding radius and half the size of the reference
+    Eigen::Vector3f reference_centroid;
+    float reference_radius;
+    size_t reference_min_points;
+    // guarded by roi_mtx_
+    bool roi_valid;
+    Eigen::Vector3f roi_min, roi_max;
+    float roi_scale;
+    // appearance of the reference, and the frames in a row the tracker
+    // matched poorly; a lost object is not tracked until re-acquired
+    ObjectDescriptor descriptor;
+    int weak_frames;
+    bool lost;
+  };
+  typedef boost::shared_ptr<TrackedObject> TrackedObjectPtr;
+  
+  OpenNISegmentTracking (const std::string& device_id, const TrackingParameters &parameters = TrackingParameters ())
+  : parameters_ (parameters)
+  , grid_ (parameters.leaf_size)
+  , headless_ (false)
+  , table_removal_ (true)
+  , table_store_ (4)
+  , reacquisition_ (true)
+  , device_id_ (device_id)
+  , replay_fps_ (0.0f)
+  , replay_repeat_ (false)
+  , record_compress_ (true)
+  , sensor_view (0)
+  , reference_view (0)
+  , projective_ (false)
+  , batched_weighting_ (true)
+  , compact_target_ (false)
+  , search_radius_ (0.0f)
+  , adaptive_particles_ (true)
+  , tracking_budget_ (0.0)
+  , multi_resolution_ (false)
+  , motion_model_ (ParticleFilter::CONSTANT_VELOCITY)
+  , pool_ (new WorkStealingPool (parameters.threads > 0 ? parameters.threads : defaultWorkerNum ()))
+  , preprocessor_ (parameters.min_depth, parameters.max_depth, parameters.leaf_size, parameters.normal_radius)
+  , fused_preprocessing_ (true)
+  , pass_store_ (2)
+  , downsampled_store_ (4)
+  , normal_store_ (4)
+  , tracking_store_ (4)
+  , use_roi_ (false)
+  , roi_store_ (4)
+  , pipelined_ (true)
+  , input_queue_ (1, true)
+  , preprocessed_queue_ (1, true)
+  , merged_store_ (4)
+  , merged_tracking_store_ (4)
+  {
+    pass_.setFilterFieldName ("z");
+    pass_.setFilterLimits (parameters.min_depth, parameters.max_depth);
+    pass_.setKeepOrganized (true);
+    firstp_ = true;
+    
+    seg_.setOptimizeCoefficients (true);
+    seg_.setModelType (pcl::SACMODEL_PLANE);
+    seg_.setMethodType (pcl::SAC_RANSAC);
+    seg_.setMaxIterations (parameters.plane_iterations);
+    seg_.setDistanceThreshold (parameters.plane_threshold);
+    
+    normal_tree_.reset (new pcl::KdTreeFLANN<pcl::PointXYZRGB> ());
+    
+    extract_positive_.setNegative (false);
+    cluster_extraction_.setClusterTolerance (0.05f);
+    cluster_extraction_.setMinClusterSize (100);
+    cluster_extraction_.setMaxClusterSize (25000);
+    cluster_extraction_.setWorkerPool (pool_.get ());
+  }
+
+  // tracker for one of object_num objects. the batched weighting runs on
+  // pool_, the per-particle one splits the workers between the objects.
+  boost::shared_ptr<ParticleFilter>
+  createTracker (TrackedObject &object, size_t object_num)
+  {
+    std::vector<double> default_step_covariance = std::vector<double> (6, 0.01 * 0.01);
+    std::vector<double> initial_noise_covariance = std::vector<double> (6, 0.0);
+    std::vector<double> default_initial_mean = std::vector<double> (6, 0.0);
+    
+    const unsigned threads = std::max (1u, static_cast<unsigned> (pool_->getThreadNum () / std::max<size_t> (1, object_num)));
+    boost::shared_ptr<ParticleFilter> tracker = boost::shared_ptr<ParticleFilter>
+      (new ParticleFilter (threads)); // 9.52 - 800 particles/4threads
+    
+    tracker->setStepNoiseCovariance (default_step_covariance);
+    tracker->setInitialNoiseCovariance (initial_noise_covariance);
+    tracker->setInitialNoiseMean (default_initial_mean);
+    tracker->setIterationNum (1);
+    // with a motion model the particles only cover the prediction error
+    int particle_num = parameters_.particle_num;
+    if (particle_num == 0)
+      particle_num = motion_model_ != ParticleFilter::MOTION_NONE ? 200 : 400;
+    tracker->setParticleNum (particle_num);
+    if (adaptive_particles_)
+      tracker->setAdaptiveParticleNum (std::max (1, particle_num / 4), 2 * particle_num);
+    tracker->setMotionModel (motion_model_);
+    tracker->setTimeBudget (tracking_budget_, 4);
+    tracker->setBatchedWeighting (batched_weighting_);
+    tracker->setCompactTarget (compact_target_);
+    tracker->setSearchRadius (search_radius_);
+    if (multi_resolution_)
+    {
+      std::vector<float> leaf_sizes;
+      leaf_sizes.push_back (0.04f);
+      leaf_sizes.push_back (0.02f);
+      tracker->setReferencePyramid (leaf_sizes, 0.25f);
+    }
+    tracker->setWorkerPool (pool_.get ());
+    setCoherence (*tracker, object);
+    return (tracker);
+  }
+
+  // associates reference and input points through a kd-tree over the input,
+  // or by projecting them into the sensor image
+  void
+  setProjectiveCoherence (bool projective)
+  {
+    projective_ = projective;
+    checkSingleSensor ();
+  }
+
+  void
+  setCoherence (ParticleFilter &tracker, TrackedObject &object)
+  {
+    boost::shared_ptr<PointCloudCoherence<RefPointType> > coherence;
+    object.projective_coherence.reset ();
+    if (projective_)
+    {
+      object.projective_coherence.reset (new ProjectiveCloudCoherence<RefPointType> ());
+      object.projective_coherence->setLeafSize (static_cast<float> (parameters_.leaf_size));
+      coherence = object.projective_coherence;
+    }
+    else
+    {
+      NearestPairPointCloudCoherence<RefPointType>::Ptr nearest_pair_coherence
+        (new NearestPairPointCloudCoherence<RefPointType> ());
+      pcl::search::AutotunedSearch<RefPointType>::SearchPtr oct;
+      if (search_radius_ > 0.0f)
+      {
+        oct.reset (new VoxelHashSearch<RefPointType> (search_radius_));
+        nearest_pair_coherence->setMaximumDistance (search_radius_);
+      }
+      else
+        oct.reset (new pcl::search::AutotunedSearch<RefPointType> (pcl::search::KDTREE));
+      nearest_pair_coherence->setSearchMethod (oct);
+      coherence = nearest_pair_coherence;
+    }
+
+    // setup coherences
+    boost::shared_ptr<DistanceCoherence<RefPointType> > distance_coherence
+      = boost::shared_ptr<DistanceCoherence<RefPointType> > (new DistanceCoherence<RefPointType> ());
+    distance_coherence->setWeight (parameters_.distance_weight);
+    coherence->addPointCoherence (distance_coherence);
+    
+    boost::shared_ptr<HSVColorCoherence<RefPointType> > color_coherence
+      = boost::shared_ptr<HSVColorCoherence<RefPointType> > (new HSVColorCoherence<RefPointType> ());
+    color_coherence->setWeight (parameters_.color_weight);
+    coherence->addPointCoherence (color_coherence);
+    
+    boost::shared_ptr<NormalCoherence<RefPointType> > normal_coherence
+      = boost::shared_ptr<NormalCoherence<RefPointType> > (new NormalCoherence<RefPointType> ());
+    normal_coherence->setWeight (parameters_.normal_weight);
+    coherence->addPointCoherence (normal_coherence);
+    
+    tracker.setCloudCoherence (coherence);
+  }
+
+  void
+  drawPlaneCoordinate (pcl::visualization::PCLVisualizer& viz)
+  {
+      pcl::PointXYZ O, X, Y, Z;
+      O.x = plane_trans_ (0, 3);
+      O.y = plane_trans_ (1, 3);
+      O.z = plane_trans_ (2, 3);
+      X.x = O.x + plane_trans_ (0, 0) * 0.1;
+      X.y = O.y + plane_trans_ (1, 0) * 0.1;
+      X.z = O.z + plane_trans_ (2, 0) * 0.1;
+      Y.x = O.x + plane_trans_ (0, 1) * 0.1;
+      Y.y = O.y + plane_trans_ (1, 1) * 0.1;
+      Y.z = O.z + plane_trans_ (2, 1) * 0.1;
+      Z.x = O.x + plane_trans_ (0, 2) * 0.15;
+      Z.y = O.y + plane_trans_ (1, 2) * 0.15;
+      Z.z = O.z + plane_trans_ (2, 2) * 0.15;
+      drawLine (viz, O, X, "x");
+      drawLine (viz, O, Y, "y");
+      drawLine (viz, O, Z, "z");
+  }
+
+  void
+  drawSearchArea (pcl::visualization::PCLVisualizer& viz, ParticleFilter& tracker, const std::string& name)
+  {
+    const ParticleXYZRPY zero_particle;
+    Eigen::Affine3f trans = tracker.getTrans ();
+    Eigen::Affine3f search_origin = trans * tracker.toEigenMatrix (zero_particle);
+    Eigen::Quaternionf q = Eigen::Quaternionf (search_origin.rotation ());
+    
+    pcl::ModelCoefficients coefficients;
+    coefficients.values.push_back (search_origin.translation ()[0]);
+    coefficients.values.push_back (search_origin.translation ()[1]);
+    coefficients.values.push_back (search_origin.translation ()[2]);
+    coefficients.values.push_back (q.x ());
+    coefficients.values.push_back (q.y ());
+    coefficients.values.push_back (q.z ());
+    coefficients.values.push_back (q.w ());
+    
+    coefficients.values.push_back (1.0);
+    coefficients.values.push_back (1.0);
+    coefficients.values.push_back (1.0);
+    
+    viz.removeShape (name);
+    viz.addCube (coefficients, name);
+  }
+
+  void drawLine (pcl::visualization::PCLVisualizer& viz, const pcl::PointXYZ& from, const pcl::PointXYZ& to, const std::string& name)
+  {
+    viz.removeShape (name);
+    viz.addLine<pcl::PointXYZ> (from, to, name);
+  }
+  
+  bool
+  drawParticles (pcl::visualization::PCLVisualizer& viz, const VizSnapshot &snapshot)
+  {
+    if (snapshot.particles->points.empty ())
+    {
+      PCL_WARN ("no particles\n");
+      return false;
+    }
+    pcl::visualization::PointCloudColorHandlerCustom<pcl::PointXYZ> blue_color (snapshot.particles, 0, 0, 255);
+    if (!viz.updatePointCloud (snapshot.particles, blue_color, "particle cloud"))
+      viz.addPointCloud (snapshot.particles, blue_color, "particle cloud");
+    return true;
+  }
+  
+  // transforms the references into result_clouds_, which only the viewer
+  // thread touches
+  void
+  drawResult (pcl::visualization::PCLVisualizer& viz, const VizSnapshot &snapshot)
+  {
+    for (size_t k = 0; k < std::max (snapshot.references.size (), result_clouds_.size ()); k++)
+    {
+      std::stringstream name;
+      name << "resultcloud" << k;
+      if (k >= snapshot.references.size () || !snapshot.references[k])
+      {
+        viz.removePointCloud (name.str ());
+        continue;
+      }
+      if (k >= result_clouds_.size ())
+        result_clouds_.push_back (RefCloudPtr (new RefCloud));
+      const RefCloudPtr& result_cloud = result_clouds_[k];
+      pcl::transformPointCloud<pcl::PointXYZRGBNormal> (*snapshot.references[k], *result_cloud,
+                                                        Eigen::Affine3f (snapshot.results[k]));
+      pcl::visualization::PointCloudColorHandlerCustom<pcl::PointXYZRGBNormal> red_color (result_cloud, 255, 0, 0);
+      if (!viz.updatePointCloud (result_cloud, red_color, name.str ()))
+        viz.addPointCloud (result_cloud, red_color, name.str ());
+    }
+  }
+
+  // draws the latest snapshot, if the tracking stage published a new one;
+  // shares no lock with the tracking stage
+  void
+  viz_cb (pcl::visualization::PCLVisualizer& viz)
+  {
+    viz.setBackgroundColor (0.8, 0.8, 0.8);
+    if (!snapshots_.update ())
+      return;
+    const VizSnapshot& snapshot = snapshots_.front ();
+    if (!viz.updatePointCloud (snapshot.cloud, "cloudpass"))
+    {
+      viz.addPointCloud (snapshot.cloud, "cloudpass");
+      viz.resetCameraViewpoint ("cloudpass");
+    }
+    if (drawParticles (viz, snapshot))
+      drawResult (viz, snapshot);
+  }
+
+  // copies what the viewer draws of the frame into the back snapshot and
+  // publishes it; allocates only while the snapshot buffers grow
+  void
+  publishSnapshot (const Cloud &cloud)
+  {
+    STAGE_TIMER ("publishSnapshot");
+    VizSnapshot& snapshot = snapshots_.back ();
+    *snapshot.cloud = cloud;
+    size_t particle_num = 0;
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      ParticleFilter::PointCloudStatePtr particles = objects_[k]->tracker->getParticles ();
+      particle_num += particles ? particles->points.size () : 0;
+    }
+    snapshot.particles->points.resize (particle_num);
+    snapshot.particles->width = static_cast<uint32_t> (particle_num);
+    snapshot.particles->height = 1;
+    snapshot.references.resize (objects_.size ());
+    snapshot.results.resize (objects_.size ());
+    size_t i = 0;
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      ParticleFilter& tracker = *objects_[k]->tracker;
+      ParticleFilter::PointCloudStatePtr particles = tracker.getParticles ();
+      for (size_t p = 0; particles && p < particles->points.size (); p++, i++)
+      {
+        snapshot.particles->points[i].x = particles->points[p].x;
+        snapshot.particles->points[i].y = particles->points[p].y;
+        snapshot.particles->points[i].z = particles->points[p].z;
+      }
+      snapshot.references[k] = objects_[k]->lost ? RefCloudConstPtr () : tracker.getReferenceCloud ();
+      snapshot.results[k] = tracker.toEigenMatrix (tracker.getResult ()).matrix ();
+    }
+    snapshots_.publish ();
+  }
+
+  void filterPassThrough (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud, Cloud &result)
+  {
+    STAGE_TIMER ("filterPassThrough");
+    pass_.setInputCloud (cloud);
+    pass_.filter (result);
+  }
+
+  void euclideanSegment (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
+                         std::vector<pcl::PointIndices> &cluster_indices)
+  {
+    STAGE_TIMER ("euclideanSegment");
+    cluster_extraction_.extract (*cloud, cluster_indices);
+  }
+
+  // the kd-tree clustering euclideanSegment replaced, for -bench_clustering
+  void euclideanSegmentKdTree (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
+                               std::vector<pcl::PointIndices> &cluster_indices)
+  {
+    STAGE_TIMER ("euclideanSegmentKdTree");
+    pcl::EuclideanClusterExtraction<pcl::PointXYZRGB> ec;
+    pcl::KdTree<pcl::PointXYZRGB>::Ptr tree (new pcl::KdTreeFLANN<pcl::PointXYZRGB>);
+    
+    ec.setClusterTolerance (0.05); // 2cm
+    ec.setMinClusterSize (100);
+    ec.setMaxClusterSize (25000);
+    ec.setSearchMethod (tree);
+    ec.setInputCloud (cloud);
+    ec.extract (cluster_indices);
+
+  }
+  
+  void gridSample (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud, Cloud &result)
+  {
+    STAGE_TIMER ("gridSample");
+    grid_.filter (*cloud, result);
+  }
+  
+  
+  void planeSegmentation (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
+                          pcl::ModelCoefficients &coefficients,
+                          pcl::PointIndices &inliers)
+  {
+    STAGE_TIMER ("planeSegmentation");
+    seg_.setInputCloud (cloud);
+    seg_.segment (inliers, coefficients);
+  }
+
+  void planeProjection (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
+                        Cloud &result,
+                        const pcl::ModelCoefficients::ConstPtr &coefficients)
+  {
+    STAGE_TIMER ("planeProjection");
+    pcl::ProjectInliers<pcl::PointXYZRGB> proj;
+    proj.setModelType (pcl::SACMODEL_PLANE);
+    proj.setInputCloud (cloud);
+    proj.setModelCoefficients (coefficients);
+    proj.filter (result);
+  }
+
+  void convexHull (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
+                   Cloud &result,
+                   std::vector<pcl::Vertices> &hull_vertices)
+  {
+    STAGE_TIMER ("convexHull");
+    pcl::ConvexHull<pcl::PointXYZRGB> chull;
+    chull.setInputCloud (cloud);
+    chull.reconstruct (*cloud_hull_, hull_vertices);
+  }
+
+  // NormalEstimation with a 3 cm radius and the viewpoint at the origin,
+  // run in ranges of points on pool_
+  void normalEstimation (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
+                         pcl::PointCloud<pcl::Normal> &result)
+  {
+    STAGE_TIMER ("normalEstimation");
+    normal_tree_->setInputCloud (cloud);
+    result.points.resize (cloud->points.size ());
+    result.width = cloud->width;
+    result.height = cloud->height;
+    result.header = cloud->header;
+    parallelFor (*pool_, static_cast<int> (cloud->points.size ()),
+                 boost::bind (&OpenNISegmentTracking::estimateNormals, this, boost::cref (*cloud), &result, _1, _2));
+    result.is_dense = true;
+    for (size_t i = 0; i < result.points.size () && result.is_dense; i++)
+      result.is_dense = pcl_isfinite (result.points[i].normal_x);
+  }
+
+  void
+  estimateNormals (const Cloud &cloud, pcl::PointCloud<pcl::Normal>* result, int begin, int end)
+  {
+    std::vector<int> indices;
+    std::vector<float> distances;
+    for (int i = begin; i < end; i++)
+    {
+      pcl::Normal& normal = result->points[i];
+      Eigen::Vector4f plane;
+      float curvature;
+      if (!pcl_isfinite (cloud.points[i].x) ||
+          normal_tree_->radiusSearch (cloud.points[i], parameters_.normal_radius, indices, distances) == 0 ||
+          !pcl::computePointNormal (cloud, indices, plane, curvature))
+      {
+        normal.normal_x = normal.normal_y = normal.normal_z = normal.curvature = std::numeric_limits<float>::quiet_NaN ();
+        continue;
+      }
+      pcl::flipNormalTowardsViewpoint (cloud.points[i], 0.0f, 0.0f, 0.0f, plane[0], plane[1], plane[2]);
+      normal.normal_x = plane[0];
+      normal.normal_y = plane[1];
+      normal.normal_z = plane[2];
+      normal.curvature = curvature;
+    }
+  }
+  
+  // tracks all objects in cloud on pool_. the batched weighting of every
+  // tracker pairs with one CorrespondenceTarget built for the frame.
+  void tracking (const pcl::PointCloud<pcl::PointXYZRGBNormal>::ConstPtr &cloud)
+  {
+    STAGE_TIMER ("tracking");
+    CorrespondenceTarget::Ptr target;
+    if (batched_weighting_)
+    {
+      target.reset (new CorrespondenceTarget);
+      target->setSearchRadius (search_radius_);
+      target->setInputCloud (cloud, projective_ ? projective_index_ : boost::shared_ptr<ProjectiveCloudCoherence<RefPointType> > (),
+                             compact_target_);
+    }
+    TaskGroup group (*pool_);
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      if (objects_[k]->lost)
+        continue;
+      objects_[k]->tracker->setSharedTarget (target);
+      objects_[k]->tracker->setInputCloud (cloud);
+      group.run (boost::bind (&ParticleFilter::compute, objects_[k]->tracker.get ()));
+    }
+    group.wait ();
+  }
+
+  void addNormalToCloud (const CloudConstPtr &cloud,
+                         const pcl::PointCloud<pcl::Normal>::ConstPtr &normals,
+                         RefCloud &result)
+    {
+      STAGE_TIMER ("addNormalToCloud");
+      result.points.resize (cloud->points.size ());
+      result.width = cloud->width;
+      result.height = cloud->height;
+      result.is_dense = cloud->is_dense;
+      result.header = cloud->header;
+      if (!cloud->points.empty ())
+        interleaveNormals (&cloud->points[0], &normals->points[0], cloud->points.size (), &result.points[0]);
+    }
+  
+  // grabber callback; with the pipeline running it only hands the frame to
+  // the preprocessing thread
+  void
+  cloud_cb (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud)
+  {
+    AcquiredFrame acquired;
+    acquired.cloud = cloud;
+    acquired.acquired_us = monotonicMicroseconds ();
+    if (recorder_.isOpen ())
+    {
+      STAGE_TIMER ("record");
+      recorder_.write (*cloud, acquired.acquired_us);
+    }
+    if (pipelined_)
+    {
+      input_queue_.push (acquired);
+      return;
+    }
+    STAGE_TIMER ("computation");
+    PreprocessedFramePtr frame = preprocess (acquired);
+    if (gatherSensorFrames (*frame))
+      track (frame);
+  }
+
+  // grabber callback of an additional sensor
+  void
+  sensor_cb (Sensor* sensor, const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud)
+  {
+    AcquiredFrame acquired;
+    acquired.cloud = cloud;
+    acquired.acquired_us = monotonicMicroseconds ();
+    sensor->input_queue.push (acquired);
+  }
+
+  // the organized preprocessing of a frame of sensor, moved into the
+  // coordinates of the primary sensor. the region of interest is the box
+  // around the primary one's in the coordinates of sensor.
+  PreprocessedFramePtr
+  preprocessSensor (Sensor &sensor, const AcquiredFrame &acquired)
+  {
+    STAGE_TIMER ("preprocessSensor");
+    PreprocessedFramePtr frame (new PreprocessedFrame);
+    frame->seq = acquired.cloud->header.seq;
+    frame->acquired_us = acquired.acquired_us;
+    frame->sensor_width = frame->sensor_height = 0;
+    if (!acquired.cloud->isOrganized ())
+    {
+      PCL_WARN ("dropped an unorganized frame of the sensor %s\n", sensor.source.c_str ());
+      frame->cloud_pass_downsampled.reset (new Cloud);
+      return (frame);
+    }
+    Eigen::Vector3f roi_min, roi_max;
+    if (getRegionOfInterest (roi_min, roi_max))
+    {
+      const Eigen::Affine3f to_sensor = sensor.extrinsics.inverse ();
+      Eigen::Vector3f min = Eigen::Vector3f::Constant (std::numeric_limits<float>::max ());
+      Eigen::Vector3f max = -min;
+      for (int corner = 0; corner < 8; corner++)
+      {
+        const Eigen::Vector3f p = to_sensor * Eigen::Vector3f ((corner & 1) ? roi_max[0] : roi_min[0],
+                                                               (corner & 2) ? roi_max[1] : roi_min[1],
+                                                               (corner & 4) ? roi_max[2] : roi_min[2]);
+        min = min.cwiseMin (p);
+        max = max.cwiseMax (p);
+      }
+      sensor.preprocessor.setRegionOfInterest (min, max);
+    }
+    else
+      sensor.preprocessor.clearRegionOfInterest ();
+    sensor.preprocessor.compute (*acquired.cloud, !firstp_, frame->cloud_pass_downsampled, frame->tracking_cloud);
+    pcl::transformPointCloud (*frame->cloud_pass_downsampled, *frame->cloud_pass_downsampled, sensor.extrinsics);
+    if (frame->tracking_cloud)
+      pcl::transformPointCloudWithNormals (*frame->tracking_cloud, *frame->tracking_cloud, sensor.extrinsics);
+    return (frame);
+  }
+
+  // adds the next frame of every additional sensor to frame and merges their
+  // points into its downsampled cloud. the frame counts as acquired when
+  // the oldest of them was. false once a sensor has stopped.
+  bool
+  gatherSensorFrames (PreprocessedFrame &frame)
+  {
+    if (sensors_.empty ())
+      return (true);
+    STAGE_TIMER ("gatherSensors");
+    frame.sensor_frames.resize (sensors_.size ());
+    uint64_t newest_us = frame.acquired_us;
+    size_t point_num = frame.cloud_pass_downsampled->points.size ();
+    for (size_t k = 0; k < sensors_.size (); k++)
+    {
+      if (!sensors_[k]->output_queue.pop (frame.sensor_frames[k]))
+        return (false);
+      frame.acquired_us = std::min (frame.acquired_us, frame.sensor_frames[k]->acquired_us);
+      newest_us = std::max (newest_us, frame.sensor_frames[k]->acquired_us);
+      point_num += frame.sensor_frames[k]->cloud_pass_downsampled->points.size ();
+    }
+    STAGE_RECORD ("sensors.skew", newest_us - frame.acquired_us);
+    CloudPtr merged = merged_store_.acquire (point_num);
+    merged->header = frame.cloud_pass_downsampled->header;
+    typename std::vector<PointType, Eigen::aligned_allocator<PointType> >::iterator out =
+      std::copy (frame.cloud_pass_downsampled->points.begin (), frame.cloud_pass_downsampled->points.end (), merged->points.begin ());
+    for (size_t k = 0; k < sensors_.size (); k++)
+    {
+      const Cloud& cloud = *frame.sensor_frames[k]->cloud_pass_downsampled;
+      out = std::copy (cloud.points.begin (), cloud.points.end (), out);
+    }
+    frame.cloud_pass_downsampled = merged;
+    return (true);
+  }
+
+  // pass-through, voxel grid and, once the tracker has a reference, normals
+  PreprocessedFramePtr
+  preprocess (const AcquiredFrame &acquired)
+  {
+    STAGE_TIMER ("preprocess");
+    STAGE_RECORD ("queue.preprocess", monotonicMicroseconds () - acquired.acquired_us);
+    PreprocessedFramePtr frame (new PreprocessedFrame);
+    frame->seq = acquired.cloud->header.seq;
+    frame->acquired_us = acquired.acquired_us;
+    frame->sensor_width = acquired.cloud->isOrganized () ? acquired.cloud->width : 0;
+    frame->sensor_height = acquired.cloud->isOrganized () ? acquired.cloud->height : 0;
+    if (projective_ && acquired.cloud->isOrganized ())
+      frame->sensor_intrinsics = preprocessor_.updateIntrinsics (*acquired.cloud);
+    Eigen::Vector3f roi_min, roi_max;
+    const bool crop = getRegionOfInterest (roi_min, roi_max);
+    if (fused_preprocessing_ && acquired.cloud->isOrganized ())
+    {
+      STAGE_TIMER ("fusedPreprocess");
+      if (crop)
+        preprocessor_.setRegionOfInterest (roi_min, roi_max);
+      else
+        preprocessor_.clearRegionOfInterest ();
+      preprocessor_.compute (*acquired.cloud, !firstp_, frame->cloud_pass_downsampled, frame->tracking_cloud);
+      return frame;
+    }
+    CloudPtr cloud_pass = pass_store_.acquire (0);
+    filterPassThrough (acquired.cloud, *cloud_pass);
+    frame->cloud_pass_downsampled = downsampled_store_.acquire (0);
+    gridSample (cloud_pass, *frame->cloud_pass_downsampled);
+    if (crop)
+    {
+      CloudPtr cloud_roi = roi_store_.acquire (0);
+      cropRegionOfInterest (*frame->cloud_pass_downsampled, roi_min, roi_max, *cloud_roi);
+      frame->cloud_pass_downsampled = cloud_roi;
+    }
+    // normal_tree_ is shared with the initialization in track (), which never runs
+    // again once firstp_ is cleared
+    if (!firstp_)
+    {
+      frame->normals = normal_store_.acquire (0);
+      normalEstimation (frame->cloud_pass_downsampled, *frame->normals);
+    }
+    return frame;
+  }
+
+  // initializes one tracker per reference cloud, with the reference
+  // attributes of a model if there are any
+  void
+  startTracking (const std::vector<RefCloudPtr> &references,
+                 const std::vector<ReferenceModel::Object>* model_objects = 0)
+  {
+    std::vector<TrackedObjectPtr> objects;
+    for (size_t k = 0; k < references.size (); k++)
+    {
+      TrackedObjectPtr object (new TrackedObject);
+      object->tracker = createTracker (*object, references.size ());
+      object->tracker->setReferenceCloud (references[k]);
+      object->tracker->setMinIndices (references[k]->points.size () / 2);
+      object->tracker->setTrans (Eigen::Affine3f::Identity ());
+      if (model_objects)
+        object->tracker->setReferenceAttributes ((*model_objects)[k].attributes);
+      setReferenceExtent (*object, *references[k]);
+      object->descriptor.compute (*references[k], plane_trans_.block<3, 1> (0, 2));
+      object->weak_frames = 0;
+      object->lost = false;
+      objects.push_back (object);
+    }
+    if (projective_)
+    {
+      projective_index_.reset (new ProjectiveCloudCoherence<RefPointType> ());
+      projective_index_->setLeafSize (static_cast<float> (parameters_.leaf_size));
+    }
+    {
+      boost::mutex::scoped_lock lock (roi_mtx_);
+      objects_.swap (objects);
+    }
+    firstp_ = objects_.empty ();
+  }
+
+  // writes the references of the trackers and the table to path
+  bool
+  saveModel (const std::string &path)
+  {
+    ReferenceModel model;
+    model.plane_trans = plane_trans_;
+    if (cloud_hull_)
+      model.hull = *cloud_hull_;
+    model.objects.resize (objects_.size ());
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      ParticleFilter& tracker = *objects_[k]->tracker;
+      model.objects[k].reference.reset (new RefCloud (*tracker.getReferenceCloud ()));
+      model.objects[k].attributes = tracker.getReferenceAttributes ();
+    }
+    if (!model.save (path))
+      return (false);
+    std::cout << "saved " << objects_.size () << " objects to " << path << std::endl;
+    return (true);
+  }
+
+  // starts tracking from the references and the table in path instead of
+  // segmenting the first frame
+  bool
+  loadModel (const std::string &path)
+  {
+    STAGE_TIMER ("loadModel");
+    ReferenceModel model;
+    if (!model.load (path))
+      return (false);
+    boost::mutex::scoped_lock lock (mtx_);
+    plane_trans_ = model.plane_trans;
+    cloud_hull_.reset (new Cloud (model.hull));
+    table_.setPlane (plane_trans_, *cloud_hull_);
+    std::vector<RefCloudPtr> references;
+    for (size_t k = 0; k < model.objects.size (); k++)
+      references.push_back (model.objects[k].reference);
+    startTracking (references, &model.objects);
+    std::cout << "loaded " << objects_.size () << " objects from " << path << std::endl;
+    return (true);
+  }
+
+  // model to start from, and where to save the model of an online
+  // initialization; empty for none
+  void
+  setModelFiles (const std::string &model_file, const std::string &save_model_file)
+  {
+    model_file_ = model_file;
+    save_model_file_ = save_model_file;
+  }
+
+  // segments the table plane of cloud and writes the points above its convex
+  // hull to nonplane, false if there is no plane
+  bool
+  extractTabletopObjects (const CloudPtr &cloud_pass_downsampled, Cloud &nonplane)
+  {
+    pcl::ModelCoefficients::Ptr coefficients (new pcl::ModelCoefficients ());
+    pcl::PointIndices::Ptr inliers (new pcl::PointIndices ());
+    planeSegmentation (cloud_pass_downsampled, *coefficients, *inliers);
+    if (inliers->indices.size () <= 3)
+      return (false);
+    CloudPtr cloud_projected (new Cloud ());
+    planeProjection (cloud_pass_downsampled, *cloud_projected, coefficients);
+    
+    cloud_hull_.reset (new Cloud);
+    convexHull (cloud_projected, *cloud_hull_, hull_vertices_);
+      
+    plane_trans_ = estimatePlaneCoordinate(cloud_hull_);
+    table_.setPlane (plane_trans_, *cloud_hull_);
+    
+    pcl::PointIndices::Ptr inliers_polygon (new pcl::PointIndices ());
+    pcl::ExtractPolygonalPrismData<pcl::PointXYZRGB> polygon_extract;
+    {
+      STAGE_TIMER ("prismExtraction");
+      polygon_extract.setHeightLimits (0.01, 10.0);
+      polygon_extract.setInputPlanarHull (cloud_hull_);
+      polygon_extract.setInputCloud (cloud_pass_downsampled);
+      polygon_extract.segment (*inliers_polygon);
+    
+      extract_positive_.setInputCloud (cloud_pass_downsampled);
+      extract_positive_.setIndices (inliers_polygon);
+  
+      extract_positive_.filter (nonplane);
+    }
+    return (true);
+  }
+
+  // initializes the tracker on the first frame with a table plane, then
+  // tracks the reference in every following frame
+  void
+  track (const PreprocessedFramePtr &frame)
+  {
+    STAGE_TIMER ("track");
+    const uint64_t track_start_us = monotonicMicroseconds ();
+    const CloudPtr &cloud_pass_downsampled = frame->cloud_pass_downsampled;
+    boost::mutex::scoped_lock lock (mtx_);
+    if (firstp_)
+    {
+      nonplane_cloud_.reset (new Cloud);
+      if (extractTabletopObjects (cloud_pass_downsampled, *nonplane_cloud_))
+      {
+        std::vector<pcl::PointIndices> cluster_indices;
+        euclideanSegment (nonplane_cloud_, cluster_indices);
+        PCL_INFO ("%d clusters on the table.\n", static_cast<int> (cluster_indices.size ()));
+        
+        // track every segment; without any, try again on the next frame
+        std::vector<RefCloudPtr> references;
+        for (size_t k = 0; k < cluster_indices.size (); k++)
+        {
+          const pcl::PointIndices& segmented_indices = cluster_indices[k];
+          segmented_cloud_.reset (new Cloud);
+          for (size_t i = 0; i < segmented_indices.indices.size (); i++)
+          {
+            pcl::PointXYZRGB point = nonplane_cloud_->points[segmented_indices.indices[i]];
+            segmented_cloud_->points.push_back (point);
+          }
+          segmented_cloud_->width = segmented_cloud_->points.size ();
+          segmented_cloud_->height = 1;
+          segmented_cloud_->is_dense = true;
+
+          pcl::PointCloud<pcl::Normal>::Ptr normals (new pcl::PointCloud<pcl::Normal>);
+          normalEstimation (segmented_cloud_, *normals);
+          RefCloudPtr ref_cloud (new RefCloud);
+          addNormalToCloud (segmented_cloud_, normals, *ref_cloud);
+          references.push_back (ref_cloud);
+        }
+        startTracking (references);
+        if (!firstp_ && !save_model_file_.empty ())
+          saveModel (save_model_file_);
+      }
+    }
+    else
+    {
+      RefCloudPtr tracking_cloud = trackingInput (frame);
+      if (tracking_cloud && table_removal_)
+        tracking_cloud = removeTable (tracking_cloud);
+      if (tracking_cloud)
+      {
+        // an empty region of interest leaves the tracker where it was
+        if (!tracking_cloud->points.empty ())
+          tracking (tracking_cloud);
+        if (use_roi_)
+          for (size_t k = 0; k < objects_.size (); k++)
+            if (!objects_[k]->lost)
+              updateRegionOfInterest (*objects_[k], *tracking_cloud);
+        if (reacquisition_ && !tracking_cloud->points.empty () && detectLoss ())
+          reacquire (*tracking_cloud);
+      }
+    }
+    if (!headless_)
+      publishSnapshot (*cloud_pass_downsampled);
+    const uint64_t end_us = monotonicMicroseconds ();
+    STAGE_RECORD ("latency.endToEnd", end_us - frame->acquired_us);
+    if (pose_sink_.isOpen ())
+      writePoses (frame->seq, frame->acquired_us, track_start_us, end_us);
+  }
+
+  // streams the results of the frame to pose_sink_
+  void
+  writePoses (uint32_t seq, uint64_t acquired_us, uint64_t track_start_us, uint64_t end_us)
+  {
+    pose_sink_.beginFrame (seq, acquired_us, static_cast<uint32_t> (track_start_us - acquired_us),
+                           static_cast<uint32_t> (end_us - track_start_us), static_cast<uint32_t> (end_us - acquired_us));
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      ParticleFilter& tracker = *objects_[k]->tracker;
+      const ParticleXYZRPY result = tracker.getResult ();
+      pose_sink_.addObject (static_cast<uint32_t> (k), result, tracker.getMatchScore (),
+                            particleSpread (tracker, result), objects_[k]->lost);
+    }
+    pose_sink_.endFrame ();
+  }
+
+  // root mean square distance of the particle positions from result
+  static float
+  particleSpread (ParticleFilter &tracker, const ParticleXYZRPY &result)
+  {
+    ParticleFilter::PointCloudStatePtr particles = tracker.getParticles ();
+    if (!particles || particles->points.empty ())
+      return (0.0f);
+    double sum = 0.0;
+    for (size_t i = 0; i < particles->points.size (); i++)
+    {
+      const ParticleXYZRPY& p = particles->points[i];
+      sum += (p.x - result.x) * (p.x - result.x) + (p.y - result.y) * (p.y - result.y) + (p.z - result.z) * (p.z - result.z);
+    }
+    return (static_cast<float> (sqrt (sum / static_cast<double> (particles->points.size ()))));
+  }
+
+  // an object is lost after LOSS_FRAMES frames in a row whose best particle
+  // matches worse than LOSS_SCORE, or worse than WEAK_SCORE while the
+  // weights collapsed onto a few particles. true if any object is lost.
+  bool
+  detectLoss ()
+  {
+    bool any_lost = false;
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      TrackedObject& object = *objects_[k];
+      const float score = object.tracker->getMatchScore ();
+      ParticleFilter::PointCloudStatePtr particles = object.tracker->getParticles ();
+      // the per-particle weighting gives no score
+      if (!object.lost && pcl_isfinite (score) && particles && !particles->points.empty ())
+      {
+        const double collapse = object.tracker->getEffectiveSampleSize () / static_cast<double> (particles->points.size ());
+        const bool weak = score < LOSS_SCORE || (score < WEAK_SCORE && collapse < COLLAPSED_SAMPLE_FRACTION);
+        object.weak_frames = weak ? object.weak_frames + 1 : 0;
+        if (object.weak_frames >= LOSS_FRAMES)
+        {
+          std::cout << "lost object " << k << " (match " << score << ")" << std::endl;
+          STAGE_RECORD_UNIT ("tracking.losses", "objects", 1);
+          object.lost = true;
+          boost::mutex::scoped_lock lock (roi_mtx_);
+          object.roi_valid = false;
+        }
+      }
+      any_lost = any_lost || object.lost;
+    }
+    return (any_lost);
+  }
+
+  // clusters the points above the table and reseeds every lost object at
+  // the cluster that looks most like its reference, leaving out clusters at
+  // objects that are still tracked. clustering the downsampled points and
+  // comparing at most MAX_REACQUISITION_CANDIDATES descriptors bounds the
+  // latency.
+  void
+  reacquire (const RefCloud &cloud)
+  {
+    STAGE_TIMER ("reacquire");
+    if (table_.isValid ())
+      table_.extractAbove (cloud, reacquisition_cloud_);
+    else
+      reacquisition_cloud_ = cloud;
+    std::vector<pcl::PointIndices> clusters;
+    cluster_extraction_.extract (reacquisition_cloud_, clusters);
+    if (clusters.size () > MAX_REACQUISITION_CANDIDATES)
+      clusters.resize (MAX_REACQUISITION_CANDIDATES);
+
+    const Eigen::Vector3f up = plane_trans_.block<3, 1> (0, 2);
+    std::vector<ObjectDescriptor> descriptors (clusters.size ());
+    std::vector<bool> taken (clusters.size (), false);
+    RefCloud cluster_cloud;
+    for (size_t c = 0; c < clusters.size (); c++)
+    {
+      cluster_cloud.points.resize (clusters[c].indices.size ());
+      for (size_t i = 0; i < clusters[c].indices.size (); i++)
+        cluster_cloud.points[i] = reacquisition_cloud_.points[clusters[c].indices[i]];
+      descriptors[c].compute (cluster_cloud, up);
+      for (size_t k = 0; k < objects_.size (); k++)
+      {
+        const TrackedObject& object = *objects_[k];
+        if (object.lost)
+          continue;
+        const Eigen::Vector3f center = object.tracker->toEigenMatrix (object.tracker->getResult ()) * object.reference_centroid;
+        if ((descriptors[c].centroid - center).norm () < object.reference_radius)
+          taken[c] = true;
+      }
+    }
+
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      TrackedObject& object = *objects_[k];
+      if (!object.lost)
+        continue;
+      int best = -1;
+      float best_distance = MAX_DESCRIPTOR_DISTANCE;
+      for (size_t c = 0; c < descriptors.size (); c++)
+      {
+        const float distance = object.descriptor.distance (descriptors[c]);
+        if (!taken[c] && distance < best_distance)
+        {
+          best = static_cast<int> (c);
+          best_distance = distance;
+        }
+      }
+      if (best < 0)
+        continue;
+      // keep the last orientation and move the reference onto the cluster
+      ParticleFilter& tracker = *object.tracker;
+      const Eigen::Matrix3f rotation = tracker.toEigenMatrix (tracker.getResult ()).linear ();
+      Eigen::Affine3f trans = Eigen::Affine3f::Identity ();
+      trans.linear () = rotation;
+      trans.translation () = descriptors[best].centroid - rotation * object.reference_centroid;
+      tracker.reseed (trans);
+      object.lost = false;
+      object.weak_frames = 0;
+      taken[best] = true;
+      std::cout << "re-acquired object " << k << " (descriptor distance " << best_distance << ")" << std::endl;
+      STAGE_RECORD_UNIT ("tracking.reacquisitions", "objects", 1);
+    }
+  }
+
+  // follows the table plane to cloud and returns cloud without its points
+  RefCloudPtr
+  removeTable (const RefCloudPtr &cloud)
+  {
+    STAGE_TIMER ("tableRemoval");
+    if (table_.update (*cloud))
+      plane_trans_ = table_.getTransformation ();
+    RefCloudPtr result = table_store_.acquire (cloud->points.size ());
+    table_.removeTable (*cloud, *result);
+    return (result);
+  }
+
+  // the preprocessed cloud with normals, after pointing the projective
+  // coherence at the sensor of frame. a frame without normals was
+  // preprocessed before the initialization finished and gives a null pointer.
+  RefCloudPtr
+  trackingInput (const PreprocessedFramePtr &frame)
+  {
+    if (projective_ && frame->sensor_width > 0)
+    {
+      const CameraIntrinsics& intrinsics = frame->sensor_intrinsics;
+      if (projective_index_)
+        projective_index_->setCameraIntrinsics (intrinsics, frame->sensor_width, frame->sensor_height);
+      for (size_t k = 0; k < objects_.size (); k++)
+        objects_[k]->projective_coherence->setCameraIntrinsics (intrinsics, frame->sensor_width, frame->sensor_height);
+    }
+    RefCloudPtr tracking_cloud = frame->tracking_cloud;
+    if (!tracking_cloud && frame->normals)
+    {
+      tracking_cloud = tracking_store_.acquire (0);
+      addNormalToCloud (frame->cloud_pass_downsampled, frame->normals, *tracking_cloud);
+    }
+    if (!tracking_cloud || frame->sensor_frames.empty ())
+      return (tracking_cloud);
+    // the additional sensors preprocessed without normals until the
+    // initialization finished, like the primary one
+    size_t point_num = tracking_cloud->points.size ();
+    for (size_t k = 0; k < frame->sensor_frames.size (); k++)
+      if (frame->sensor_frames[k]->tracking_cloud)
+        point_num += frame->sensor_frames[k]->tracking_cloud->points.size ();
+    RefCloudPtr merged = merged_tracking_store_.acquire (point_num);
+    merged->header = tracking_cloud->header;
+    typename std::vector<RefPointType, Eigen::aligned_allocator<RefPointType> >::iterator out =
+      std::copy (tracking_cloud->points.begin (), tracking_cloud->points.end (), merged->points.begin ());
+    for (size_t k = 0; k < frame->sensor_frames.size (); k++)
+      if (frame->sensor_frames[k]->tracking_cloud)
+      {
+        const RefCloud& cloud = *frame->sensor_frames[k]->tracking_cloud;
+        out = std::copy (cloud.points.begin (), cloud.points.end (), out);
+      }
+    return (merged);
+  }
+
+  void
+  preprocessLoop ()
+  {
+    AcquiredFrame acquired;
+    while (input_queue_.pop (acquired))
+      preprocessed_queue_.push (preprocess (acquired));
+    preprocessed_queue_.close ();
+  }
+
+  void
+  sensorLoop (Sensor* sensor)
+  {
+    AcquiredFrame acquired;
+    while (sensor->input_queue.pop (acquired))
+      sensor->output_queue.push (preprocessSensor (*sensor, acquired));
+    sensor->output_queue.close ();
+  }
+
+  void
+  trackingLoop ()
+  {
+    PreprocessedFramePtr frame;
+    while (preprocessed_queue_.pop (frame))
+    {
+      if (!gatherSensorFrames (*frame))
+        break;
+      track (frame);
+    }
+    // once a sensor has stopped, the preprocessing stage drops the rest
+    preprocessed_queue_.close ();
+  }
+
+  // runs preprocessing and tracking on their own threads, so that a stage
+  // works on frame n + 1 while the next one still processes frame n.
+  // lossless queues make every frame go through, otherwise stale frames are
+  // dropped in favor of the newest one. the additional sensors start
+  // grabbing and preprocessing here, also without the pipeline.
+  void
+  startPipeline (bool lossless)
+  {
+    for (size_t k = 0; k < sensors_.size (); k++)
+    {
+      Sensor& sensor = *sensors_[k];
+      sensor.input_queue.setDropStale (!lossless);
+      sensor.output_queue.setDropStale (!lossless);
+      sensor.thread = boost::thread (&OpenNISegmentTracking::sensorLoop, this, &sensor);
+      sensor.grabber->start ();
+    }
+    if (!pipelined_)
+      return;
+    input_queue_.setDropStale (!lossless);
+    preprocessed_queue_.setDropStale (!lossless);
+    preprocess_thread_ = boost::thread (&OpenNISegmentTracking::preprocessLoop, this);
+    tracking_thread_ = boost::thread (&OpenNISegmentTracking::trackingLoop, this);
+  }
+
+  // lets the pipeline finish the queued frames and joins its threads
+  void
+  stopPipeline ()
+  {
+    // a grabber blocked on a full lossless queue returns once it is closed
+    for (size_t k = 0; k < sensors_.size (); k++)
+    {
+      Sensor& sensor = *sensors_[k];
+      sensor.input_queue.close ();
+      if (sensor.grabber)
+        sensor.grabber->stop ();
+      if (sensor.thread.joinable ())
+        sensor.thread.join ();
+    }
+    input_queue_.close ();
+    if (preprocess_thread_.joinable ())
+      preprocess_thread_.join ();
+    if (tracking_thread_.joinable ())
+      tracking_thread_.join ();
+  }
+
+  void
+  setPipelined (bool pipelined)
+  {
+    pipelined_ = pipelined;
+  }
+
+  // once the tracker is initialized, only the box around the last result is
+  // preprocessed and tracked
+  void
+  setRegionOfInterestGating (bool use_roi)
+  {
+    use_roi_ = use_roi;
+  }
+
+  // centroid and bounding radius of the reference, the box of the region of
+  // interest is sized from them
+  void
+  setReferenceExtent (TrackedObject &object, const RefCloud &ref_cloud)
+  {
+    Eigen::Vector3f centroid = Eigen::Vector3f::Zero ();
+    for (size_t i = 0; i < ref_cloud.points.size (); i++)
+      centroid += ref_cloud.points[i].getVector3fMap ();
+    if (!ref_cloud.points.empty ())
+      centroid /= static_cast<float> (ref_cloud.points.size ());
+    float radius = 0.0f;
+    for (size_t i = 0; i < ref_cloud.points.size (); i++)
+      radius = std::max (radius, (ref_cloud.points[i].getVector3fMap () - centroid).norm ());
+    object.reference_centroid = centroid;
+    object.reference_radius = radius;
+    object.reference_min_points = ref_cloud.points.size () / 2;
+    boost::mutex::scoped_lock lock (roi_mtx_);
+    object.roi_valid = false;
+    object.roi_scale = 1.0f;
+  }
+
+  // centers the box of object on its reference moved by the last result.
+  // its half extent is the reference radius plus three standard deviations
+  // of the particle positions; it grows while fewer than the tracker's
+  // minimum number of points (half the reference) of cloud fall inside and
+  // snaps back once the object is found.
+  void
+  updateRegionOfInterest (TrackedObject &object, const RefCloud &cloud)
+  {
+    size_t points_in_roi = cloud.points.size ();
+    {
+      boost::mutex::scoped_lock lock (roi_mtx_);
+      if (object.roi_valid)
+      {
+        points_in_roi = 0;
+        for (size_t i = 0; i < cloud.points.size (); i++)
+        {
+          const Eigen::Vector3f p = cloud.points[i].getVector3fMap ();
+          if ((p.array () >= object.roi_min.array ()).all () && (p.array () <= object.roi_max.array ()).all ())
+            ++points_in_roi;
+        }
+      }
+    }
+    STAGE_RECORD_UNIT ("roi.points", "points", points_in_roi);
+    ParticleFilter& tracker = *object.tracker;
+    const Eigen::Vector3f center = tracker.toEigenMatrix (tracker.getResult ()) * object.reference_centroid;
+    float spread = 0.0f;
+    ParticleFilter::PointCloudStatePtr particles = tracker.getParticles ();
+    if (particles && !particles->points.empty ())
+    {
+      Eigen::Vector3f mean = Eigen::Vector3f::Zero (), square = Eigen::Vector3f::Zero ();
+      for (size_t i = 0; i < particles->points.size (); i++)
+      {
+        const Eigen::Vector3f position (particles->points[i].x, particles->points[i].y, particles->points[i].z);
+        mean += position;
+        square += position.cwiseProduct (position);
+      }
+      const float n = static_cast<float> (particles->points.size ());
+      mean /= n;
+      const Eigen::Vector3f variance = square / n - mean.cwiseProduct (mean);
+      spread = sqrtf (std::max (0.0f, variance.maxCoeff ()));
+    }
+
+    boost::mutex::scoped_lock lock (roi_mtx_);
+    const bool lost = object.roi_valid && points_in_roi < object.reference_min_points;
+    object.roi_scale = lost ? std::min (object.roi_scale * 1.5f, MAX_ROI_SCALE) : 1.0f;
+    const float half_extent = std::min ((object.reference_radius + 3.0f * spread) * object.roi_scale + ROI_MARGIN,
+                                        MAX_ROI_HALF_EXTENT);
+    object.roi_min = center - Eigen::Vector3f::Constant (half_extent);
+    object.roi_max = center + Eigen::Vector3f::Constant (half_extent);
+    object.roi_valid = true;
+  }
+
+  // union of the boxes of all objects, false until each of them has one
+  bool
+  getRegionOfInterest (Eigen::Vector3f &min, Eigen::Vector3f &max)
+  {
+    if (!use_roi_ || firstp_)
+      return (false);
+    boost::mutex::scoped_lock lock (roi_mtx_);
+    if (objects_.empty ())
+      return (false);
+    min = Eigen::Vector3f::Constant (std::numeric_limits<float>::max ());
+    max = Eigen::Vector3f::Constant (-std::numeric_limits<float>::max ());
+    for (size_t k = 0; k < objects_.size (); k++)
+    {
+      if (!objects_[k]->roi_valid)
+        return (false);
+      min = min.cwiseMin (objects_[k]->roi_min);
+      max = max.cwiseMax (objects_[k]->roi_max);
+    }
+    return (true);
+  }
+
+  void
+  cropRegionOfInterest (const Cloud &cloud, const Eigen::Vector3f &min, const Eigen::Vector3f &max, Cloud &result)
+  {
+    STAGE_TIMER ("cropRegionOfInterest");
+    result.points.clear ();
+    for (size_t i = 0; i < cloud.points.size (); i++)
+    {
+      const PointType& p = cloud.points[i];
+      if (p.x >= min[0] && p.x <= max[0] && p.y >= min[1] && p.y <= max[1] && p.z >= min[2] && p.z <= max[2])
+        result.points.push_back (p);
+    }
+    result.width = static_cast<uint32_t> (result.points.size ());
+    result.height = 1;
+    result.is_dense = cloud.is_dense;
+    result.header = cloud.header;
+  }
+
+  // weights all particles with one structure-of-arrays pass instead of one
+  // coherence call per particle and point pair
+  void
+  setBatchedWeighting (bool batched)
+  {
+    batched_weighting_ = batched;
+  }
+
+  // has the batched weighting gather the target from 16 byte quantized
+  // records instead of nine float arrays
+  void
+  setCompactTarget (bool compact)
+  {
+    compact_target_ = compact;
+  }
+
+  // associates reference and input points within radius through a
+  // VoxelHashSearch instead of a kd-tree; 0 restores the kd-tree
+  void
+  setSearchRadius (float radius)
+  {
+    search_radius_ = radius;
+  }
+
+  // fixes the particle count at 200 with a motion model and 400 without one,
+  // or at that of the parameters, instead of adapting it between a quarter
+  // and twice that count (50 to 400 with the default motion model)
+  void
+  setAdaptiveParticles (bool adaptive)
+  {
+    adaptive_particles_ = adaptive;
+  }
+
+  // latency target of tracking (), traded against particles and up to four
+  // iterations; 0 disables it
+  void
+  setTrackingBudget (double budget_ms)
+  {
+    tracking_budget_ = budget_ms;
+  }
+
+  // detects lost objects and looks for them among the clusters on the table
+  void
+  setReacquisition (bool reacquisition)
+  {
+    reacquisition_ = reacquisition;
+  }
+
+  // replaces the worker pool of the normals, the clustering and the
+  // trackers; 0 threads leave a core to the grabber and the viewer. call it
+  // before run ().
+  void
+  setWorkerThreads (unsigned threads, bool pin)
+  {
+    pool_.reset (new WorkStealingPool (threads > 0 ? threads : defaultWorkerNum (), pin));
+    cluster_extraction_.setWorkerPool (pool_.get ());
+    std::cout << "worker pool: " << pool_->getThreadNum () << " threads on " << pool_->getNodeNum ()
+              << " NUMA node(s)" << (pool_->isPinned () ? ", pinned" : "") << std::endl;
+  }
+
+  static unsigned
+  defaultWorkerNum ()
+  {
+    const unsigned cores = boost::thread::hardware_concurrency ();
+    return (cores > 1 ? cores - 1 : 1);
+  }
+
+  // averages the voxel centroids of the unfused preprocessing over the last
+  // frames (1: off)
+  void
+  setTemporalSmoothing (int frames)
+  {
+    grid_.setTemporalWindow (frames);
+  }
+
+  // drops the points of the table from the tracking input every frame
+  void
+  setTableRemoval (bool table_removal)
+  {
+    table_removal_ = table_removal;
+  }
+
+  // scores the particles coarse to fine on the reference thinned to 4 cm and
+  // 2 cm voxels, refining the best quarter at each level
+  void
+  setMultiResolution (bool multi_resolution)
+  {
+    multi_resolution_ = multi_resolution;
+  }
+
+  // predicts every object from its last poses before weighting the particles
+  void
+  setMotionModel (typename ParticleFilter::MotionModel motion_model)
+  {
+    motion_model_ = motion_model;
+  }
+
+  // organized frames skip pass_, grid_ and normalEstimation () and go through preprocessor_
+  void
+  setFusedPreprocessing (bool fused)
+  {
+    fused_preprocessing_ = fused;
+  }
+      
+  Eigen::Matrix4f 
+  estimatePlaneCoordinate (CloudPtr cloud_hull)
+  {
+    if (cloud_hull->points.size() >= 3)
+    {
+      Eigen::Vector3f BA (cloud_hull->points[0].x - cloud_hull->points[1].x,
+                          cloud_hull->points[0].y - cloud_hull->points[1].y,
+                          cloud_hull->points[0].z - cloud_hull->points[1].z);
+      Eigen::Vector3f BC (cloud_hull->points[2].x - cloud_hull->points[1].x,
+                          cloud_hull->points[2].y - cloud_hull->points[1].y,
+                          cloud_hull->points[2].z - cloud_hull->points[1].z);
+      Eigen::Vector3f z = BC.cross (BA);
+      z.normalize ();
+      // check the direction of z
+      
+      Eigen::Vector3f B (cloud_hull->points[1].x, cloud_hull->points[1].y, cloud_hull->points[1].z);
+      if (B.dot (z) > 0)
+        z = - z;
+      
+      // calc x, y
+      Eigen::Vector3f xx = BA;
+      // check the direction of xx
+      if (xx.dot (Eigen::Vector3f (1, 0, 0)) < 0)
+        xx = -xx;
+      xx.normalize ();
+      Eigen::Vector3f yy = z.cross (xx);
+      yy.normalize ();
+      Eigen::Vector3f ux (1.0, 0.0, 0.0);
+      double tmp = ux.dot (yy) / ux.dot (xx);
+      double beta2 = 1 / (1 + tmp * tmp);
+      double beta = sqrt (beta2);
+      double alpha = - beta * tmp;
+      Eigen::Vector3f y = alpha * xx + beta * yy;
+      Eigen::Vector3f x = y.cross (z);
+      x.normalize ();
+      y.normalize ();
+      
+      Eigen::Matrix4f ret = Eigen::Matrix4f::Identity ();
+      
+      // fill rotation
+      for (int i = 0; i < 3; i++)
+      {
+        ret(i, 0) = x[i];
+        ret(i, 1) = y[i];
+        ret(i, 2) = z[i];
+      }
+      
+      Eigen::Vector3f OB (cloud_hull->points[1].x, cloud_hull->points[1].y, cloud_hull->points[1].z);
+      double yscale = - OB.dot (y);
+      double xscale = - OB.dot (x);
+      Eigen::Vector3f position = OB + yscale * y + xscale * x;
+        
+      for (int i = 0; i < 3; i++)
+        ret (i, 3) = position[i];
+        
+      return ret;
+    }
+    return Eigen::Matrix4f::Identity ();
+  }
+  
+  // replaces the OpenNI device by a sequence of PCD files
+  void
+  setReplaySource (const std::vector<std::string>& pcd_files, float frames_per_second, bool repeat)
+  {
+    replay_files_ = pcd_files;
+    replay_fps_ = frames_per_second;
+    replay_repeat_ = repeat;
   }
 
-using namespace pcl::tracking;
+  // replaces the OpenNI device by a recording, see RecordingWriter
+  void
+  setRecordingSource (const std::string &path, float frames_per_second, bool repeat)
+  {
+    recording_file_ = path;
+    replay_fps_ = frames_per_second;
+    replay_repeat_ = repeat;
+  }
 
-template <typename PointType>
-class OpenNISegmentTracking
-{
-public:
-  typedef pcl::PointXYZRGBNormal RefPointType;
-  typedef ParticleXYZRPY ParticleT;
-  
-  typedef pcl::PointCloud<PointType> Cloud;
-  typedef pcl::PointCloud<RefPointType> RefCloud;
-  typedef typename RefCloud::Ptr RefCloudPtr;
-  typedef typename RefCloud::ConstPtr RefCloudConstPtr;
-  typedef typename Cloud::Ptr CloudPtr;
-  typedef typename Cloud::ConstPtr CloudConstPtr;
-  typedef ParticleFilterOMPTracker<RefPointType, ParticleT> ParticleFilter;
-  //typedef ParticleFilterTracker<RefPointType, ParticleT> ParticleFilter;
-  typedef typename ParticleFilter::CoherencePtr CoherencePtr;
-  
-  OpenNISegmentTracking (const std::string& device_id)
-  : viewer_ ("PCL OpenNI Tracking Viewer")
-  , device_id_ (device_id)
-  , sensor_view (0)
-  , reference_view (0)
-  , new_cloud_ (false)
-  , ne_ (4)                   // 8 threads
+  // records every frame the grabber delivers to path; empty for none
+  void
+  setRecordingOutput (const std::string &path, bool compress)
   {
-    pass_.setFilterFieldName ("z");
-    pass_.setFilterLimits (0.0, 2.0);
-    pass_.setKeepOrganized (true);
-    firstp_ = true;
-    // grid_.setFilterFieldName ("z");
-    // grid_.setFilterLimits (0.0, 2.0);
-    grid_.setLeafSize (0.01, 0.01, 0.01);
-    //grid_.setDownsampleAllData (true);
-    
-    seg_.setOptimizeCoefficients (true);
-    seg_.setModelType (pcl::SACMODEL_PLANE);
-    seg_.setMethodType (pcl::SAC_RANSAC);
-    seg_.setMaxIterations (1000);
-    seg_.setDistanceThreshold (0.03);
-    
-    pcl::KdTreeFLANN<pcl::PointXYZRGB>::Ptr tree (new pcl::KdTreeFLANN<pcl::PointXYZRGB> ());
-    ne_.setSearchMethod (tree);
-    ne_.setRadiusSearch (0.03);
-    
-    //ne_.setNormalEstimationMethod (pcl::IntegralImageNormalEstimation<pcl::PointXYZRGB, pcl::Normal>::COVARIANCE_MATRIX);
-    //ne_.setRectSize (50, 50);
-    
-    std::vector<double> default_step_covariance = std::vector<double> (6, 0.01 * 0.01);
-    std::vector<double> initial_noise_covariance = std::vector<double> (6, 0.0);
-    std::vector<double> default_initial_mean = std::vector<double> (6, 0.0);
-    
-    tracker_ = boost::shared_ptr<ParticleFilter>
-      (new ParticleFilter (4)); // 9.52 - 800 particles/4threads
-    
-    tracker_->setStepNoiseCovariance (default_step_covariance);
-    tracker_->setInitialNoiseCovariance (initial_noise_covariance);
-    tracker_->setInitialNoiseMean (default_initial_mean);
-    tracker_->setIterationNum (1);
-    //tracker_->setParticleNum (200);
-    tracker_->setParticleNum (400); 
-    // setup coherences
-    NearestPairPointCloudCoherence<RefPointType>::Ptr coherence = NearestPairPointCloudCoherence<RefPointType>::Ptr
-      (new NearestPairPointCloudCoherence<RefPointType> ());
-    boost::shared_ptr<DistanceCoherence<RefPointType> > distance_coherence
-      = boost::shared_ptr<DistanceCoherence<RefPointType> > (new DistanceCoherence<RefPointType> ());
-    distance_coherence->setWeight (05.0);
-    coherence->addPointCoherence (distance_coherence);
-    
-    boost::shared_ptr<HSVColorCoherence<RefPointType> > color_coherence
-      = boost::shared_ptr<HSVColorCoherence<RefPointType> > (new HSVColorCoherence<RefPointType> ());
-    color_coherence->setWeight (0.1);
-    coherence->addPointCoherence (color_coherence);
-    
-    boost::shared_ptr<NormalCoherence<RefPointType> > normal_coherence
-      = boost::shared_ptr<NormalCoherence<RefPointType> > (new NormalCoherence<RefPointType> ());
-    normal_coherence->setWeight (0.1);
-    coherence->addPointCoherence (normal_coherence);
-    
-    pcl::search::AutotunedSearch<RefPointType>::SearchPtr oct
-      (new pcl::search::AutotunedSearch<RefPointType> (pcl::search::KDTREE));
+    record_file_ = path;
+    record_compress_ = compress;
+  }
 
-    //pcl::search::Octree<RefPointType>::Ptr oct (new pcl::search::Octree<RefPointType> (0.01));
-    coherence->setSearchMethod (oct);
-    
-    tracker_->setCloudCoherence (coherence);
-    extract_positive_.setNegative (false);
+  // replay grabber of the recording or the PCD files, none for the device
+  ReplayGrabber*
+  createReplayGrabber (float frames_per_second, bool repeat)
+  {
+    if (!recording_file_.empty ())
+    {
+      RecordingGrabber* grabber = new RecordingGrabber (frames_per_second, repeat);
+      if (!grabber->open (recording_file_))
+      {
+        delete grabber;
+        return (0);
+      }
+      return (grabber);
+    }
+    return (new PCDReplayGrabber (replay_files_, frames_per_second, repeat));
   }
 
+  // tracks with the points of further sensors too: each an OpenNI device id,
+  // a PCD directory or a recording, and the transformation from its
+  // coordinates into those of the primary sensor
   void
-  drawPlaneCoordinate (pcl::visualization::PCLVisualizer& viz)
+  setSensors (const std::vector<std::string> &sources,
+              const std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > &extrinsics)
   {
-      pcl::PointXYZ O, X, Y, Z;
-      O.x = plane_trans_ (0, 3);
-      O.y = plane_trans_ (1, 3);
-      O.z = plane_trans_ (2, 3);
-      X.x = O.x + plane_trans_ (0, 0) * 0.1;
-      X.y = O.y + plane_trans_ (1, 0) * 0.1;
-      X.z = O.z + plane_trans_ (2, 0) * 0.1;
-      Y.x = O.x + plane_trans_ (0, 1) * 0.1;
-      Y.y = O.y + plane_trans_ (1, 1) * 0.1;
-      Y.z = O.z + plane_trans_ (2, 1) * 0.1;
-      Z.x = O.x + plane_trans_ (0, 2) * 0.15;
-      Z.y = O.y + plane_trans_ (1, 2) * 0.15;
-      Z.z = O.z + plane_trans_ (2, 2) * 0.15;
-      drawLine (viz, O, X, "x");
-      drawLine (viz, O, Y, "y");
-      drawLine (viz, O, Z, "z");
+    sensors_.clear ();
+    for (size_t k = 0; k < sources.size (); k++)
+      sensors_.push_back (SensorPtr (new Sensor (sources[k], extrinsics[k], parameters_)));
+    checkSingleSensor ();
   }
 
+  // the projective coherence sees a single sensor. checked as the options
+  // are set, before a model creates the trackers and their coherences.
   void
-  drawSearchArea (pcl::visualization::PCLVisualizer& viz)
+  checkSingleSensor ()
   {
-    const ParticleXYZRPY zero_particle;
-    Eigen::Affine3f trans = tracker_->getTrans ();
-    Eigen::Affine3f search_origin = trans * tracker_->toEigenMatrix (zero_particle);
-    Eigen::Quaternionf q = Eigen::Quaternionf (search_origin.rotation ());
+    if (projective_ && !sensors_.empty ())
+    {
+      PCL_WARN ("the projective coherence sees a single sensor, using the kd-tree one\n");
+      projective_ = false;
+    }
+  }
+
+  // reads a row-major 4x4 matrix, or its upper 3x4
+  static bool
+  loadExtrinsics (const std::string &path, Eigen::Matrix4f &extrinsics)
+  {
+    std::ifstream ifs (path.c_str ());
+    std::vector<float> values;
+    float value;
+    while (ifs >> value)
+      values.push_back (value);
+    if (!ifs.eof () || (values.size () != 12 && values.size () != 16))
+    {
+      PCL_ERROR ("%s does not hold a 3x4 or 4x4 matrix\n", path.c_str ());
+      return (false);
+    }
+    extrinsics = Eigen::Matrix4f::Identity ();
+    for (size_t i = 0; i < values.size (); i++)
+      extrinsics (i / 4, i % 4) = values[i];
+    return (true);
+  }
+
+  // creates the grabbers of the additional sensors, replays playing at
+  // frames_per_second
+  bool
+  openSensors (float frames_per_second, bool repeat)
+  {
+    for (size_t k = 0; k < sensors_.size (); k++)
+    {
+      Sensor& sensor = *sensors_[k];
+      if (boost::filesystem::is_directory (sensor.source))
+      {
+        PCDReplayGrabber* replay = new PCDReplayGrabber (PCDReplayGrabber::listPCDFiles (sensor.source),
+                                                         frames_per_second, repeat);
+        sensor.grabber.reset (replay);
+        // like the primary one, a benchmark reads the files up front
+        if (frames_per_second <= 0.0f && !replay->preload ())
+          return (false);
+      }
+      else if (boost::filesystem::is_regular_file (sensor.source))
+      {
+        RecordingGrabber* replay = new RecordingGrabber (frames_per_second, repeat);
+        sensor.grabber.reset (replay);
+        if (!replay->open (sensor.source))
+          return (false);
+      }
+      else
+        sensor.grabber.reset (new pcl::OpenNIGrabber (sensor.source));
+      // the end of a replay ends the tracking, instead of leaving it waiting
+      // for the sensor's next frame
+      if (ReplayGrabber* replay = dynamic_cast<ReplayGrabber*> (sensor.grabber.get ()))
+      {
+        boost::function<void ()> finished = boost::bind (&FrameQueue<AcquiredFrame>::close, &sensor.input_queue);
+        replay->registerCallback (finished);
+      }
+      boost::function<void (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr&)> f =
+        boost::bind (&OpenNISegmentTracking::sensor_cb, this, &sensor, _1);
+      sensor.grabber->registerCallback (f);
+    }
+    return (true);
+  }
+
+  void
+  run ()
+  {
+    // send the saved model to the trackers
+    if (!model_file_.empty () && !loadModel (model_file_))
+      return;
     
-    pcl::ModelCoefficients coefficients;
-    coefficients.values.push_back (search_origin.translation ()[0]);
-    coefficients.values.push_back (search_origin.translation ()[1]);
-    coefficients.values.push_back (search_origin.translation ()[2]);
-    coefficients.values.push_back (q.x ());
-    coefficients.values.push_back (q.y ());
-    coefficients.values.push_back (q.z ());
-    coefficients.values.push_back (q.w ());
+    pcl::Grabber* interface;
+    if (replay_files_.empty () && recording_file_.empty ())
+      interface = new pcl::OpenNIGrabber (device_id_);
+    else if (!(interface = createReplayGrabber (replay_fps_, replay_repeat_)))
+      return;
+    boost::function<void (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr&)> f =
+      boost::bind (&OpenNISegmentTracking::cloud_cb, this, _1);
+    interface->registerCallback (f);
+    if ((!pose_target_.empty () && !pose_sink_.open (pose_target_)) ||
+        (!record_file_.empty () && !recorder_.open (record_file_, record_compress_)) ||
+        !openSensors (replay_fps_, replay_repeat_))
+    {
+      delete interface;
+      return;
+    }
     
-    coefficients.values.push_back (1.0);
-    coefficients.values.push_back (1.0);
-    coefficients.values.push_back (1.0);
+    if (!headless_)
+    {
+      viewer_.reset (new pcl::visualization::CloudViewer ("PCL OpenNI Tracking Viewer"));
+      viewer_->runOnVisualizationThread (boost::bind(&OpenNISegmentTracking::viz_cb, this, _1), "viz_cb");
+    }
     
-    viz.removeShape ("searcharea");
-    viz.addCube (coefficients, "searcharea");
+    startPipeline (false);
+    interface->start ();
+      
+    // headless, until the replay ends or SIGINT / SIGTERM
+    while (headless_ ? !stop_requested && interface->isRunning () : !viewer_->wasStopped ())
+    {
+      boost::this_thread::sleep(boost::posix_time::seconds(1));
+      if (statistics_dump_requested)
+      {
+        statistics_dump_requested = 0;
+        dumpStatistics ();
+      }
+    }
+    interface->stop ();
+    stopPipeline ();
+    delete interface;
+    recorder_.close ();
+    closePoseSink ();
+    dumpStatistics ();
+  }
+
+  void
+  closePoseSink ()
+  {
+    if (!pose_sink_.isOpen ())
+      return;
+    pose_sink_.close ();
+    if (pose_sink_.getDroppedFrames () > 0)
+      PCL_WARN ("%d frames were not written to %s\n", static_cast<int> (pose_sink_.getDroppedFrames ()), pose_target_.c_str ());
+  }
+
+  // runs without a viewer; run () returns at the end of the replay or on
+  // SIGINT / SIGTERM
+  void
+  setHeadless (bool headless)
+  {
+    headless_ = headless;
+  }
+
+  // streams every frame's results to a file or a "unix:<path>" socket, see
+  // PoseSink; empty for none
+  void
+  setPoseOutput (const std::string &target)
+  {
+    pose_target_ = target;
+  }
+
+  // plays the replay source once, as fast as the pipeline accepts frames and
+  // without a viewer, then reports the throughput and the per-stage latency
+  void
+  benchmark ()
+  {
+    if (!model_file_.empty () && !loadModel (model_file_))
+      return;
+    boost::scoped_ptr<ReplayGrabber> replay (createReplayGrabber (0.0f, false));
+    if (!replay)
+      return;
+    // a recording is unpacked during the replay, PCD files are read before
+    if (recording_file_.empty ())
+    {
+      std::cout << "loading " << replay_files_.size () << " frames" << std::endl;
+      if (!static_cast<PCDReplayGrabber&> (*replay).preload ())
+        return;
+    }
+    if ((!pose_target_.empty () && !pose_sink_.open (pose_target_)) || !openSensors (0.0f, false))
+      return;
+    boost::function<void (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr&)> f =
+      boost::bind (&OpenNISegmentTracking::cloud_cb, this, _1);
+    replay->registerCallback (f);
+
+    StageRegistry::instance ().reset ();
+    const double start_time = pcl::getTime ();
+    startPipeline (true);
+    replay->start ();
+    replay->waitUntilFinished ();
+    stopPipeline ();
+    const double elapsed = pcl::getTime () - start_time;
+    closePoseSink ();
+
+    const size_t frames = replay->getFrameCount ();
+    std::cout << "frames: " << frames << ", elapsed: " << elapsed << " s, throughput: "
+              << frames / elapsed << " Hz, " << (pipelined_ ? "pipelined" : "sequential") << std::endl;
+    dumpStatistics ();
+  }
+
+  // initializes the tracker on the first replay frames and compares the
+  // per-particle and the batched particle weighting on the next one
+  void
+  benchmarkCoherence (int repetitions)
+  {
+    size_t i = 0;
+    RefCloudPtr tracking_cloud;
+    for (; i < replay_files_.size () && !tracking_cloud; i++)
+    {
+      AcquiredFrame acquired;
+      CloudPtr cloud (new Cloud);
+      if (pcl::io::loadPCDFile (replay_files_[i], *cloud) < 0)
+        return;
+      acquired.cloud = cloud;
+      acquired.acquired_us = monotonicMicroseconds ();
+      PreprocessedFramePtr frame = preprocess (acquired);
+      if (firstp_)
+        track (frame);
+      else
+        tracking_cloud = trackingInput (frame);
+    }
+    if (!tracking_cloud || tracking_cloud->points.empty ())
+    {
+      PCL_ERROR ("the replay frames did not initialize the tracker\n");
+      return;
+    }
+    std::cout << "weighting frame " << i - 1 << " " << repetitions << " times" << std::endl;
+    objects_[0]->tracker->setSharedTarget (CorrespondenceTarget::ConstPtr ());
+    objects_[0]->tracker->compareWeighting (tracking_cloud, repetitions, std::cout);
+  }
+
+  // times the kd-tree and the voxel clustering <repetitions> times on the
+  // tabletop objects of every replay frame and checks that they agree
+  void
+  benchmarkClustering (int repetitions)
+  {
+    double kdtree_time = 0.0, voxel_time = 0.0;
+    size_t frames = 0, mismatches = 0;
+    for (size_t i = 0; i < replay_files_.size (); i++)
+    {
+      AcquiredFrame acquired;
+      CloudPtr cloud (new Cloud);
+      if (pcl::io::loadPCDFile (replay_files_[i], *cloud) < 0)
+        return;
+      acquired.cloud = cloud;
+      acquired.acquired_us = monotonicMicroseconds ();
+      PreprocessedFramePtr frame = preprocess (acquired);
+      CloudPtr nonplane (new Cloud);
+      if (!extractTabletopObjects (frame->cloud_pass_downsampled, *nonplane))
+        continue;
+
+      std::vector<pcl::PointIndices> kdtree_clusters, voxel_clusters;
+      double start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        euclideanSegmentKdTree (nonplane, kdtree_clusters);
+      kdtree_time += pcl::getTime () - start;
+      start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        euclideanSegment (nonplane, voxel_clusters);
+      voxel_time += pcl::getTime () - start;
+
+      // compare the clusters as sets of sorted indices, in case of ties in size
+      std::vector<std::vector<int> > kdtree_sets, voxel_sets;
+      for (size_t k = 0; k < kdtree_clusters.size (); k++)
+      {
+        kdtree_sets.push_back (kdtree_clusters[k].indices);
+        std::sort (kdtree_sets.back ().begin (), kdtree_sets.back ().end ());
+      }
+      for (size_t k = 0; k < voxel_clusters.size (); k++)
+        voxel_sets.push_back (voxel_clusters[k].indices);
+      std::sort (kdtree_sets.begin (), kdtree_sets.end ());
+      std::sort (voxel_sets.begin (), voxel_sets.end ());
+      const bool same = kdtree_sets == voxel_sets;
+      std::cout << "frame " << i << ": " << nonplane->points.size () << " points, "
+                << kdtree_clusters.size () << " kd-tree / " << voxel_clusters.size () << " voxel clusters"
+                << (same ? "" : ", MISMATCH") << std::endl;
+      mismatches += same ? 0 : 1;
+      ++frames;
+    }
+    if (frames == 0)
+    {
+      PCL_ERROR ("no replay frame had a table plane\n");
+      return;
+    }
+    const double runs = static_cast<double> (frames * repetitions);
+    std::cout << "kd-tree: " << 1e3 * kdtree_time / runs << " ms, voxel: " << 1e3 * voxel_time / runs
+              << " ms per frame, " << mismatches << " of " << frames << " frames differ" << std::endl;
+  }
+
+  // times pcl::VoxelGrid and HashedVoxelGrid <repetitions> times on every
+  // replay frame after the pass-through and checks that every VoxelGrid
+  // centroid is in the same leaf of the hashed output, within 0.1 mm and one
+  // color level; with a temporal window the smoothed grid is timed too
+  void
+  benchmarkDownsampling (int repetitions)
+  {
+    pcl::VoxelGrid<PointType> voxel_grid;
+    const float leaf_size = static_cast<float> (parameters_.leaf_size);
+    voxel_grid.setLeafSize (leaf_size, leaf_size, leaf_size);
+    HashedVoxelGrid hashed_grid (parameters_.leaf_size);
+    const float inverse_leaf_size = 1.0f / leaf_size;
+    VoxelHashTable leaves;
+    leaves.reserve (640 * 480);
+    double voxel_grid_time = 0.0, hashed_time = 0.0, temporal_time = 0.0;
+    size_t frames = 0, points = 0, mismatches = 0;
+    for (size_t i = 0; i < replay_files_.size (); i++)
+    {
+      CloudPtr cloud (new Cloud), cloud_pass (new Cloud);
+      if (pcl::io::loadPCDFile (replay_files_[i], *cloud) < 0)
+        return;
+      filterPassThrough (cloud, *cloud_pass);
+
+      Cloud voxel_grid_result, hashed_result;
+      voxel_grid.setInputCloud (cloud_pass);
+      double start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        voxel_grid.filter (voxel_grid_result);
+      voxel_grid_time += pcl::getTime () - start;
+      start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        hashed_grid.filter (*cloud_pass, hashed_result);
+      hashed_time += pcl::getTime () - start;
+      if (grid_.getTemporalWindow () > 1)
+      {
+        Cloud temporal_result;
+        start = pcl::getTime ();
+        for (int r = 0; r < repetitions; r++)
+          grid_.filter (*cloud_pass, temporal_result);
+        temporal_time += pcl::getTime () - start;
+      }
+
+      leaves.clear ();
+      for (size_t p = 0; p < hashed_result.points.size (); p++)
+        leaves.findOrInsert (static_cast<int> (floorf (hashed_result.points[p].x * inverse_leaf_size)),
+                             static_cast<int> (floorf (hashed_result.points[p].y * inverse_leaf_size)),
+                             static_cast<int> (floorf (hashed_result.points[p].z * inverse_leaf_size)));
+      size_t differences = voxel_grid_result.points.size () == hashed_result.points.size () ? 0 : 1;
+      for (size_t p = 0; p < voxel_grid_result.points.size () && differences == 0; p++)
+      {
+        const PointType& expected = voxel_grid_result.points[p];
+        const int slot = leaves.find (static_cast<int> (floorf (expected.x * inverse_leaf_size)),
+                                      static_cast<int> (floorf (expected.y * inverse_leaf_size)),
+                                      static_cast<int> (floorf (expected.z * inverse_leaf_size)));
+        if (slot < 0 ||
+            (expected.getVector3fMap () - hashed_result.points[slot].getVector3fMap ()).norm () > 1e-4f ||
+            std::abs (static_cast<int> (expected.r) - hashed_result.points[slot].r) > 1 ||
+            std::abs (static_cast<int> (expected.g) - hashed_result.points[slot].g) > 1 ||
+            std::abs (static_cast<int> (expected.b) - hashed_result.points[slot].b) > 1)
+          ++differences;
+      }
+      std::cout << "frame " << i << ": " << cloud->width << "x" << cloud->height << ", "
+                << voxel_grid_result.points.size () << " VoxelGrid / " << hashed_result.points.size ()
+                << " hashed leaves" << (differences == 0 ? "" : ", MISMATCH") << std::endl;
+      mismatches += differences;
+      points += cloud->points.size ();
+      ++frames;
+    }
+    if (frames == 0)
+      return;
+    const double runs = static_cast<double> (frames * repetitions);
+    const double mega_points = static_cast<double> (points) * repetitions / 1e6;
+    std::cout << "VoxelGrid: " << 1e3 * voxel_grid_time / runs << " ms per frame, "
+              << mega_points / voxel_grid_time << " Mpoints/s" << std::endl
+              << "hashed: " << 1e3 * hashed_time / runs << " ms per frame, "
+              << mega_points / hashed_time << " Mpoints/s" << std::endl;
+    if (grid_.getTemporalWindow () > 1)
+      std::cout << "hashed over " << grid_.getTemporalWindow () << " frames: " << 1e3 * temporal_time / runs
+                << " ms per frame, " << mega_points / temporal_time << " Mpoints/s" << std::endl;
+    std::cout << mismatches << " of " << frames << " frames differ" << std::endl;
+  }
+
+  // builds a KdTreeFLANN, a pcl::search::Octree and a VoxelHashSearch
+  // <repetitions> times over the downsampled cloud of every replay frame and
+  // times the nearest neighbor of every point moved by up to a leaf, as a
+  // particle moves the reference, through each. the hash answers within the
+  // search radius, 2 leaves by default, and must agree with the kd-tree there.
+  void
+  benchmarkSearch (int repetitions)
+  {
+    const float leaf_size = static_cast<float> (parameters_.leaf_size);
+    const float radius = search_radius_ > 0.0f ? search_radius_ : 2.0f * leaf_size;
+    pcl::KdTreeFLANN<PointType> kdtree;
+    pcl::search::Octree<PointType> octree (leaf_size);
+    VoxelHashSearch<PointType> hash (radius);
+    double build_time[3] = { 0.0, 0.0, 0.0 }, query_time[3] = { 0.0, 0.0, 0.0 }, batched_time = 0.0;
+    size_t frames = 0, points = 0, mismatches = 0;
+    std::vector<int> k_indices (1);
+    std::vector<float> k_distances (1);
+    for (size_t i = 0; i < replay_files_.size (); i++)
+    {
+      CloudPtr cloud (new Cloud), cloud_pass (new Cloud), cloud_downsampled (new Cloud);
+      if (pcl::io::loadPCDFile (replay_files_[i], *cloud) < 0)
+        return;
+      filterPassThrough (cloud, *cloud_pass);
+      gridSample (cloud_pass, *cloud_downsampled);
+      const size_t size = cloud_downsampled->points.size ();
+      if (size == 0)
+        continue;
+      // deterministic offsets in [-leaf, leaf)
+      std::vector<float> x (size), y (size), z (size);
+      uint32_t state = 1;
+      for (size_t p = 0; p < size; p++)
+      {
+        const PointType& point = cloud_downsampled->points[p];
+        float offset[3];
+        for (int k = 0; k < 3; k++)
+        {
+          state = state * 1664525u + 1013904223u;
+          offset[k] = leaf_size * (static_cast<float> (state >> 8) / 8388608.0f - 1.0f);
+        }
+        x[p] = point.x + offset[0];
+        y[p] = point.y + offset[1];
+        z[p] = point.z + offset[2];
+      }
+
+      double start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        kdtree.setInputCloud (cloud_downsampled);
+      build_time[0] += pcl::getTime () - start;
+      start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        octree.setInputCloud (cloud_downsampled);
+      build_time[1] += pcl::getTime () - start;
+      start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        hash.setInputCloud (cloud_downsampled);
+      build_time[2] += pcl::getTime () - start;
+
+      std::vector<int> nearest[3];
+      std::vector<float> distances (size);
+      pcl::search::Search<PointType>* searches[3] = { 0, &octree, &hash };
+      PointType query;
+      for (int s = 0; s < 3; s++)
+      {
+        nearest[s].resize (size);
+        start = pcl::getTime ();
+        for (int r = 0; r < repetitions; r++)
+          for (size_t p = 0; p < size; p++)
+          {
+            query.x = x[p];
+            query.y = y[p];
+            query.z = z[p];
+            const int found = s == 0 ? kdtree.nearestKSearch (query, 1, k_indices, k_distances)
+                                     : searches[s]->nearestKSearch (query, 1, k_indices, k_distances);
+            nearest[s][p] = found > 0 ? k_indices[0] : -1;
+            if (s == 0)
+              distances[p] = found > 0 ? k_distances[0] : std::numeric_limits<float>::max ();
+          }
+        query_time[s] += pcl::getTime () - start;
+      }
+      std::vector<int> batched (size);
+      start = pcl::getTime ();
+      for (int r = 0; r < repetitions; r++)
+        hash.findNearest (&x[0], &y[0], &z[0], size, &batched[0]);
+      batched_time += pcl::getTime () - start;
+
+      // the same distance for ties, and no neighbor beyond the radius
+      size_t differences = 0;
+      for (size_t p = 0; p < size; p++)
+      {
+        const bool within = distances[p] <= radius * radius;
+        const PointType& expected = cloud_downsampled->points[std::max (nearest[0][p], 0)];
+        for (int s = 1; s < 4; s++)
+        {
+          const int index = s < 3 ? nearest[s][p] : batched[p];
+          if (s == 1 ? index < 0 : within != (index >= 0))
+          {
+            ++differences;
+            break;
+          }
+          if (index < 0)
+            continue;
+          const PointType& found = cloud_downsampled->points[index];
+          const float query_distance = (found.getVector3fMap () - Eigen::Vector3f (x[p], y[p], z[p])).squaredNorm ();
+          const float expected_distance = (expected.getVector3fMap () - Eigen::Vector3f (x[p], y[p], z[p])).squaredNorm ();
+          if (query_distance > expected_distance + 1e-9f)
+          {
+            ++differences;
+            break;
+          }
+        }
+      }
+      std::cout << "frame " << i << ": " << size << " points" << (differences == 0 ? "" : ", MISMATCH") << std::endl;
+      mismatches += differences == 0 ? 0 : 1;
+      points += size;
+      ++frames;
+    }
+    if (frames == 0)
+      return;
+    const double runs = static_cast<double> (frames * repetitions);
+    const double queries = static_cast<double> (points) * repetitions;
+    const char* names[3] = { "KdTreeFLANN", "search::Octree", "VoxelHashSearch" };
+    std::cout << "mean points: " << points / frames << ", hash radius: " << radius << " m" << std::endl;
+    for (int s = 0; s < 3; s++)
+      std::cout << names[s] << ": build " << 1e3 * build_time[s] / runs << " ms, nearest "
+                << 1e9 * query_time[s] / queries << " ns per query" << std::endl;
+    std::cout << "VoxelHashSearch batched: nearest " << 1e9 * batched_time / queries << " ns per query" << std::endl
+              << mismatches << " of " << frames << " frames differ" << std::endl;
+  }
+
+  // prints the stage summary and writes it to the statistics file, if any
+  void
+  dumpStatistics ()
+  {
+    StageRegistry::instance ().print (std::cout);
+    if (!statistics_file_.empty () && StageRegistry::instance ().exportFile (statistics_file_))
+      std::cout << "wrote " << statistics_file_ << std::endl;
+  }
+
+  void
+  setStatisticsFile (const std::string& path)
+  {
+    statistics_file_ = path;
+  }
+  
+  TrackingParameters parameters_;
+  pcl::PassThrough<PointType> pass_;
+  HashedVoxelGrid grid_;
+  pcl::SACSegmentation<PointType> seg_;
+  pcl::ExtractIndices<PointType> extract_positive_;
+  
+  boost::shared_ptr<pcl::visualization::CloudViewer> viewer_;
+  bool headless_;
+  std::string pose_target_;
+  PoseSink pose_sink_;
+  CloudPtr plane_cloud_;
+  CloudPtr nonplane_cloud_;
+  CloudPtr cloud_hull_;
+  CloudPtr segmented_cloud_;
+  
+  std::vector<pcl::Vertices> hull_vertices_;
+  Eigen::Matrix4f plane_trans_;
+  TablePlaneTracker table_;
+  bool table_removal_;
+  FrameStore<RefPointType> table_store_;
+  bool reacquisition_;
+  RefCloud reacquisition_cloud_;
+  
+  std::string device_id_;
+  std::vector<std::string> replay_files_;
+  float replay_fps_;
+  bool replay_repeat_;
+  std::string recording_file_;
+  std::string record_file_;
+  bool record_compress_;
+  RecordingWriter recorder_;
+  std::string statistics_file_;
+  std::string model_file_;
+  std::string save_model_file_;
+  boost::mutex mtx_;
+  int sensor_view, reference_view;
+  // frames for the viewer, and the result clouds it draws
+  TripleBuffer<VizSnapshot> snapshots_;
+  std::vector<RefCloudPtr> result_clouds_;
+  typename pcl::KdTreeFLANN<PointType>::Ptr normal_tree_;
+  VoxelClusterExtraction cluster_extraction_;
+  // tracked objects and the settings of their trackers
+  std::vector<TrackedObjectPtr> objects_;
+  bool projective_;
+  bool batched_weighting_;
+  bool compact_target_;
+  float search_radius_;
+  bool adaptive_particles_;
+  double tracking_budget_;
+  bool multi_resolution_;
+  typename ParticleFilter::MotionModel motion_model_;
+  // projective index of the shared correspondence target
+  boost::shared_ptr<ProjectiveCloudCoherence<RefPointType> > projective_index_;
+  // workers of the trackers and their weighting
+  boost::shared_ptr<WorkStealingPool> pool_;
+  boost::atomic<bool> firstp_;
+
+  OrganizedPreprocessor preprocessor_;
+  bool fused_preprocessing_;
+  // recycled clouds of the preprocessing (pass, downsampled, normal) and the
+  // tracking (tracking) stage
+  FrameStore<PointType> pass_store_;
+  FrameStore<PointType> downsampled_store_;
+  FrameStore<pcl::Normal> normal_store_;
+  FrameStore<RefPointType> tracking_store_;
+
+  // regions of interest of objects_, written by the tracking stage and read
+  // by the preprocessing stage
+  bool use_roi_;
+  boost::mutex roi_mtx_;
+  FrameStore<PointType> roi_store_;
+  static const float LOSS_SCORE;
+  static const float WEAK_SCORE;
+  static const double COLLAPSED_SAMPLE_FRACTION;
+  static const int LOSS_FRAMES = 3;
+  static const float MAX_DESCRIPTOR_DISTANCE;
+  static const size_t MAX_REACQUISITION_CANDIDATES = 16;
+  static const float MAX_ROI_SCALE;
+  static const float ROI_MARGIN;
+  static const float MAX_ROI_HALF_EXTENT;
+
+  bool pipelined_;
+  FrameQueue<AcquiredFrame> input_queue_;
+  FrameQueue<PreprocessedFramePtr> preprocessed_queue_;
+  boost::thread preprocess_thread_;
+  boost::thread tracking_thread_;
+  // merged clouds of all sensors
+  FrameStore<PointType> merged_store_;
+  FrameStore<RefPointType> merged_tracking_store_;
+  // the grabbers of the additional sensors call into this; they go first
+  std::vector<SensorPtr> sensors_;
+};
+
+template <typename PointType> const float OpenNISegmentTracking<PointType>::LOSS_SCORE = 0.2f;
+template <typename PointType> const float OpenNISegmentTracking<PointType>::WEAK_SCORE = 0.4f;
+template <typename PointType> const double OpenNISegmentTracking<PointType>::COLLAPSED_SAMPLE_FRACTION = 0.02;
+template <typename PointType> const float OpenNISegmentTracking<PointType>::MAX_DESCRIPTOR_DISTANCE = 0.25f;
+template <typename PointType> const float OpenNISegmentTracking<PointType>::MAX_ROI_SCALE = 8.0f;
+template <typename PointType> const float OpenNISegmentTracking<PointType>::ROI_MARGIN = 0.05f;
+template <typename PointType> const float OpenNISegmentTracking<PointType>::MAX_ROI_HALF_EXTENT = 2.0f;
+
+// Runs the -bench replay once for every configuration of a parameter grid,
+// up to jobs at a time. Each runs in a forked process, so that its stage
+// statistics, its worker pool and a crash stay with it, and leaves
+// config_<i>.poses, config_<i>.csv (the stage statistics) and config_<i>.log
+// in the output directory. report () summarizes them in sweep.csv and marks
+// the configurations no other one beats in throughput, end-to-end latency and,
+// against a reference trajectory, tracking error and coverage.
+class ParameterSweep
+{
+public:
+  ParameterSweep (const std::vector<TrackingParameters> &grid, const std::string &directory, int jobs)
+  : grid_ (grid)
+  , directory_ (directory)
+  , jobs_ (static_cast<size_t> (std::max (1, jobs)))
+  , succeeded_ (grid.size (), false)
+  {
+  }
+
+  // returns the index of its configuration in a child, which then runs it
+  // and exits, and -1 in the parent once all children have exited
+  int
+  run ()
+  {
+    boost::system::error_code error;
+    boost::filesystem::create_directories (directory_, error);
+    if (!boost::filesystem::is_directory (directory_))
+    {
+      PCL_ERROR ("failed to create %s\n", directory_.c_str ());
+      return (-1);
+    }
+    std::map<pid_t, size_t> children;
+    size_t next = 0;
+    while (next < grid_.size () || !children.empty ())
+    {
+      if (next < grid_.size () && children.size () < jobs_)
+      {
+        const size_t config = next++;
+        // PoseSink appends to an existing file
+        ::unlink (getPath (config, ".poses").c_str ());
+        ::unlink (getPath (config, ".csv").c_str ());
+        std::cout << "config " << config << ": " << grid_[config].describe () << std::endl;
+        const pid_t pid = ::fork ();
+        if (pid == 0)
+        {
+          const int fd = ::open (getPath (config, ".log").c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if (fd >= 0)
+          {
+            ::dup2 (fd, STDOUT_FILENO);
+            ::dup2 (fd, STDERR_FILENO);
+            ::close (fd);
+          }
+          return (static_cast<int> (config));
+        }
+        if (pid < 0)
+          PCL_ERROR ("failed to start config %d: %s\n", static_cast<int> (config), std::strerror (errno));
+        else
+          children[pid] = config;
+        continue;
+      }
+      int status;
+      const pid_t pid = ::waitpid (-1, &status, 0);
+      if (pid < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      const std::map<pid_t, size_t>::iterator child = children.find (pid);
+      if (child == children.end ())
+        continue;
+      succeeded_[child->second] = WIFEXITED (status) && WEXITSTATUS (status) == 0;
+      std::cout << "config " << child->second << (succeeded_[child->second] ? " finished" : " failed, see its log")
+                << std::endl;
+      children.erase (child);
+    }
+    return (-1);
   }
 
-  void drawLine (pcl::visualization::PCLVisualizer& viz, const pcl::PointXYZ& from, const pcl::PointXYZ& to, const std::string& name)
+  std::string
+  getPath (size_t config, const std::string &extension) const
   {
-    viz.removeShape (name);
-    viz.addLine<pcl::PointXYZ> (from, to, name);
+    return (directory_ + "/config_" + boost::lexical_cast<std::string> (config) + extension);
   }
-  
+
+  // prints the summary and writes it to sweep.csv; the tracking error only
+  // with a reference trajectory
   bool
-  drawParticles (pcl::visualization::PCLVisualizer& viz)
+  report (const std::string &reference_file)
   {
-    ParticleFilter::PointCloudStatePtr particles = tracker_->getParticles ();
-    if (particles)
+    PoseTrajectory reference;
+    const bool with_reference = !reference_file.empty ();
+    if (with_reference && !reference.load (reference_file))
+      return (false);
+    std::vector<Result> results (grid_.size ());
+    for (size_t i = 0; i < grid_.size (); i++)
     {
-      pcl::PointCloud<pcl::PointXYZ>::Ptr particle_cloud (new pcl::PointCloud<pcl::PointXYZ> ());
-      for (size_t i = 0; i < particles->points.size (); i++)
-      {
-        pcl::PointXYZ point;
-        
-        ParticleXYZRPY particle = particles->points[i];
-        point.x = particles->points[i].x;
-        point.y = particles->points[i].y;
-        point.z = particles->points[i].z;
-        particle_cloud->points.push_back (point);
-      }
-      
+      Result& result = results[i];
+      PoseTrajectory trajectory;
+      if (!succeeded_[i] || !trajectory.load (getPath (i, ".poses")) ||
+          !readStage (getPath (i, ".csv"), "latency.endToEnd", result.end_to_end) ||
+          !readStage (getPath (i, ".csv"), "track", result.track))
+        continue;
+      result.frames = trajectory.getFrames ().size ();
+      result.throughput = trajectory.getFrameRate ();
+      if (with_reference)
       {
-        pcl::visualization::PointCloudColorHandlerCustom<pcl::PointXYZ> blue_color (particle_cloud, 0, 0, 255);
-        if (!viz.updatePointCloud (particle_cloud, blue_color, "particle cloud"))
-          viz.addPointCloud (particle_cloud, blue_color, "particle cloud");
+        result.error = reference.compare (trajectory);
+        if (result.error.object_frames > 0)
+          result.coverage = static_cast<double> (result.error.tracked) / static_cast<double> (result.error.object_frames);
       }
-      return true;
+      result.valid = result.frames > 0;
     }
-    else
+    for (size_t i = 0; i < results.size (); i++)
     {
-      PCL_WARN ("no particles\n");
-      return false;
+      results[i].pareto = results[i].valid;
+      for (size_t j = 0; j < results.size () && results[i].pareto; j++)
+        if (j != i && results[j].valid && dominates (results[j], results[i], with_reference))
+          results[i].pareto = false;
     }
-  }
-  
-  void
-  drawResult (pcl::visualization::PCLVisualizer& viz)
-  {
-    ParticleXYZRPY result = tracker_->getResult ();
-    std::cout << "result: " << result.weight << std::endl; //debug
-    Eigen::Affine3f transformation = tracker_->toEigenMatrix (result);
-    pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr result_cloud (new pcl::PointCloud<pcl::PointXYZRGBNormal> ());
-    
-    pcl::transformPointCloud<pcl::PointXYZRGBNormal> (*(tracker_->getReferenceCloud ()), *result_cloud,
-                                                      transformation);
-    
+
+    const std::string path = directory_ + "/sweep.csv";
+    std::ofstream ofs (path.c_str ());
+    if (!ofs)
     {
-      pcl::visualization::PointCloudColorHandlerCustom<pcl::PointXYZRGBNormal> red_color (result_cloud, 255, 0, 0);
-      if (!viz.updatePointCloud (result_cloud, red_color, "resultcloud"))
-        viz.addPointCloud (result_cloud, red_color, "resultcloud");
+      PCL_ERROR ("failed to open %s\n", path.c_str ());
+      return (false);
+    }
+    ofs << "config";
+    for (int k = 0; k < TrackingParameters::PARAMETER_NUM; k++)
+      ofs << "," << TrackingParameters::NAMES[k];
+    ofs << ",frames,throughput_hz,end_to_end_p50_us,end_to_end_p95_us,end_to_end_p99_us,"
+        << "track_p50_us,track_p95_us,track_p99_us,translation_rms_m,translation_max_m,rotation_mean_deg,"
+        << "coverage,pareto\n";
+    std::cout << "config   frames    fps   e2e p50/p95/p99 ms   track p95 ms";
+    if (with_reference)
+      std::cout << "   rms mm   rot deg  coverage";
+    std::cout << std::endl;
+    for (size_t i = 0; i < results.size (); i++)
+    {
+      const Result& r = results[i];
+      char line[256];
+      ofs << i;
+      for (int k = 0; k < TrackingParameters::PARAMETER_NUM; k++)
+        ofs << "," << grid_[i].get (k);
+      if (!r.valid)
+      {
+        ofs << ",0,,,,,,,,,,,,0\n";
+        snprintf (line, sizeof (line), "%6d   failed", static_cast<int> (i));
+        std::cout << line << std::endl;
+        continue;
+      }
+      ofs << "," << r.frames << "," << r.throughput << "," << r.end_to_end.p50 << "," << r.end_to_end.p95 << ","
+          << r.end_to_end.p99 << "," << r.track.p50 << "," << r.track.p95 << "," << r.track.p99 << ",";
+      if (with_reference)
+        ofs << r.error.rms_translation << "," << r.error.max_translation << ","
+            << r.error.mean_rotation * 180.0 / M_PI << "," << r.coverage;
+      else
+        ofs << ",,,";
+      ofs << "," << (r.pareto ? 1 : 0) << "\n";
+      snprintf (line, sizeof (line), "%6d %8d %6.1f   %5.1f/%5.1f/%5.1f   %12.1f", static_cast<int> (i),
+                static_cast<int> (r.frames), r.throughput, 1e-3 * r.end_to_end.p50, 1e-3 * r.end_to_end.p95,
+                1e-3 * r.end_to_end.p99, 1e-3 * r.track.p95);
+      std::cout << line;
+      if (with_reference)
+      {
+        snprintf (line, sizeof (line), " %8.1f %9.2f %8.1f%%", 1e3 * r.error.rms_translation,
+                  r.error.mean_rotation * 180.0 / M_PI, 1e2 * r.coverage);
+        std::cout << line;
+      }
+      std::cout << (r.pareto ? "  *" : "") << std::endl;
     }
+    std::cout << "* Pareto-optimal, wrote " << path << std::endl;
+    return (true);
   }
 
-  void
-  viz_cb (pcl::visualization::PCLVisualizer& viz)
+protected:
+  struct Result
   {
-    boost::mutex::scoped_lock lock (mtx_);
-    viz.setBackgroundColor (0.8, 0.8, 0.8);
-    if (!cloud_pass_downsampled_)
+    Result ()
+    : valid (false)
+    , frames (0)
+    , throughput (0.0)
+    , error (PoseTrajectory::Error ())
+    , coverage (0.0)
+    , pareto (false)
     {
-      boost::this_thread::sleep (boost::posix_time::seconds (1));
-      return;
     }
 
-    if (!viz.updatePointCloud (cloud_pass_downsampled_, "cloudpass"))
+    bool valid;
+    size_t frames;
+    double throughput;
+    StageRegistry::Summary end_to_end, track;
+    PoseTrajectory::Error error;
+    double coverage;
+    bool pareto;
+  };
+
+  // true if a is at least as good as b in every measure and better in one
+  static bool
+  dominates (const Result &a, const Result &b, bool with_reference)
+  {
+    bool better = a.throughput > b.throughput || a.end_to_end.p95 < b.end_to_end.p95;
+    if (a.throughput < b.throughput || a.end_to_end.p95 > b.end_to_end.p95)
+      return (false);
+    if (with_reference)
     {
-      viz.addPointCloud (cloud_pass_downsampled_, "cloudpass");
-      viz.resetCameraViewpoint ("cloudpass");
+      if (a.error.rms_translation > b.error.rms_translation || a.coverage < b.coverage)
+        return (false);
+      better = better || a.error.rms_translation < b.error.rms_translation || a.coverage > b.coverage;
     }
-      
-    if (new_cloud_)
+    return (better);
+  }
+
+  // reads the summary of stage from a CSV written by StageRegistry::exportFile
+  static bool
+  readStage (const std::string &path, const std::string &stage, StageRegistry::Summary &summary)
+  {
+    std::ifstream ifs (path.c_str ());
+    std::string line;
+    while (std::getline (ifs, line))
     {
-      bool ret = drawParticles (viz);
-      if (ret)
-        drawResult (viz);
+      std::istringstream fields (line);
+      std::string name, unit;
+      char comma;
+      if (std::getline (fields, name, ',') && name == stage && std::getline (fields, unit, ',') &&
+          fields >> summary.count >> comma >> summary.mean >> comma >> summary.p50 >> comma >> summary.p95
+                 >> comma >> summary.p99 >> comma >> summary.max)
+      {
+        summary.name = name;
+        summary.unit = unit;
+        return (true);
+      }
     }
-    new_cloud_ = false;
+    PCL_ERROR ("no %s statistics in %s\n", stage.c_str (), path.c_str ());
+    return (false);
   }
 
-  void filterPassThrough (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud, Cloud &result)
+  std::vector<TrackingParameters> grid_;
+  std::string directory_;
+  size_t jobs_;
+  std::vector<bool> succeeded_;
+};
+
+// the command line switches shared by every tracking run, applied by configure
+struct TrackingOptions
+{
+  TrackingOptions ()
+    : sequential (false), unfused (false), roi (false), projective (false), unbatched (false)
+    , compact (false), fixed_particles (false), keep_table (false), pyramid (false), no_reacquire (false)
+    , headless (false), record_raw (false), search_radius (0.0f), temporal_window (1)
+    , motion_model (BatchedParticleFilterTracker::CONSTANT_VELOCITY), tracking_budget (0.0)
   {
-    FPS_CALC_BEGIN;
-    pass_.setInputCloud (cloud);
-    pass_.filter (result);
-    FPS_CALC_END("filterPassThrough");
   }
 
-  void euclideanSegment (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
-                         std::vector<pcl::PointIndices> &cluster_indices)
+  bool sequential, unfused, roi, projective, unbatched, compact;
+  bool fixed_particles, keep_table, pyramid, no_reacquire, headless, record_raw;
+  float search_radius;
+  int temporal_window;
+  BatchedParticleFilterTracker::MotionModel motion_model;
+  double tracking_budget;
+  std::string model_file, save_model_file, pose_target, record_file, statistics_file;
+  std::vector<std::string> sensor_sources;
+  std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > sensor_extrinsics;
+};
+
+template <typename PointType> void
+configure (OpenNISegmentTracking<PointType> &v, const TrackingOptions &options)
+{
+  v.setPipelined (!options.sequential);
+  v.setFusedPreprocessing (!options.unfused);
+  v.setRegionOfInterestGating (options.roi);
+  v.setProjectiveCoherence (options.projective);
+  v.setBatchedWeighting (!options.unbatched);
+  v.setCompactTarget (options.compact);
+  v.setSearchRadius (options.search_radius);
+  v.setAdaptiveParticles (!options.fixed_particles);
+  v.setTrackingBudget (options.tracking_budget);
+  v.setTemporalSmoothing (options.temporal_window);
+  v.setMotionModel (options.motion_model);
+  v.setTableRemoval (!options.keep_table);
+  v.setMultiResolution (options.pyramid);
+  v.setReacquisition (!options.no_reacquire);
+  v.setModelFiles (options.model_file, options.save_model_file);
+  v.setHeadless (options.headless);
+  v.setPoseOutput (options.pose_target);
+  v.setRecordingOutput (options.record_file, !options.record_raw);
+  v.setSensors (options.sensor_sources, options.sensor_extrinsics);
+  v.setStatisticsFile (options.statistics_file);
+}
+
+void
+usage (char** argv)
+{
+  std::cout << "usage: " << argv[0] << " [<device_id>] [<pcd_file> ...] <options>\n\n"
+            << "  -pcd_dir <dir>  replay the PCD frames of <dir> instead of an OpenNI device\n"
+            << "  -fps <hz>       replay rate, 0 plays as fast as possible (default: 30)\n"
+            << "  -loop           repeat the replay until the viewer is closed\n"
+            << "  -bench          play the replay frames once without a viewer and\n"
+            << "                  report throughput and per-stage latency\n"
+            << "  -sequential     process each frame completely inside the grabber callback\n"
+            << "                  instead of on the preprocessing and tracking threads\n"
+            << "  -unfused        use the separate pass-through, voxel grid and normal estimation\n"
+            << "                  also for organized frames\n"
+            << "  -temporal <n>   average the voxel centroids of the separate voxel grid over\n"
+            << "                  the last <n> frames (default: 1)\n"
+            << "  -roi            after the initialization only preprocess and track the\n"
+            << "                  box around the last result, growing it while the object is lost\n"
+            << "  -projective     associate reference and input points by projecting them\n"
+            << "                  into the sensor image instead of through a kd-tree\n"
+            << "  -unbatched      weight the particles one at a time through the point coherences\n"
+            << "  -compact        quantize the frame's attributes into 16 byte records for the batched weighting\n"
+            << "  -voxel_search <radius>\n"
+            << "                  pair reference and input points within <radius> through a voxel\n"
+            << "                  hash instead of the nearest one at any distance through a kd-tree\n"
+            << "  -bench_coherence <n>\n"
+            << "                  initialize on the replay frames, then time the per-particle\n"
+            << "                  and the batched weighting <n> times on the next frame\n"
+            << "  -bench_clustering <n>\n"
+            << "                  time the kd-tree and the voxel clustering <n> times on the\n"
+            << "                  tabletop objects of every replay frame and compare them\n"
+            << "  -bench_downsample <n>\n"
+            << "                  time pcl::VoxelGrid and the hashed voxel grid <n> times on\n"
+            << "                  every replay frame and compare their leaves\n"
+            << "  -bench_search <n>\n"
+            << "                  time building and querying a kd-tree, an octree and the voxel\n"
+            << "                  hash search <n> times on every downsampled replay frame\n"
+            << "  -fixed_particles\n"
+            << "                  track with 200 particles (400 without a motion model) instead\n"
+            << "                  of choosing 50 to 400 (100 to 800) by KLD-sampling every frame\n"
+            << "  -motion <none|velocity|acceleration>\n"
+            << "                  predict the objects at constant velocity or acceleration and fit\n"
+            << "                  the step noise to the prediction error (default: velocity)\n"
+            << "  -budget <ms>    keep the tracking stage within <ms> by trading particles\n"
+            << "                  against iterations (default: off)\n"
+            << "  -keep_table     track against the table points too instead of following the\n"
+            << "                  table plane and dropping them every frame\n"
+            << "  -pyramid        score all particles on the reference thinned to 4 cm voxels\n"
+            << "                  and only the best quarter on 2 cm and then full resolution\n"
+            << "                  (with -bench_coherence: compare it to the per-particle weights)\n"
+            << "  -no_reacquire   keep tracking an object whose match collapsed instead of\n"
+            << "                  searching the clusters on the table for it\n"
+            << "  -threads <n>    workers of the pool that runs the normals, the clustering and\n"
+            << "                  the particle weighting (default: one less than the cores)\n"
+            << "  -params \"<name>=<value> ...\"\n"
+            << "                  override the pipeline parameters leaf, min_depth, max_depth,\n"
+            << "                  plane_iterations, plane_threshold, normal_radius, particles,\n"
+            << "                  distance_weight, color_weight, normal_weight and threads\n"
+            << "  -sweep \"<name>=<value>,<value>... ...\"\n"
+            << "                  run -bench for every combination of the values, several at a\n"
+            << "                  time in separate processes, and compare their throughput,\n"
+            << "                  latency and tracking error in <dir>/sweep.csv (threads\n"
+            << "                  defaults to 2 in a sweep)\n"
+            << "  -sweep_dir <dir>\n"
+            << "                  output directory of -sweep (default: sweep)\n"
+            << "  -jobs <n>       configurations of -sweep run at a time (default: the cores\n"
+            << "                  divided by the threads of a configuration plus 2); use 1 for\n"
+            << "                  latencies free of interference\n"
+            << "  -reference <file>\n"
+            << "                  poses (see -poses) to measure the -sweep configurations against,\n"
+            << "                  e.g. those of a -bench run with many particles\n"
+            << "  -pin            pin the workers to CPUs, filling one NUMA node after the other\n"
+            << "  -model <file>   start tracking from the objects and table saved in <file>\n"
+            << "                  instead of segmenting the first frame\n"
+            << "  -save_model <file>\n"
+            << "                  save the objects and table of the online initialization\n"
+            << "  -replay <file>  replay a recording instead of an OpenNI device (with -fps 0\n"
+            << "                  as fast as the pipeline takes the frames)\n"
+            << "  -record <file>  record every frame the device or the replay delivers to <file>\n"
+            << "  -record_raw     record the depth uncompressed\n"
+            << "  -sensor <source> <extrinsics>\n"
+            << "                  also track with the points of another sensor, an OpenNI device\n"
+            << "                  id, a PCD directory or a recording, preprocessed on its own\n"
+            << "                  thread; <extrinsics> holds the row-major 4x4 (or 3x4) transform\n"
+            << "                  from its coordinates into those of the first sensor. repeat for\n"
+            << "                  more sensors\n"
+            << "  -headless       run without a viewer until the replay ends or SIGINT / SIGTERM\n"
+            << "  -poses <file|unix:path>\n"
+            << "                  append every frame's poses, match scores, particle spreads and\n"
+            << "                  latencies as binary records to <file>, or send them as\n"
+            << "                  datagrams to the local socket bound at <path>\n"
+            << "  -stats <file>   write the per-stage latency percentiles to <file> (CSV, or\n"
+            << "                  JSON for a .json file) at exit and on SIGUSR1\n";
+}
+
+int
+main (int argc, char** argv)
+{
+  if (pcl::console::find_switch (argc, argv, "-h"))
   {
-    pcl::EuclideanClusterExtraction<pcl::PointXYZRGB> ec;
-    pcl::KdTree<pcl::PointXYZRGB>::Ptr tree (new pcl::KdTreeFLANN<pcl::PointXYZRGB>);
-    
-    ec.setClusterTolerance (0.05); // 2cm
-    ec.setMinClusterSize (100);
-    ec.setMaxClusterSize (25000);
-    ec.setSearchMethod (tree);
-    ec.setInputCloud (cloud);
-    ec.extract (cluster_indices);
+    usage (argv);
+    return (0);
+  }
+
+  std::string device_id = "";
+  if (argc > 1 && argv[1][0] != '-')
+    device_id = std::string (argv[1]);
 
+  std::vector<std::string> pcd_files;
+  std::string pcd_dir;
+  if (pcl::console::parse_argument (argc, argv, "-pcd_dir", pcd_dir) > 0)
+    pcd_files = PCDReplayGrabber::listPCDFiles (pcd_dir);
+  std::vector<int> pcd_arguments = pcl::console::parse_file_extension_argument (argc, argv, ".pcd");
+  for (size_t i = 0; i < pcd_arguments.size (); i++)
+    pcd_files.push_back (argv[pcd_arguments[i]]);
+  float fps = 30.0f;
+  pcl::console::parse_argument (argc, argv, "-fps", fps);
+  const bool loop = pcl::console::find_switch (argc, argv, "-loop");
+  TrackingOptions options;
+  options.sequential = pcl::console::find_switch (argc, argv, "-sequential");
+  options.unfused = pcl::console::find_switch (argc, argv, "-unfused");
+  options.roi = pcl::console::find_switch (argc, argv, "-roi");
+  options.projective = pcl::console::find_switch (argc, argv, "-projective");
+  options.unbatched = pcl::console::find_switch (argc, argv, "-unbatched");
+  options.compact = pcl::console::find_switch (argc, argv, "-compact");
+  options.fixed_particles = pcl::console::find_switch (argc, argv, "-fixed_particles");
+  options.keep_table = pcl::console::find_switch (argc, argv, "-keep_table");
+  options.pyramid = pcl::console::find_switch (argc, argv, "-pyramid");
+  options.no_reacquire = pcl::console::find_switch (argc, argv, "-no_reacquire");
+  TrackingParameters parameters;
+  std::string parameter_spec;
+  if (pcl::console::parse_argument (argc, argv, "-params", parameter_spec) > 0)
+  {
+    std::vector<TrackingParameters> grid;
+    if (!parameters.expand (parameter_spec, grid) || grid.size () != 1)
+    {
+      PCL_ERROR ("-params takes one value per parameter\n");
+      usage (argv);
+      return (1);
+    }
+    parameters = grid[0];
   }
-  
-  void gridSample (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud, Cloud &result)
+  int threads = parameters.threads;
+  pcl::console::parse_argument (argc, argv, "-threads", threads);
+  parameters.threads = std::max (0, threads);
+  pcl::console::parse_argument (argc, argv, "-temporal", options.temporal_window);
+  pcl::console::parse_argument (argc, argv, "-voxel_search", options.search_radius);
+  std::string motion = "velocity";
+  pcl::console::parse_argument (argc, argv, "-motion", motion);
+  if (motion == "none")
+    options.motion_model = BatchedParticleFilterTracker::MOTION_NONE;
+  else if (motion == "acceleration")
+    options.motion_model = BatchedParticleFilterTracker::CONSTANT_ACCELERATION;
+  else if (motion != "velocity")
   {
-    FPS_CALC_BEGIN;
-    grid_.setInputCloud (cloud);
-    grid_.filter (result);
-    FPS_CALC_END("gridSample");
+    PCL_ERROR ("unknown motion model %s\n", motion.c_str ());
+    usage (argv);
+    return (1);
   }
-  
-  
-  void planeSegmentation (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
-                          pcl::ModelCoefficients &coefficients,
-                          pcl::PointIndices &inliers)
+  bool pin = pcl::console::find_switch (argc, argv, "-pin");
+  pcl::console::parse_argument (argc, argv, "-model", options.model_file);
+  pcl::console::parse_argument (argc, argv, "-save_model", options.save_model_file);
+  pcl::console::parse_argument (argc, argv, "-budget", options.tracking_budget);
+  pcl::console::parse_argument (argc, argv, "-stats", options.statistics_file);
+  signal (SIGUSR1, requestStatisticsDump);
+  options.headless = pcl::console::find_switch (argc, argv, "-headless");
+  if (options.headless)
   {
-    FPS_CALC_BEGIN;
-    seg_.setInputCloud (cloud);
-    seg_.segment (inliers, coefficients);
-    FPS_CALC_END("planeSegmentation");
+    signal (SIGINT, requestStop);
+    signal (SIGTERM, requestStop);
   }
-
-  void planeProjection (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
-                        Cloud &result,
-                        const pcl::ModelCoefficients::ConstPtr &coefficients)
+  pcl::console::parse_argument (argc, argv, "-poses", options.pose_target);
+  std::string recording;
+  pcl::console::parse_argument (argc, argv, "-replay", recording);
+  pcl::console::parse_argument (argc, argv, "-record", options.record_file);
+  options.record_raw = pcl::console::find_switch (argc, argv, "-record_raw");
+  for (int i = 1; i < argc; i++)
   {
-    FPS_CALC_BEGIN;
-    pcl::ProjectInliers<pcl::PointXYZRGB> proj;
-    proj.setModelType (pcl::SACMODEL_PLANE);
-    proj.setInputCloud (cloud);
-    proj.setModelCoefficients (coefficients);
-    proj.filter (result);
-    FPS_CALC_END("planeProjection");
+    if (std::string (argv[i]) != "-sensor")
+      continue;
+    Eigen::Matrix4f extrinsics;
+    if (i + 2 >= argc || !OpenNISegmentTracking<pcl::PointXYZRGB>::loadExtrinsics (argv[i + 2], extrinsics))
+    {
+      PCL_ERROR ("-sensor needs a source and an extrinsics file\n");
+      usage (argv);
+      return (1);
+    }
+    options.sensor_sources.push_back (argv[i + 1]);
+    options.sensor_extrinsics.push_back (extrinsics);
+    i += 2;
   }
 
-  void convexHull (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
-                   Cloud &result,
-                   std::vector<pcl::Vertices> &hull_vertices)
+  int coherence_repetitions = 0;
+  if (pcl::console::parse_argument (argc, argv, "-bench_coherence", coherence_repetitions) > 0)
   {
-    FPS_CALC_BEGIN;
-    pcl::ConvexHull<pcl::PointXYZRGB> chull;
-    chull.setInputCloud (cloud);
-    chull.reconstruct (*cloud_hull_, hull_vertices);
-    FPS_CALC_END("convexHull");
+    if (pcd_files.size () < 2 || coherence_repetitions <= 0)
+    {
+      PCL_ERROR ("-bench_coherence needs a positive count and at least two replay frames\n");
+      usage (argv);
+      return (1);
+    }
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setWorkerThreads (parameters.threads, pin);
+    v.setReplaySource (pcd_files, 0.0f, false);
+    v.setPipelined (false);
+    v.setFusedPreprocessing (!options.unfused);
+    v.setProjectiveCoherence (options.projective);
+    v.setMultiResolution (options.pyramid);
+    v.setCompactTarget (options.compact);
+    v.setSearchRadius (options.search_radius);
+    v.benchmarkCoherence (coherence_repetitions);
+    return (0);
   }
 
-  void normalEstimation (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud,
-                         pcl::PointCloud<pcl::Normal> &result)
+  int clustering_repetitions = 0;
+  if (pcl::console::parse_argument (argc, argv, "-bench_clustering", clustering_repetitions) > 0)
   {
-    FPS_CALC_BEGIN;
-    ne_.setInputCloud (cloud);
-    ne_.compute (result);
-    FPS_CALC_END("normalEstimation");
+    if (pcd_files.empty () || clustering_repetitions <= 0)
+    {
+      PCL_ERROR ("-bench_clustering needs a positive count and replay frames\n");
+      usage (argv);
+      return (1);
+    }
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setWorkerThreads (parameters.threads, pin);
+    v.setReplaySource (pcd_files, 0.0f, false);
+    v.setPipelined (false);
+    v.setFusedPreprocessing (!options.unfused);
+    v.benchmarkClustering (clustering_repetitions);
+    return (0);
   }
-  
-  void tracking (const pcl::PointCloud<pcl::PointXYZRGBNormal>::ConstPtr &cloud)
+
+  int downsample_repetitions = 0;
+  if (pcl::console::parse_argument (argc, argv, "-bench_downsample", downsample_repetitions) > 0)
   {
-    FPS_CALC_BEGIN;
-    tracker_->setInputCloud (cloud);
-    tracker_->compute ();
-    FPS_CALC_END("tracking");
+    if (pcd_files.empty () || downsample_repetitions <= 0)
+    {
+      PCL_ERROR ("-bench_downsample needs a positive count and replay frames\n");
+      usage (argv);
+      return (1);
+    }
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setReplaySource (pcd_files, 0.0f, false);
+    v.setTemporalSmoothing (options.temporal_window);
+    v.benchmarkDownsampling (downsample_repetitions);
+    return (0);
   }
 
-  void addNormalToCloud (const CloudConstPtr &cloud,
-                         const pcl::PointCloud<pcl::Normal>::ConstPtr &normals,
-                         RefCloud &result)
+  int search_repetitions = 0;
+  if (pcl::console::parse_argument (argc, argv, "-bench_search", search_repetitions) > 0)
+  {
+    if (pcd_files.empty () || search_repetitions <= 0)
     {
-      result.width = cloud->width;
-      result.height = cloud->height;
-      result.is_dense = cloud->is_dense;
-      for (size_t i = 0; i < cloud->points.size (); i++)
-      {
-        pcl::PointXYZRGBNormal point;
-        point.x = cloud->points[i].x;
-        point.y = cloud->points[i].y;
-        point.z = cloud->points[i].z;
-        point.rgb = cloud->points[i].rgb;
-        point.normal[0] = normals->points[i].normal[0];
-        point.normal[1] = normals->points[i].normal[1];
-        point.normal[2] = normals->points[i].normal[2];
-        result.points.push_back (point);
-      }
+      PCL_ERROR ("-bench_search needs a positive count and replay frames\n");
+      usage (argv);
+      return (1);
     }
-  
-  void
-  cloud_cb (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr &cloud)
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setReplaySource (pcd_files, 0.0f, false);
+    v.setSearchRadius (options.search_radius);
+    v.benchmarkSearch (search_repetitions);
+    return (0);
+  }
+
+  bool bench = pcl::console::find_switch (argc, argv, "-bench");
+  std::string sweep_spec;
+  if (pcl::console::parse_argument (argc, argv, "-sweep", sweep_spec) > 0)
   {
-    boost::mutex::scoped_lock lock (mtx_);
-    FPS_CALC_BEGIN;
-    cloud_pass_.reset (new Cloud);
-    pcl::ModelCoefficients::Ptr coefficients (new pcl::ModelCoefficients ());
-    pcl::PointIndices::Ptr inliers (new pcl::PointIndices ());
-    filterPassThrough (cloud, *cloud_pass_);
-    cloud_pass_downsampled_.reset (new Cloud);
-    gridSample (cloud_pass_, *cloud_pass_downsampled_);
-    
-     if (firstp_)
+    std::vector<TrackingParameters> grid;
+    TrackingParameters base = parameters;
+    if (base.threads == 0)
+      base.threads = 2;
+    if ((pcd_files.empty () && recording.empty ()) || !base.expand (sweep_spec, grid))
     {
-      planeSegmentation (cloud_pass_downsampled_, *coefficients, *inliers);
-      if (inliers->indices.size () > 3)
-      {
-        CloudPtr cloud_projected (new Cloud ());
-        planeProjection (cloud_pass_downsampled_, *cloud_projected, coefficients);
-        
-        cloud_hull_.reset (new Cloud);
-        convexHull (cloud_projected, *cloud_hull_, hull_vertices_);
-          
-        plane_trans_ = estimatePlaneCoordinate(cloud_hull_);
-        
-        // setup offset to tracker_
-        Eigen::Affine3f affine_plane = Eigen::Affine3f (plane_trans_);
-        //std::cout << "trans: " << plane_trans_ << std::endl; //debug
-        Eigen::Affine3f offset = Eigen::Affine3f::Identity ();
-        offset = Eigen::Translation3f (0.0, 1.0, 0.0);
-        tracker_->setTrans (Eigen::Affine3f::Identity ());
-        //tracker_->setTrans (affine_plane * offset);
-        pcl::PointIndices::Ptr inliers_polygon (new pcl::PointIndices ());
-        pcl::ExtractPolygonalPrismData<pcl::PointXYZRGB> polygon_extract;
-        nonplane_cloud_.reset (new Cloud);
-        
-        polygon_extract.setHeightLimits (0.01, 10.0);
-        polygon_extract.setInputPlanarHull (cloud_hull_);
-        polygon_extract.setInputCloud (cloud_pass_downsampled_);
-        polygon_extract.segment (*inliers_polygon);
-        
-        extract_positive_.setInputCloud (cloud_pass_downsampled_);
-        extract_positive_.setIndices (inliers_polygon);
-      
-        extract_positive_.filter (*nonplane_cloud_);
-        
-        std::vector<pcl::PointIndices> cluster_indices;
-        euclideanSegment (nonplane_cloud_, cluster_indices);
-        std::cout << "clusters: " << cluster_indices.size () << std::endl;
-        
-        // select segment randomly
-        int segment_index = rand () % cluster_indices.size ();
-        std::cout << "segmented_cloud: " << segment_index << std::endl;
-        pcl::PointIndices segmented_indices = cluster_indices[segment_index];
-        segmented_cloud_.reset (new Cloud);
-        for (size_t i = 0; i < segmented_indices.indices.size (); i++)
-        {
-          pcl::PointXYZRGB point = nonplane_cloud_->points[segmented_indices.indices[i]];
-          segmented_cloud_->points.push_back (point);
-        }
-        segmented_cloud_->width = segmented_cloud_->points.size ();
-        segmented_cloud_->height = 1;
-        segmented_cloud_->is_dense = true;
-
-        pcl::PointCloud<pcl::Normal>::Ptr normals (new pcl::PointCloud<pcl::Normal>);
-        normalEstimation (segmented_cloud_, *normals);
-        RefCloudPtr ref_cloud (new RefCloud);
-        addNormalToCloud (segmented_cloud_, normals, *ref_cloud);
-        // initialie tracker
-        tracker_->setReferenceCloud (ref_cloud);
-        tracker_->setMinIndices (ref_cloud->points.size () / 2);
-        firstp_ = false;
-      }}
-     else
-     {
-        normals_.reset (new pcl::PointCloud<pcl::Normal>);
-        normalEstimation (cloud_pass_downsampled_, *normals_);
-        pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr tracking_cloud (new pcl::PointCloud<pcl::PointXYZRGBNormal> ());
-        tracking_cloud->width = cloud_pass_downsampled_->width;
-        tracking_cloud->height = cloud_pass_downsampled_->height;
-        tracking_cloud->is_dense = cloud_pass_downsampled_->is_dense;
-        for (size_t i = 0; i < cloud_pass_downsampled_->points.size (); i++)
-      {
-        pcl::PointXYZRGBNormal point;
-        point.x = cloud_pass_downsampled_->points[i].x;
-        point.y = cloud_pass_downsampled_->points[i].y;
-        point.z = cloud_pass_downsampled_->points[i].z;
-        point.rgb = cloud_pass_downsampled_->points[i].rgb;
-        point.normal[0] = normals_->points[i].normal[0];
-        point.normal[1] = normals_->points[i].normal[1];
-        point.normal[2] = normals_->points[i].normal[2];
-        tracking_cloud->points.push_back (point);
-      }
-      pcl::PointCloud<pcl::PointXYZRGBNormal>::ConstPtr tracking_const_ptr = tracking_cloud;
-      tracking (tracking_cloud);
-     }
-     new_cloud_ = true;
-     FPS_CALC_END("computation");
+      PCL_ERROR ("-sweep needs replay frames and a parameter grid\n");
+      usage (argv);
+      return (1);
+    }
+    int max_threads = 0;
+    for (size_t i = 0; i < grid.size (); i++)
+      max_threads = std::max (max_threads, grid[i].threads > 0 ? grid[i].threads
+                                                               : static_cast<int> (OpenNISegmentTracking<pcl::PointXYZRGB>::defaultWorkerNum ()));
+    // the preprocessing and the tracking thread come on top of the workers
+    int jobs = std::max (1, static_cast<int> (boost::thread::hardware_concurrency ()) / (max_threads + 2));
+    pcl::console::parse_argument (argc, argv, "-jobs", jobs);
+    std::string sweep_dir = "sweep", reference_file;
+    pcl::console::parse_argument (argc, argv, "-sweep_dir", sweep_dir);
+    pcl::console::parse_argument (argc, argv, "-reference", reference_file);
+    std::cout << grid.size () << " configurations, " << std::max (1, jobs) << " at a time" << std::endl;
+    ParameterSweep sweep (grid, sweep_dir, jobs);
+    const int config = sweep.run ();
+    if (config < 0)
+      return (sweep.report (reference_file) ? 0 : 1);
+    // a child benchmarks its configuration; concurrent ones would pin their
+    // workers to the same CPUs, and would share the files they write
+    parameters = grid[config];
+    options.pose_target = sweep.getPath (config, ".poses");
+    options.statistics_file = sweep.getPath (config, ".csv");
+    pin = pin && jobs <= 1;
+    options.record_file.clear ();
+    options.save_model_file.clear ();
+    bench = true;
   }
-      
-  Eigen::Matrix4f 
-  estimatePlaneCoordinate (CloudPtr cloud_hull)
+
+  if (bench)
   {
-    if (cloud_hull->points.size() >= 3)
+    if (pcd_files.empty () && recording.empty ())
     {
-      Eigen::Vector3f BA (cloud_hull->points[0].x - cloud_hull->points[1].x,
-                          cloud_hull->points[0].y - cloud_hull->points[1].y,
-                          cloud_hull->points[0].z - cloud_hull->points[1].z);
-      Eigen::Vector3f BC (cloud_hull->points[2].x - cloud_hull->points[1].x,
-                          cloud_hull->points[2].y - cloud_hull->points[1].y,
-                          cloud_hull->points[2].z - cloud_hull->points[1].z);
-      Eigen::Vector3f z = BC.cross (BA);
-      z.normalize ();
-      // check the direction of z
-      
-      Eigen::Vector3f B (cloud_hull->points[1].x, cloud_hull->points[1].y, cloud_hull->points[1].z);
-      if (B.dot (z) > 0)
-        z = - z;
-      
-      // calc x, y
-      Eigen::Vector3f xx = BA;
-      // check the direction of xx
-      if (xx.dot (Eigen::Vector3f (1, 0, 0)) < 0)
-        xx = -xx;
-      xx.normalize ();
-      Eigen::Vector3f yy = z.cross (xx);
-      yy.normalize ();
-      Eigen::Vector3f ux (1.0, 0.0, 0.0);
-      double tmp = ux.dot (yy) / ux.dot (xx);
-      double beta2 = 1 / (1 + tmp * tmp);
-      double beta = sqrt (beta2);
-      double alpha = - beta * tmp;
-      Eigen::Vector3f y = alpha * xx + beta * yy;
-      Eigen::Vector3f x = y.cross (z);
-      x.normalize ();
-      y.normalize ();
-      
-      Eigen::Matrix4f ret = Eigen::Matrix4f::Identity ();
-      
-      // fill rotation
-      for (int i = 0; i < 3; i++)
-      {
-        ret(i, 0) = x[i];
-        ret(i, 1) = y[i];
-        ret(i, 2) = z[i];
-      }
-      
-      Eigen::Vector3f OB (cloud_hull->points[1].x, cloud_hull->points[1].y, cloud_hull->points[1].z);
-      double yscale = - OB.dot (y);
-      double xscale = - OB.dot (x);
-      Eigen::Vector3f position = OB + yscale * y + xscale * x;
-        
-      for (int i = 0; i < 3; i++)
-        ret (i, 3) = position[i];
-        
-      return ret;
+      PCL_ERROR ("-bench needs replay frames\n");
+      usage (argv);
+      return (1);
     }
-    return Eigen::Matrix4f::Identity ();
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setWorkerThreads (parameters.threads, pin);
+    v.setReplaySource (pcd_files, 0.0f, false);
+    if (!recording.empty ())
+      v.setRecordingSource (recording, 0.0f, false);
+    configure (v, options);
+    v.benchmark ();
+    return (0);
   }
-  
-  void
-  run ()
+
+  if (!pcd_files.empty () || !recording.empty ())
   {
-    // send PCD to tracker_
-    // tracker_->setReferenceCloud (ref_cloud_downsampled);
-    // tracker_->setMinIndices (ref_cloud_downsampled->points.size () / 2);
-    
-    pcl::Grabber* interface = new pcl::OpenNIGrabber (device_id_);
-    boost::function<void (const pcl::PointCloud<pcl::PointXYZRGB>::ConstPtr&)> f =
-      boost::bind (&OpenNISegmentTracking::cloud_cb, this, _1);
-    interface->registerCallback (f);
-    
-    viewer_.runOnVisualizationThread (boost::bind(&OpenNISegmentTracking::viz_cb, this, _1), "viz_cb");
-    
-    interface->start ();
-      
-    while (!viewer_.wasStopped ())
-      boost::this_thread::sleep(boost::posix_time::seconds(1));
-    interface->stop ();
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setWorkerThreads (parameters.threads, pin);
+    if (recording.empty ())
+    {
+      PCL_INFO ("replaying %d frames.\n", static_cast<int> (pcd_files.size ()));
+      v.setReplaySource (pcd_files, fps, loop);
+    }
+    else
+    {
+      PCL_INFO ("replaying %s.\n", recording.c_str ());
+      v.setRecordingSource (recording, fps, loop);
+    }
+    configure (v, options);
+    v.run ();
+    return (0);
   }
-  
-  pcl::PassThrough<PointType> pass_;
-  pcl::VoxelGrid<PointType> grid_;
-  //pcl::ApproximateVoxelGrid<PointType> grid_;
-  pcl::SACSegmentation<PointType> seg_;
-  pcl::ExtractIndices<PointType> extract_positive_;
-  
-  pcl::visualization::CloudViewer viewer_;
-  pcl::PointCloud<pcl::Normal>::Ptr normals_;
-  CloudPtr cloud_pass_;
-  CloudPtr cloud_pass_downsampled_;
-  CloudPtr plane_cloud_;
-  CloudPtr nonplane_cloud_;
-  CloudPtr cloud_hull_;
-  CloudPtr segmented_cloud_;
-  
-  std::vector<pcl::Vertices> hull_vertices_;
-  Eigen::Matrix4f plane_trans_;
-  
-  std::string device_id_;
-  boost::mutex mtx_;
-  int sensor_view, reference_view;
-  bool new_cloud_;
-  pcl::NormalEstimationOMP<PointType, pcl::Normal> ne_;
-  //pcl::IntegralImageNormalEstimation<PointType, pcl::Normal> ne_;
-  boost::shared_ptr<ParticleFilter> tracker_;
-  bool firstp_;
-};
-
-void
-usage (char** argv)
-{
-  std::cout << "usage: " << argv[0] << " <device_id> <pcd_file> <options>\n\n";
-}
-
-int
-main (int argc, char** argv)
-{
-  
-  std::string device_id = std::string (argv[1]);
 
   // open kinect
   pcl::OpenNIGrabber grabber ("");
   if (grabber.providesCallback<pcl::OpenNIGrabber::sig_cb_openni_point_cloud_rgb> ())
   {
     PCL_INFO ("PointXYZRGB mode enabled.\n");
-    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id);
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setWorkerThreads (parameters.threads, pin);
+    configure (v, options);
     v.run ();
   }
   else
   {
     PCL_INFO ("PointXYZ mode enabled.\n");
-    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id);
+    OpenNISegmentTracking<pcl::PointXYZRGB> v (device_id, parameters);
+    v.setWorkerThreads (parameters.threads, pin);
+    configure (v, options);
     v.run ();
   }
   return (0);
 
 }
-